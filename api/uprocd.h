@@ -10,6 +10,7 @@
 typedef int (*uprocd_module_entry_type)();
 UPROCD_EXPORT int uprocd_module_entry();
 
+UPROCD_EXPORT const char * uprocd_module_name();
 UPROCD_EXPORT const char * uprocd_module_directory();
 UPROCD_EXPORT char * uprocd_module_path(const char *path);
 UPROCD_EXPORT void uprocd_module_path_free(char *path);
@@ -17,6 +18,11 @@ UPROCD_EXPORT void uprocd_module_path_free(char *path);
 typedef void (*uprocd_exit_handler)(void *userdata);
 UPROCD_EXPORT void uprocd_on_exit(uprocd_exit_handler func, void *userdata);
 
+typedef void (*uprocd_fork_handler)(void *userdata);
+UPROCD_EXPORT void uprocd_on_before_fork(uprocd_fork_handler func, void *userdata);
+UPROCD_EXPORT void uprocd_on_after_fork_parent(uprocd_fork_handler func, void *userdata);
+UPROCD_EXPORT void uprocd_on_after_fork_child(uprocd_fork_handler func, void *userdata);
+
 UPROCD_EXPORT int uprocd_config_present(const char *key);
 UPROCD_EXPORT int uprocd_config_list_size(const char *key);
 UPROCD_EXPORT double uprocd_config_number(const char *key);
@@ -34,5 +40,21 @@ UPROCD_EXPORT void uprocd_context_get_args(uprocd_context *ctx, int *pargc,
                                            char ***pargv);
 UPROCD_EXPORT const char * uprocd_context_get_cwd(uprocd_context *ctx);
 UPROCD_EXPORT const char ** uprocd_context_get_env(uprocd_context *ctx);
+UPROCD_EXPORT void uprocd_context_get_fds(uprocd_context *ctx, int *fds);
+
+typedef int (*uprocd_request_handler)(uprocd_context *ctx, void *userdata);
+UPROCD_EXPORT int uprocd_serve(uprocd_request_handler handler, void *userdata);
+
+typedef struct uprocd_metric uprocd_metric;
+
+UPROCD_EXPORT uprocd_metric * uprocd_metric_counter(const char *name);
+UPROCD_EXPORT uprocd_metric * uprocd_metric_gauge(const char *name);
+UPROCD_EXPORT uprocd_metric * uprocd_metric_histogram(const char *name);
+
+UPROCD_EXPORT void uprocd_metric_counter_add(uprocd_metric *metric,
+                                             unsigned long long value);
+UPROCD_EXPORT void uprocd_metric_gauge_set(uprocd_metric *metric, double value);
+UPROCD_EXPORT void uprocd_metric_histogram_observe(uprocd_metric *metric,
+                                                   double value);
 
 #endif
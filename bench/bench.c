@@ -0,0 +1,232 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "bench.h"
+
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+// Microbenchmarks for uprocd's hot paths. Results are written as JSON, so runs from
+// different commits can be compared by a script.
+
+struct bench {
+  long iterations;
+  double elapsed, resumed;
+  long allocs, resumed_allocs;
+  int paused;
+};
+
+// Allocations are counted by wrapping glibc's allocator, which it allows programs to
+// replace, so benchmarks can report how many they make per operation.
+extern void * __libc_malloc(size_t sz);
+extern void * __libc_calloc(size_t n, size_t sz);
+extern void * __libc_realloc(void *p, size_t sz);
+
+static long g_allocs = 0;
+
+void * malloc(size_t sz) {
+  g_allocs++;
+  return __libc_malloc(sz);
+}
+
+void * calloc(size_t n, size_t sz) {
+  g_allocs++;
+  return __libc_calloc(n, sz);
+}
+
+void * realloc(void *p, size_t sz) {
+  g_allocs++;
+  return __libc_realloc(p, sz);
+}
+
+static struct {
+  const char *filter;
+  int runs;
+  double min_time;
+  sds results;
+  int count;
+} g_bench = { .runs = 5, .min_time = 0.1 };
+
+static double now() {
+  return clock_seconds(CLOCK_MONOTONIC);
+}
+
+long bench_iterations(bench *b) {
+  return b->iterations;
+}
+
+void bench_pause(bench *b) {
+  if (!b->paused) {
+    b->elapsed += now() - b->resumed;
+    b->allocs += g_allocs - b->resumed_allocs;
+    b->paused = 1;
+  }
+}
+
+void bench_resume(bench *b) {
+  if (b->paused) {
+    b->resumed_allocs = g_allocs;
+    b->resumed = now();
+    b->paused = 0;
+  }
+}
+
+static double time_once(bench *b, long iterations, bench_func func, void *data) {
+  b->iterations = iterations;
+  b->elapsed = 0;
+  b->allocs = 0;
+  b->paused = 0;
+  b->resumed_allocs = g_allocs;
+  b->resumed = now();
+  func(b, data);
+  bench_pause(b);
+  return b->elapsed;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+void bench_run(const char *name, sds params, long items, bench_func func, void *data) {
+  if (g_bench.filter && strstr(name, g_bench.filter) == NULL) {
+    sdsfree(params);
+    return;
+  }
+
+  bench b = { .iterations = 0 };
+
+  // Grow the batch until it takes a tenth of the target, then size it from that.
+  long iterations = 1;
+  double elapsed;
+  while ((elapsed = time_once(&b, iterations, func, data)) < g_bench.min_time / 10 &&
+         iterations < (1L << 40)) {
+    iterations *= 10;
+  }
+  if (elapsed < g_bench.min_time) {
+    long scaled = iterations * (g_bench.min_time / (elapsed > 0 ? elapsed : 1e-9));
+    iterations = scaled > iterations ? scaled : iterations;
+  }
+
+  double *ns = newa(double, g_bench.runs);
+  for (int i = 0; i < g_bench.runs; i++) {
+    ns[i] = time_once(&b, iterations, func, data) * 1e9 / iterations;
+  }
+  qsort(ns, g_bench.runs, sizeof(double), compare_doubles);
+  double median = ns[g_bench.runs / 2];
+
+  sds result = sdscatprintf(sdsempty(),
+                            "{\"name\":\"%s\",\"params\":%s,\"iterations\":%ld,"
+                            "\"runs\":%d,\"ns_per_op\":%.1f,\"min_ns_per_op\":%.1f,"
+                            "\"max_ns_per_op\":%.1f,\"allocs_per_op\":%.2f", name,
+                            params, iterations, g_bench.runs, median, ns[0],
+                            ns[g_bench.runs - 1], (double)b.allocs / iterations);
+  if (items > 0) {
+    result = sdscatprintf(result, ",\"items_per_op\":%ld,\"ns_per_item\":%.2f", items,
+                          median / items);
+  }
+  result = sdscat(result, "}");
+
+  g_bench.results = sdscatprintf(g_bench.results, "%s\n    %s",
+                                 g_bench.count++ ? "," : "", result);
+  fprintf(stderr, "%-32s %-28s %14.1f ns/op %10.2f allocs/op\n", name, params, median,
+          (double)b.allocs / iterations);
+
+  sdsfree(result);
+  sdsfree(params);
+  free(ns);
+}
+
+sds bench_temp_file(const char *contents, size_t len) {
+  const char *tmpdir = getenv("TMPDIR");
+  sds path = sdscatfmt(sdsempty(), "%s/uprocd-bench.XXXXXX", tmpdir ? tmpdir : "/tmp");
+
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  if (write(fd, contents, len) != (ssize_t)len) {
+    fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  close(fd);
+  return path;
+}
+
+static void usage() {
+  puts("usage: uprocd-bench [-h] [-f filter] [-o output] [-r runs] [-t seconds]");
+}
+
+static void help() {
+  puts("uprocd-bench runs microbenchmarks of uprocd's internals, printing JSON results.");
+  puts("");
+  puts("  -h           Show this screen.");
+  puts("  -f filter    Only run benchmarks whose name contains filter.");
+  puts("  -o output    Write the results to output instead of stdout.");
+  puts("  -r runs      Timed runs per benchmark, of which the median is reported.");
+  puts("  -t seconds   The minimum duration of each timed run.");
+}
+
+int main(int argc, char **argv) {
+  const char *output = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hf:o:r:t:")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage();
+      putchar('\n');
+      help();
+      return 0;
+    case 'f':
+      g_bench.filter = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'r':
+      g_bench.runs = atoi(optarg);
+      break;
+    case 't':
+      g_bench.min_time = atof(optarg);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (g_bench.runs < 1 || !(g_bench.min_time > 0)) {
+    fprintf(stderr, "The run count and duration must be positive.\n");
+    return 1;
+  }
+
+  g_bench.results = sdsempty();
+
+  bench_config();
+  bench_table();
+  bench_lines();
+  // Last, since uprocd_context_enter replaces the environment and standard I/O.
+  bench_env();
+
+  FILE *fp = output ? fopen(output, "w") : stdout;
+  if (fp == NULL) {
+    fprintf(stderr, "Error opening %s: %s\n", output, strerror(errno));
+    return 1;
+  }
+
+  fprintf(fp, "{\n  \"benchmarks\": [%s\n  ]\n}\n", g_bench.results);
+  sdsfree(g_bench.results);
+
+  if (fp != stdout && fclose(fp) != 0) {
+    fprintf(stderr, "Error writing %s: %s\n", output, strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,34 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "common.h"
+
+typedef struct bench bench;
+
+// A benchmark runs bench_iterations() times per call, and is called repeatedly with a
+// growing iteration count until a call takes long enough to time reliably.
+typedef void (*bench_func)(bench *b, void *data);
+
+long bench_iterations(bench *b);
+// Excludes setup and cleanup from the timing.
+void bench_pause(bench *b);
+void bench_resume(bench *b);
+
+// params is a JSON object describing the input, e.g. {"entries":1000}, and items is
+// how many keys, lines, list entries... each iteration processes, so that results can
+// also be compared per item. Takes ownership of params.
+void bench_run(const char *name, sds params, long items, bench_func func, void *data);
+
+// Writes a file with the given contents to a temporary path, which the caller frees.
+sds bench_temp_file(const char *contents, size_t len);
+
+void bench_config();
+void bench_table();
+void bench_lines();
+void bench_env();
+
+#endif
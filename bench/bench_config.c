@@ -0,0 +1,100 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "bench.h"
+#include "private.h"
+
+#include <unistd.h>
+
+// A NativeModule declaring the given number of properties, cycling through every type,
+// with defaults for all of them. Lists have 16 items, and strings span two lines.
+static sds generate_config(int properties) {
+  sds config = sdsnew("[NativeModule]\nNativeLib=bench.so\nDescription=Benchmark\n");
+
+  config = sdscat(config, "\n[Properties]\n");
+  for (int i = 0; i < properties; i++) {
+    static const char *types[] = {"number", "string", "list number", "list string"};
+    config = sdscatfmt(config, "Property%i=%s\n", i, types[i % 4]);
+  }
+
+  config = sdscat(config, "\n[Defaults]\n");
+  for (int i = 0; i < properties; i++) {
+    config = sdscatfmt(config, "Property%i=", i);
+    switch (i % 4) {
+    case 0:
+      config = sdscatfmt(config, "%i\n", i);
+      break;
+    case 1:
+      config = sdscatfmt(config, "value of property %i\n  continued here\n", i);
+      break;
+    default:
+      for (int j = 0; j < 16; j++) {
+        config = sdscatfmt(config, j ? " %i" : "%i", i * 16 + j);
+      }
+      config = sdscat(config, "\n");
+      break;
+    }
+  }
+
+  return config;
+}
+
+static void run_config_parse(bench *b, void *data) {
+  const char *path = data;
+  for (long i = 0; i < bench_iterations(b); i++) {
+    config *cfg = config_parse(path);
+    if (cfg == NULL) {
+      fprintf(stderr, "config_parse failed on %s\n", path);
+      exit(1);
+    }
+    config_free(cfg);
+  }
+}
+
+typedef struct list_data {
+  sds name, value;
+  user_type *type;
+} list_data;
+
+static void run_user_value_parse(bench *b, void *data) {
+  list_data *list = data;
+  for (long i = 0; i < bench_iterations(b); i++) {
+    user_value *usr = user_value_parse(list->name, list->value, list->type);
+    user_value_free(usr);
+  }
+}
+
+void bench_config() {
+  int sizes[] = {16, 256, 4096};
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    sds config = generate_config(sizes[i]);
+    sds path = bench_temp_file(config, sdslen(config));
+
+    bench_run("config_parse", sdscatfmt(sdsempty(), "{\"properties\":%i}", sizes[i]),
+              sizes[i], run_config_parse, path);
+
+    unlink(path);
+    sdsfree(path);
+    sdsfree(config);
+  }
+
+  int lengths[] = {16, 1024, 65536};
+  for (int kind = TYPE_STRING; kind <= TYPE_NUMBER; kind++) {
+    for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+      user_type child = { .kind = kind }, type = { .kind = TYPE_LIST, .child = &child };
+      list_data list = { .name = sdsnew("List"), .value = sdsempty(), .type = &type };
+      for (int j = 0; j < lengths[i]; j++) {
+        list.value = sdscatfmt(list.value, j ? " %i" : "%i", j);
+      }
+
+      bench_run("user_value_parse",
+                sdscatfmt(sdsempty(), "{\"type\":\"list %s\",\"items\":%i}",
+                          kind == TYPE_STRING ? "string" : "number", lengths[i]),
+                lengths[i], run_user_value_parse, &list);
+
+      sdsfree(list.name);
+      sdsfree(list.value);
+    }
+  }
+}
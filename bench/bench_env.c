@@ -0,0 +1,138 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "bench.h"
+#include "private.h"
+#include "uprocd.h"
+
+#include <unistd.h>
+
+extern char **environ;
+
+// Contexts are created ahead of time in batches this size, each holding a few fds.
+#define CONTEXT_BATCH 64
+
+typedef struct env_data {
+  // name/value pairs, as they would be read from a Run message.
+  sds *env;
+  int envc;
+  sds cwd;
+  int fds[3];
+} env_data;
+
+// Everything service_method_run does to turn a request into a context, minus sd-bus,
+// so allocs_per_op is the number of allocations uprocd makes per spawn.
+static uprocd_context * decode_context(env_data *ed) {
+  uprocd_context *ctx = context_new();
+  arena *a = &ctx->arena;
+  context_add_arg(ctx, arena_strdup(a, "uprocd-bench"));
+  context_add_arg(ctx, arena_strdup(a, "--version"));
+  for (int i = 0; i < ed->envc; i++) {
+    context_add_env(ctx, arena_strdup(a, ed->env[i * 2]),
+                    arena_strdup(a, ed->env[i * 2 + 1]));
+  }
+  ctx->cwd = arena_strdup(a, ed->cwd);
+  ctx->pid = getpid();
+  return ctx;
+}
+
+static void run_context_decode(bench *b, void *data) {
+  env_data *ed = data;
+  for (long i = 0; i < bench_iterations(b); i++) {
+    uprocd_context_free(decode_context(ed));
+  }
+}
+
+static void run_context_enter(bench *b, void *data) {
+  env_data *ed = data;
+  uprocd_context *contexts[CONTEXT_BATCH];
+
+  for (long done = 0; done < bench_iterations(b); done += CONTEXT_BATCH) {
+    long batch = bench_iterations(b) - done;
+    if (batch > CONTEXT_BATCH) {
+      batch = CONTEXT_BATCH;
+    }
+
+    bench_pause(b);
+    for (int i = 0; i < batch; i++) {
+      contexts[i] = decode_context(ed);
+      for (int j = 0; j < 3; j++) {
+        contexts[i]->fds[j] = dup(ed->fds[j]);
+      }
+
+      // Tell the context the template already moved it, so it never calls cgrmvd.
+      int moved[2];
+      if (pipe(moved) == -1) {
+        abort();
+      }
+      write(moved[1], "\1", 1);
+      close(moved[1]);
+      contexts[i]->moved_fd = moved[0];
+    }
+    bench_resume(b);
+
+    for (int i = 0; i < batch; i++) {
+      uprocd_context_enter(contexts[i]);
+    }
+
+    bench_pause(b);
+    for (int i = 0; i < batch; i++) {
+      uprocd_context_free(contexts[i]);
+    }
+    bench_resume(b);
+  }
+}
+
+void bench_env() {
+  // uprocd_context_enter replaces the environment, so put the original one back after.
+  int nsaved = 0;
+  while (environ[nsaved]) {
+    nsaved++;
+  }
+  char **saved = newa(char*, nsaved);
+  for (int i = 0; i < nsaved; i++) {
+    saved[i] = strdup(environ[i]);
+  }
+
+  env_data ed;
+  char *cwd = getcwd(NULL, 0);
+  ed.cwd = sdsnew(cwd ? cwd : "/");
+  free(cwd);
+  for (int i = 0; i < 3; i++) {
+    ed.fds[i] = dup(i);
+  }
+
+  int sizes[] = {16, 128, 1024};
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    ed.envc = sizes[i];
+    ed.env = newa(sds, ed.envc * 2);
+    for (int j = 0; j < ed.envc; j++) {
+      ed.env[j * 2] = sdscatfmt(sdsempty(), "UPROCD_BENCH_VARIABLE_%i", j);
+      ed.env[j * 2 + 1] = sdscatfmt(sdsempty(), "/usr/local/share/uprocd/bench/%i", j);
+    }
+
+    #define RUN(name, func) \
+      bench_run(name, sdscatfmt(sdsempty(), "{\"variables\":%i}", sizes[i]), sizes[i], \
+                func, &ed)
+    RUN("context_decode", run_context_decode);
+    RUN("uprocd_context_enter", run_context_enter);
+    #undef RUN
+
+    for (int j = 0; j < ed.envc * 2; j++) {
+      sdsfree(ed.env[j]);
+    }
+    free(ed.env);
+  }
+
+  for (int i = 0; i < 3; i++) {
+    close(ed.fds[i]);
+  }
+  sdsfree(ed.cwd);
+
+  clearenv();
+  for (int i = 0; i < nsaved; i++) {
+    putenv(saved[i]);
+  }
+  free(saved);
+}
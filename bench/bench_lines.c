@@ -0,0 +1,55 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "bench.h"
+
+#include <unistd.h>
+
+#define LINE_READER_LINES 1024
+
+static void run_line_reader(bench *b, void *data) {
+  const char *path = data;
+  for (long i = 0; i < bench_iterations(b); i++) {
+    line_reader lr;
+    if (line_reader_open(&lr, path) < 0) {
+      fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+      exit(1);
+    }
+
+    int lines = 0;
+    while (line_reader_next(&lr, NULL)) {
+      lines++;
+    }
+    if (lines != LINE_READER_LINES) {
+      abort();
+    }
+
+    line_reader_free(&lr);
+  }
+}
+
+void bench_lines() {
+  // Short config lines, long list values, and lines longer than a page.
+  int lengths[] = {40, 200, 4096};
+  for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    sds contents = sdsempty();
+    for (int j = 0; j < LINE_READER_LINES; j++) {
+      for (int k = 0; k < lengths[i]; k++) {
+        contents = sdscatlen(contents, &"abcdefghijklmnopqrstuvwxyz"[(j + k) % 26], 1);
+      }
+      contents = sdscat(contents, "\n");
+    }
+
+    // Opening and reading the file is part of each iteration, as it is for callers.
+    sds path = bench_temp_file(contents, sdslen(contents));
+    bench_run("line_reader",
+              sdscatfmt(sdsempty(), "{\"lines\":%i,\"line_length\":%i}", LINE_READER_LINES,
+                        lengths[i]),
+              LINE_READER_LINES, run_line_reader, path);
+
+    unlink(path);
+    sdsfree(path);
+    sdsfree(contents);
+  }
+}
@@ -0,0 +1,156 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "bench.h"
+
+#ifdef HAVE_JUDY
+#include <Judy.h>
+#endif
+
+typedef struct table_data {
+  int entries;
+  sds *keys;
+  table tbl;
+#ifdef HAVE_JUDY
+  Pvoid_t judy;
+#endif
+} table_data;
+
+static void run_table_add(bench *b, void *data) {
+  table_data *td = data;
+  for (long i = 0; i < bench_iterations(b); i++) {
+    table tbl;
+    table_init(&tbl);
+    for (int j = 0; j < td->entries; j++) {
+      table_add(&tbl, td->keys[j], td->keys[j]);
+    }
+    table_free(&tbl);
+  }
+}
+
+static void run_table_get(bench *b, void *data) {
+  table_data *td = data;
+  for (long i = 0; i < bench_iterations(b); i++) {
+    for (int j = 0; j < td->entries; j++) {
+      if (table_get(&td->tbl, td->keys[j]) != td->keys[j]) {
+        abort();
+      }
+    }
+  }
+}
+
+static void run_table_iter(bench *b, void *data) {
+  table_data *td = data;
+  for (long i = 0; i < bench_iterations(b); i++) {
+    table_cursor cursor = TABLE_CURSOR_INIT;
+    void *value;
+    int seen = 0;
+    while (table_iter(&td->tbl, &cursor, &value)) {
+      seen++;
+    }
+    if (seen != td->entries) {
+      abort();
+    }
+  }
+}
+
+#ifdef HAVE_JUDY
+// The same operations on a JudySL array, as the table used to be implemented, so the
+// two can be compared in one run. judy_next copies each key, as callers of the old
+// table_next had to.
+
+static void run_judy_add(bench *b, void *data) {
+  table_data *td = data;
+  for (long i = 0; i < bench_iterations(b); i++) {
+    Pvoid_t judy = NULL;
+    Word_t *pvalue;
+    for (int j = 0; j < td->entries; j++) {
+      JSLI(pvalue, judy, (const uint8_t*)td->keys[j]);
+      *pvalue = (Word_t)td->keys[j];
+    }
+    JudySLFreeArray(&judy, PJE0);
+  }
+}
+
+static void run_judy_get(bench *b, void *data) {
+  table_data *td = data;
+  for (long i = 0; i < bench_iterations(b); i++) {
+    for (int j = 0; j < td->entries; j++) {
+      Word_t *pvalue;
+      JSLG(pvalue, td->judy, (const uint8_t*)td->keys[j]);
+      if (pvalue == NULL || (sds)*pvalue != td->keys[j]) {
+        abort();
+      }
+    }
+  }
+}
+
+static void run_judy_next(bench *b, void *data) {
+  table_data *td = data;
+  for (long i = 0; i < bench_iterations(b); i++) {
+    uint8_t idx[4096];
+    Word_t *pvalue;
+    char *key = NULL;
+    int seen = 0;
+
+    idx[0] = 0;
+    JSLF(pvalue, td->judy, idx);
+    while (pvalue) {
+      free(key);
+      key = strdup((char*)idx);
+      seen++;
+      JSLN(pvalue, td->judy, idx);
+    }
+    free(key);
+
+    if (seen != td->entries) {
+      abort();
+    }
+  }
+}
+#endif
+
+void bench_table() {
+  // A module's properties, a typical environment, a large one, and far more than
+  // either ever has.
+  int sizes[] = {16, 64, 256, 4096};
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    // Shaped like environment variable names, the most common keys.
+    table_data td = { .entries = sizes[i], .keys = newa(sds, sizes[i]) };
+    table_init(&td.tbl);
+    for (int j = 0; j < td.entries; j++) {
+      td.keys[j] = sdscatfmt(sdsempty(), "UPROCD_BENCH_VARIABLE_%i", j);
+      table_add(&td.tbl, td.keys[j], td.keys[j]);
+    }
+
+    #define RUN(name, func) \
+      bench_run(name, sdscatfmt(sdsempty(), "{\"entries\":%i}", td.entries), td.entries, \
+                func, &td)
+    RUN("table_add", run_table_add);
+    RUN("table_get", run_table_get);
+    RUN("table_iter", run_table_iter);
+
+#ifdef HAVE_JUDY
+    td.judy = NULL;
+    for (int j = 0; j < td.entries; j++) {
+      Word_t *pvalue;
+      JSLI(pvalue, td.judy, (const uint8_t*)td.keys[j]);
+      *pvalue = (Word_t)td.keys[j];
+    }
+
+    RUN("judy_add", run_judy_add);
+    RUN("judy_get", run_judy_get);
+    RUN("judy_next", run_judy_next);
+
+    JudySLFreeArray(&td.judy, PJE0);
+#endif
+    #undef RUN
+
+    table_free(&td.tbl);
+    for (int j = 0; j < td.entries; j++) {
+      sdsfree(td.keys[j]);
+    }
+    free(td.keys);
+  }
+}
@@ -29,18 +29,26 @@ def arguments(parser):
                        action='store_true', default=False)
     group.add_argument('--pkg-config', help='Use the given pkg-config executable')
     group.add_argument('--ruby', help='Use the given Ruby binary')
+    group.add_argument('--perl', help='Use the given Perl binary')
+    group.add_argument('--lua', help='Use the given pkg-config package for Lua')
     group.add_argument('--mrkd', help='Use the given mrkd executable')
     group.add_argument('--destdir', help='Set the installation destdir', default='/')
     group.add_argument('--prefix', help='Set the installation prefix', default='usr')
     group.add_argument('--auto-service',
                        help='Automatically stop services before installation',
                        action='store_true', default=False)
+    group.add_argument('--bench-filter',
+                       help='Only run the benchmarks whose name contains the given text')
 
 
 class Judy(Test):
     Judy_h = header_test('Judy.h')
 
 
+class Sdt(Test):
+    sdt_h = header_test('sys/sdt.h')
+
+
 class MrkdBuilder(fbuild.db.PersistentObject):
     def __init__(self, ctx, exe=None):
         self.ctx = ctx
@@ -75,6 +83,25 @@ def ruby_version(ctx, ruby_bin):
     return m.group(1)
 
 
+@fbuild.db.caches
+def perl_embed_flags(ctx, perl_bin):
+    ctx.logger.check('checking how to embed %s' % perl_bin)
+
+    try:
+        cflags, _ = ctx.execute([perl_bin, '-MExtUtils::Embed', '-e', 'ccopts'],
+                                quieter=1)
+        ldlibs, _ = ctx.execute([perl_bin, '-MExtUtils::Embed', '-e', 'ldopts'],
+                                quieter=1)
+    except fbuild.ExecutionError:
+        ctx.logger.failed()
+        return None
+
+    rec = Record(cflags=cflags.decode('utf-8').split(),
+                 ldlibs=ldlibs.decode('utf-8').split())
+    ctx.logger.passed(' '.join(rec.cflags + rec.ldlibs))
+    return rec
+
+
 @fbuild.db.caches
 def run_pkg_config(ctx, package):
     ctx.logger.check('checking for %s' % package)
@@ -110,6 +137,8 @@ def print_config(ctx, rec):
     print('C compiler flags:', ' '.join(set(rec.c.static.compiler.flags)))
     print('C linker flags:', ' '.join(set(rec.c.static.exe_linker.flags)))
     optprint('Build docs:', rec.mrkd)
+    optprint('USDT probes:', rec.sdt)
+    optprint('Judy benchmarks:', rec.judy)
 
     print()
     padprint('=', 'Modules')
@@ -117,6 +146,8 @@ def print_config(ctx, rec):
 
     optprint('Python module:', rec.python3)
     optprint('Ruby module:', rec.ruby)
+    optprint('Perl module:', rec.perl)
+    optprint('Lua module:', rec.lua)
     print()
 
 
@@ -163,13 +194,30 @@ def _configure(ctx, print_):
         if ruby_ver is not None:
             ruby = run_pkg_config(ctx, 'ruby-%s' % ruby_ver)
 
+    perl = None
+    try:
+        perl_bin = ctx.options.perl or find_program(ctx, ['perl'])
+    except fbuild.ConfigFailed:
+        pass
+    else:
+        perl = perl_embed_flags(ctx, perl_bin)
+
+    # Prefer LuaJIT, then the newest PUC Lua, under the names distros commonly use.
+    lua = None
+    for package in ([ctx.options.lua] if ctx.options.lua else
+                    ['luajit', 'lua5.4', 'lua-5.4', 'lua5.3', 'lua-5.3', 'lua']):
+        lua = run_pkg_config(ctx, package)
+        if lua is not None:
+            break
+
     try:
         mrkd = MrkdBuilder(ctx, ctx.options.mrkd)
     except fbuild.ConfigFailed:
         mrkd = None
 
-    if not Judy(c.static).Judy_h:
-        raise fbuild.ConfigFailed('Judy is required.')
+    # Only used by the benchmarks, to compare the table against.
+    judy = bool(Judy(c.static).Judy_h)
+    sdt = bool(Sdt(c.static).sdt_h)
 
     try:
         systemctl = find_program(ctx, ['systemctl'])
@@ -177,7 +225,8 @@ def _configure(ctx, print_):
         systemctl = None
 
     rec = Record(c=c, libsystemd=libsystemd, python3=python3, ruby_bin=ruby_bin,
-                 ruby=ruby, mrkd=mrkd, systemctl=systemctl)
+                 ruby=ruby, perl=perl, lua=lua, mrkd=mrkd, systemctl=systemctl, sdt=sdt,
+                 judy=judy)
     if print_:
         print_config(ctx, rec)
     return rec
@@ -242,19 +291,15 @@ def build_docs(ctx, src, *, rec, index):
     return Record(man=man, html=html)
 
 
-def build(ctx):
-    rec = _configure(ctx, print_=True)
-    ctx.install_destdir = ctx.options.destdir
-    ctx.install_prefix = ctx.options.prefix
-
+def build_common(ctx, rec):
     sds = rec.c.static.build_lib('sds', ['sds/sds.c'])
 
     common_kw = dict(
         includes=['api', 'sds', 'src/common'],
         cflags=['-fvisibility=hidden'] + rec.libsystemd.cflags,
         ldlibs=['-Wl,--export-dynamic'] + rec.libsystemd.ldlibs,
-        external_libs=['Judy'],
         libs=[sds],
+        macros=['HAVE_SYS_SDT_H'] if rec.sdt else [],
     )
 
     common = rec.c.static.build_lib('common', Path.glob('src/common/*.c'), **common_kw)
@@ -263,18 +308,39 @@ def build(ctx):
     common_kw = common_kw.copy()
     common_kw['libs'] = common_kw['libs'] + [common]
 
+    # uprocd_serve runs requests on a pool of worker threads.
+    uprocd_kw = common_kw.copy()
+    uprocd_kw['external_libs'] = ['pthread', 'm']
+
+    return common_kw, uprocd_kw
+
+
+def build(ctx):
+    rec = _configure(ctx, print_=True)
+    ctx.install_destdir = ctx.options.destdir
+    ctx.install_prefix = ctx.options.prefix
+
+    common_kw, uprocd_kw = build_common(ctx, rec)
+
     cgrmvd = rec.c.static.build_exe('cgrmvd', Path.glob('src/cgrmvd/*.c'), **common_kw)
-    uprocd = rec.c.static.build_exe('uprocd', Path.glob('src/uprocd/*.c'), **common_kw)
+    uprocd = rec.c.static.build_exe('uprocd', Path.glob('src/uprocd/*.c'), **uprocd_kw)
     uprocctl = rec.c.static.build_exe('uprocctl', Path.glob('src/uprocctl/*.c'),
                                       **common_kw)
     u = symlink(ctx, uprocctl, 'u')
+    load = rec.c.static.build_exe('uprocd-load', Path.glob('src/uprocd-load/*.c'),
+                                  **common_kw)
 
     modules = [
         Module(name='python', pkg=rec.python3, sources='python.c',
-               others=['ipython', 'mrkd', 'mypy'], files=['_uprocd_modules.py'],
+               others=['ipython', 'mrkd', 'mypy'], files=['_uprocd_profile.py'],
                links=['upython', 'uipython', 'umrkd', 'umypy']),
         Module(name='ruby', pkg=rec.ruby, sources='ruby.c', others=[],
-               files=['_uprocd_requires.rb'], links=['uruby']),
+               files=['_uprocd_requires.rb', '_uprocd_iseq.rb'], links=['uruby']),
+        Module(name='perl', pkg=rec.perl, sources='perl.c', others=[],
+               files=['_uprocd_serve.pm'], links=['uperl']),
+        Module(name='lua', pkg=rec.lua, sources='lua.c', others=[], files=[],
+               links=['ulua']),
+        Module(name='elf', sources='elf.c', others=[], files=[], links=[]),
     ]
 
     module_outputs = ctx.scheduler.map(
@@ -294,12 +360,15 @@ def build(ctx):
 
     ctx.install(cgrmvd, 'share/uprocd/bin')
     ctx.install(uprocd, 'share/uprocd/bin')
+    ctx.install(load, 'share/uprocd/bin')
     ctx.install(uprocctl, 'bin')
     ctx.install(u, 'bin')
 
     ctx.install('misc/uprocd@.service', 'lib/systemd/user')
     ctx.install('misc/cgrmvd.service', 'lib/systemd/system')
+    ctx.install('misc/cgrmvd.socket', 'lib/systemd/system')
     ctx.install('misc/uprocd.policy', 'share/cgrmvd/policies')
+    ctx.install('misc/uprocd-spawn.bt', 'share/uprocd')
     ctx.install('misc/com.refi64.uprocd.Cgrmvd.conf', '/etc/dbus-1/system.d')
 
     for i, output in enumerate(module_outputs):
@@ -322,6 +391,52 @@ def build(ctx):
         ctx.install(page.man, 'share/man/man%s' % section, rename=rename)
 
 
+@register()
+def bench(ctx):
+    '''Build and run the microbenchmarks, writing the results to bench.json.'''
+    rec = _configure(ctx, print_=False)
+    _, uprocd_kw = build_common(ctx, rec)
+
+    # The benchmarks call straight into uprocd's internals, so link everything but its
+    # main().
+    bench_kw = uprocd_kw.copy()
+    bench_kw['includes'] = uprocd_kw['includes'] + ['src/uprocd']
+    if rec.judy:
+        bench_kw['macros'] = uprocd_kw['macros'] + ['HAVE_JUDY']
+        bench_kw['external_libs'] = uprocd_kw['external_libs'] + ['Judy']
+    sources = [src for src in Path.glob('src/uprocd/*.c') if src.basename() != 'main.c']
+    exe = rec.c.static.build_exe('uprocd-bench', Path.glob('bench/*.c') + sources,
+                                 **bench_kw)
+
+    output = ctx.buildroot / 'bench.json'
+    args = [exe, '-o', output]
+    if ctx.options.bench_filter:
+        args += ['-f', ctx.options.bench_filter]
+
+    _, stderr = ctx.execute(args, msg1='bench', msg2=output, color='compile')
+    print(stderr.decode('utf-8'), end='')
+
+
+@register()
+def load(ctx):
+    '''Run uprocd-load against the noop module on a private bus, writing load.json.'''
+    rec = _configure(ctx, print_=False)
+    common_kw, uprocd_kw = build_common(ctx, rec)
+
+    uprocd = rec.c.static.build_exe('uprocd', Path.glob('src/uprocd/*.c'), **uprocd_kw)
+    load = rec.c.static.build_exe('uprocd-load', Path.glob('src/uprocd-load/*.c'),
+                                  **common_kw)
+    # Only ever used from the build tree, so it's never installed.
+    build_module(ctx, Module(name='noop', sources='noop.c', others=[], files=[],
+                             links=[]), rec=rec, uprocctl=None)
+
+    output = ctx.buildroot / 'load.json'
+    stdout, _ = ctx.execute([load, '-j', '-u', uprocd, '-m', ctx.buildroot / 'modules',
+                             'noop'], msg1='uprocd-load', msg2=output, color='compile')
+    with open(output, 'wb') as fp:
+        fp.write(stdout)
+
+
 def pre_install(ctx):
     if ctx.options.auto_service:
         rec = _configure(ctx, print_=False)
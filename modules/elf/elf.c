@@ -0,0 +1,592 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define _GNU_SOURCE
+
+#include "uprocd.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Loads a position-independent executable into the template with dlopen, so its
+// dynamic linking and static constructors happen once, then calls its main in every
+// child.
+//
+// Two things keep a PIE from working as a plain shared object. glibc refuses to dlopen
+// anything flagged DF_1_PIE, so the program is loaded from an in-memory copy with the
+// flag cleared. And the PIE's code accesses variables like optind, environ and stdout
+// through copy relocations: it has private copies that only the main executable's
+// copies would normally be redirected to. Before calling main, every other object's GOT
+// entries for those variables are pointed at the PIE's copies, which is what ld.so would
+// have done had the PIE been the main executable.
+//
+// Loading from a copy means ld.so only sees /proc/self/fd/N as the program's path, and
+// would expand $ORIGIN in its RUNPATH against that. The program's direct dependencies
+// are therefore loaded beforehand from its search path as it reads relative to the real
+// program, so ld.so finds them already loaded by soname, and the program's link map is
+// then given its real path back.
+
+#if defined(__x86_64__)
+#define RELOC_COPY R_X86_64_COPY
+#define RELOC_GLOB_DAT R_X86_64_GLOB_DAT
+#define RELOC_ABS R_X86_64_64
+#elif defined(__aarch64__)
+#define RELOC_COPY R_AARCH64_COPY
+#define RELOC_GLOB_DAT R_AARCH64_GLOB_DAT
+#define RELOC_ABS R_AARCH64_ABS64
+#endif
+
+typedef struct copy_reloc {
+  const char *name;
+  void *copy;
+  size_t size;
+} copy_reloc;
+
+typedef struct got_patch {
+  void **slot;
+  void *value;
+  int relro;
+} got_patch;
+
+static struct {
+  void *handle;
+  struct link_map *map;
+  int (*main)(int, char **, char **);
+  copy_reloc *copies;
+  int ncopies;
+  got_patch *patches;
+  int npatches;
+} g_program;
+
+static void * map_file(const char *path, size_t *psize) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= sizeof(Elf64_Ehdr)) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Error mapping %s.\n", path);
+    return NULL;
+  }
+
+  *psize = st.st_size;
+  return data;
+}
+
+static int check_program(const char *path, const Elf64_Ehdr *ehdr, size_t size) {
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+    fprintf(stderr, "%s is not a 64-bit ELF file.\n", path);
+    return -1;
+  } else if (ehdr->e_type != ET_DYN) {
+    fprintf(stderr, "%s is not position-independent; rebuild it with -fPIE -pie.\n",
+            path);
+    return -1;
+  } else if (ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > size) {
+    fprintf(stderr, "%s is truncated.\n", path);
+    return -1;
+  }
+
+  const Elf64_Phdr *phdrs = (const void *)((const char *)ehdr + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    // The program's own thread-local variables would use the local-exec model, which
+    // only works for the main executable.
+    if (phdrs[i].p_type == PT_TLS) {
+      fprintf(stderr, "%s uses thread-local storage, so it can't be preloaded.\n",
+              path);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Clears DF_1_PIE in a writable copy of the program's dynamic section.
+static void clear_pie_flag(char *data, size_t size) {
+  Elf64_Ehdr *ehdr = (Elf64_Ehdr *)data;
+  Elf64_Phdr *phdrs = (Elf64_Phdr *)(data + ehdr->e_phoff);
+
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type != PT_DYNAMIC || phdrs[i].p_offset + phdrs[i].p_filesz > size) {
+      continue;
+    }
+
+    Elf64_Dyn *dyn = (Elf64_Dyn *)(data + phdrs[i].p_offset);
+    for (; (char *)(dyn + 1) <= data + phdrs[i].p_offset + phdrs[i].p_filesz &&
+           dyn->d_tag != DT_NULL; dyn++) {
+      if (dyn->d_tag == DT_FLAGS_1) {
+        dyn->d_un.d_val &= ~DF_1_PIE;
+      }
+    }
+  }
+}
+
+// Maps an address in the program to an offset in its file, or 0 if no segment covers it.
+static size_t vaddr_to_offset(const char *data, size_t size, Elf64_Addr vaddr) {
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)data;
+  const Elf64_Phdr *phdrs = (const Elf64_Phdr *)(data + ehdr->e_phoff);
+
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_LOAD && vaddr >= phdrs[i].p_vaddr &&
+        vaddr < phdrs[i].p_vaddr + phdrs[i].p_filesz) {
+      size_t offset = phdrs[i].p_offset + (vaddr - phdrs[i].p_vaddr);
+      return offset < size ? offset : 0;
+    }
+  }
+
+  return 0;
+}
+
+// Copies one entry of a search path into buf, expanding $ORIGIN and ${ORIGIN}.
+static void expand_origin(const char *dir, size_t len, const char *origin, char *buf,
+                          size_t bufsz) {
+  size_t n = 0;
+  for (size_t i = 0; i < len && n + 1 < bufsz;) {
+    size_t skip = strncmp(dir + i, "${ORIGIN}", 9) == 0 ? 9 :
+                  strncmp(dir + i, "$ORIGIN", 7) == 0 ? 7 : 0;
+    if (skip) {
+      int written = snprintf(buf + n, bufsz - n, "%s", origin);
+      n = written < bufsz - n ? n + written : bufsz - 1;
+      i += skip;
+    } else {
+      buf[n++] = dir[i++];
+    }
+  }
+  buf[n] = '\0';
+}
+
+static int load_needed(const char *path, const char *data, size_t size,
+                       const char *origin) {
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)data;
+  const Elf64_Phdr *phdrs = (const Elf64_Phdr *)(data + ehdr->e_phoff);
+  const Elf64_Dyn *dyns = NULL;
+  size_t ndyns = 0;
+
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_DYNAMIC && phdrs[i].p_offset + phdrs[i].p_filesz <= size) {
+      dyns = (const Elf64_Dyn *)(data + phdrs[i].p_offset);
+      ndyns = phdrs[i].p_filesz / sizeof(Elf64_Dyn);
+    }
+  }
+
+  size_t strtab = 0, strsz = 0, runpath = 0, rpath = 0;
+  int has_runpath = 0, has_rpath = 0;
+  for (size_t i = 0; i < ndyns && dyns[i].d_tag != DT_NULL; i++) {
+    switch (dyns[i].d_tag) {
+    case DT_STRTAB:
+      strtab = vaddr_to_offset(data, size, dyns[i].d_un.d_ptr);
+      break;
+    case DT_STRSZ:
+      strsz = dyns[i].d_un.d_val;
+      break;
+    case DT_RUNPATH:
+      runpath = dyns[i].d_un.d_val;
+      has_runpath = 1;
+      break;
+    case DT_RPATH:
+      rpath = dyns[i].d_un.d_val;
+      has_rpath = 1;
+      break;
+    }
+  }
+
+  // Anything without a search path is found by ld.so the same way either way.
+  if (strtab == 0 || strtab + strsz > size || (!has_runpath && !has_rpath)) {
+    return 0;
+  }
+
+  // ld.so ignores RPATH when RUNPATH is present.
+  const char *strings = data + strtab;
+  size_t search_off = has_runpath ? runpath : rpath;
+  if (search_off >= strsz || memchr(strings + search_off, '\0', strsz - search_off) == NULL) {
+    fprintf(stderr, "%s has a corrupt search path.\n", path);
+    return -1;
+  }
+  const char *search = strings + search_off;
+
+  for (size_t i = 0; i < ndyns && dyns[i].d_tag != DT_NULL; i++) {
+    if (dyns[i].d_tag != DT_NEEDED || dyns[i].d_un.d_val >= strsz) {
+      continue;
+    }
+
+    const char *needed = strings + dyns[i].d_un.d_val;
+    if (memchr(needed, '\0', strsz - dyns[i].d_un.d_val) == NULL ||
+        strchr(needed, '/') != NULL) {
+      continue;
+    }
+
+    for (const char *dir = search; *dir;) {
+      size_t len = strcspn(dir, ":");
+      char expanded[PATH_MAX], lib[PATH_MAX];
+      expand_origin(dir, len, origin, expanded, sizeof(expanded));
+      dir += len + (dir[len] == ':');
+
+      if (snprintf(lib, sizeof(lib), "%s/%s", *expanded ? expanded : ".", needed) >=
+          sizeof(lib) || access(lib, R_OK) == -1) {
+        continue;
+      }
+
+      // The handle is kept open for good, like the program's own.
+      if (dlopen(lib, RTLD_NOW | RTLD_GLOBAL) == NULL) {
+        fprintf(stderr, "Error loading %s for %s: %s\n", lib, path, dlerror());
+        return -1;
+      }
+      break;
+    }
+  }
+
+  return 0;
+}
+
+static void * load_program(const char *path, const char *data, size_t size) {
+  int fd = memfd_create(path, MFD_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "memfd_create failed: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  char *copy = NULL;
+  if (ftruncate(fd, size) == 0) {
+    copy = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (copy == NULL || copy == MAP_FAILED) {
+    fprintf(stderr, "Error copying %s: %s\n", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  memcpy(copy, data, size);
+  clear_pie_flag(copy, size);
+  munmap(copy, size);
+
+  char fdpath[64];
+  snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", fd);
+
+  // Binding everything now means the children never have to.
+  void *handle = dlopen(fdpath, RTLD_NOW | RTLD_GLOBAL);
+  if (handle == NULL) {
+    fprintf(stderr, "Error loading %s: %s\n", path, dlerror());
+  }
+
+  close(fd);
+  return handle;
+}
+
+// Looks main up in the dynamic symbols first, then in the program's symbol table,
+// since executables usually don't export it.
+static void * find_main(const char *path, const char *data, size_t size) {
+  void *sym = dlsym(g_program.handle, "main");
+  if (sym != NULL) {
+    return sym;
+  }
+
+  const Elf64_Ehdr *ehdr = (const void *)data;
+  if (ehdr->e_shoff == 0 || ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) > size) {
+    return NULL;
+  }
+
+  const Elf64_Shdr *shdrs = (const void *)(data + ehdr->e_shoff);
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    if (shdrs[i].sh_type != SHT_SYMTAB || shdrs[i].sh_link >= ehdr->e_shnum) {
+      continue;
+    }
+
+    const Elf64_Shdr *strtab = &shdrs[shdrs[i].sh_link];
+    if (shdrs[i].sh_offset + shdrs[i].sh_size > size ||
+        strtab->sh_offset + strtab->sh_size > size) {
+      continue;
+    }
+
+    const Elf64_Sym *syms = (const void *)(data + shdrs[i].sh_offset);
+    const char *names = data + strtab->sh_offset;
+    for (size_t j = 0; j < shdrs[i].sh_size / sizeof(Elf64_Sym); j++) {
+      if (ELF64_ST_TYPE(syms[j].st_info) == STT_FUNC && syms[j].st_shndx != SHN_UNDEF &&
+          syms[j].st_name < strtab->sh_size &&
+          strcmp(names + syms[j].st_name, "main") == 0) {
+        return (char *)g_program.map->l_addr + syms[j].st_value;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// glibc relocates most of the dynamic section in place, but not for every object (e.g.
+// the vDSO), so small values are treated as unrelocated.
+static uintptr_t dyn_ptr(ElfW(Addr) base, ElfW(Addr) ptr) {
+  return ptr < base ? base + ptr : ptr;
+}
+
+typedef struct dyn_info {
+  const ElfW(Rela) *rela;
+  size_t nrela;
+  const ElfW(Sym) *syms;
+  const char *strtab;
+} dyn_info;
+
+static int read_dyn_info(ElfW(Addr) base, const ElfW(Dyn) *dyn, dyn_info *info) {
+  memset(info, 0, sizeof(*info));
+  size_t relasz = 0;
+
+  for (; dyn && dyn->d_tag != DT_NULL; dyn++) {
+    switch (dyn->d_tag) {
+    case DT_RELA:
+      info->rela = (const void *)dyn_ptr(base, dyn->d_un.d_ptr);
+      break;
+    case DT_RELASZ:
+      relasz = dyn->d_un.d_val;
+      break;
+    case DT_SYMTAB:
+      info->syms = (const void *)dyn_ptr(base, dyn->d_un.d_ptr);
+      break;
+    case DT_STRTAB:
+      info->strtab = (const void *)dyn_ptr(base, dyn->d_un.d_ptr);
+      break;
+    }
+  }
+
+  info->nrela = relasz / sizeof(ElfW(Rela));
+  return info->rela && info->syms && info->strtab ? 0 : -1;
+}
+
+#ifdef RELOC_COPY
+
+static int find_copy_relocs() {
+  dyn_info info;
+  if (read_dyn_info(g_program.map->l_addr, g_program.map->l_ld, &info) == -1) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < info.nrela; i++) {
+    if (ELF64_R_TYPE(info.rela[i].r_info) != RELOC_COPY) {
+      continue;
+    }
+
+    const ElfW(Sym) *sym = &info.syms[ELF64_R_SYM(info.rela[i].r_info)];
+    g_program.copies = realloc(g_program.copies,
+                               (g_program.ncopies + 1) * sizeof(copy_reloc));
+    copy_reloc *copy = &g_program.copies[g_program.ncopies++];
+    copy->name = info.strtab + sym->st_name;
+    copy->copy = (char *)g_program.map->l_addr + info.rela[i].r_offset;
+    copy->size = sym->st_size;
+  }
+
+  return 0;
+}
+
+static int collect_got_patches(struct dl_phdr_info *phdr_info, size_t size, void *unused) {
+  const ElfW(Dyn) *dyn = NULL;
+  uintptr_t relro_start = 0, relro_end = 0;
+
+  for (int i = 0; i < phdr_info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &phdr_info->dlpi_phdr[i];
+    if (phdr->p_type == PT_DYNAMIC) {
+      dyn = (const void *)(phdr_info->dlpi_addr + phdr->p_vaddr);
+    } else if (phdr->p_type == PT_GNU_RELRO) {
+      relro_start = phdr_info->dlpi_addr + phdr->p_vaddr;
+      relro_end = relro_start + phdr->p_memsz;
+    }
+  }
+
+  dyn_info info;
+  if (dyn == (const void *)g_program.map->l_ld ||
+      read_dyn_info(phdr_info->dlpi_addr, dyn, &info) == -1) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < info.nrela; i++) {
+    int type = ELF64_R_TYPE(info.rela[i].r_info);
+    if ((type != RELOC_GLOB_DAT && type != RELOC_ABS) ||
+        ELF64_R_SYM(info.rela[i].r_info) == 0) {
+      continue;
+    }
+
+    const char *name = info.strtab + info.syms[ELF64_R_SYM(info.rela[i].r_info)].st_name;
+    for (int j = 0; j < g_program.ncopies; j++) {
+      if (strcmp(name, g_program.copies[j].name) != 0) {
+        continue;
+      }
+
+      uintptr_t slot = phdr_info->dlpi_addr + info.rela[i].r_offset;
+      g_program.patches = realloc(g_program.patches,
+                                  (g_program.npatches + 1) * sizeof(got_patch));
+      got_patch *patch = &g_program.patches[g_program.npatches++];
+      patch->slot = (void **)slot;
+      patch->value = (char *)g_program.copies[j].copy +
+                     (type == RELOC_ABS ? info.rela[i].r_addend : 0);
+      patch->relro = slot >= relro_start && slot < relro_end;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+// Runs in the child, right before main: brings the PIE's copies up to date with the
+// variables everyone else has been using, then points everyone else at the copies.
+static void redirect_copy_relocs() {
+  for (int i = 0; i < g_program.ncopies; i++) {
+    copy_reloc *copy = &g_program.copies[i];
+    void *current = dlsym(RTLD_DEFAULT, copy->name);
+    if (current != NULL && current != copy->copy) {
+      memcpy(copy->copy, current, copy->size);
+    }
+  }
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  for (int i = 0; i < g_program.npatches; i++) {
+    got_patch *patch = &g_program.patches[i];
+    void *page = (void *)((uintptr_t)patch->slot & ~(page_size - 1));
+
+    if (patch->relro && mprotect(page, page_size, PROT_READ | PROT_WRITE) == -1) {
+      continue;
+    }
+    *patch->slot = patch->value;
+    if (patch->relro) {
+      mprotect(page, page_size, PROT_READ);
+    }
+  }
+}
+
+#else
+
+static int find_copy_relocs() {
+  dyn_info info;
+  if (read_dyn_info(g_program.map->l_addr, g_program.map->l_ld, &info) == 0 &&
+      info.nrela > 0) {
+    fprintf(stderr, "Copy relocations aren't supported on this architecture.\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int collect_got_patches(struct dl_phdr_info *info, size_t size, void *unused) {
+  return 0;
+}
+
+static void redirect_copy_relocs() {}
+
+#endif
+
+static int preload(const char *path) {
+  size_t size;
+  char *data = map_file(path, &size);
+  if (data == NULL) {
+    return -1;
+  }
+
+  int rc = -1;
+  char *real = NULL, *origin = NULL;
+  if (check_program(path, (Elf64_Ehdr *)data, size) == -1) {
+    goto end;
+  }
+
+  real = realpath(path, NULL);
+  if (real == NULL) {
+    fprintf(stderr, "Error resolving %s: %s\n", path, strerror(errno));
+    goto end;
+  }
+
+  origin = strdup(real);
+  *strrchr(origin, '/') = '\0';
+  if (load_needed(path, data, size, origin) == -1) {
+    goto end;
+  }
+
+  g_program.handle = load_program(path, data, size);
+  if (g_program.handle == NULL) {
+    goto end;
+  }
+
+  if (dlinfo(g_program.handle, RTLD_DI_LINKMAP, &g_program.map) == -1) {
+    fprintf(stderr, "dlinfo failed: %s\n", dlerror());
+    goto end;
+  }
+
+  // So dladdr and anything walking the link maps see the program instead of the memfd.
+  g_program.map->l_name = real;
+  real = NULL;
+
+  g_program.main = find_main(path, data, size);
+  if (g_program.main == NULL) {
+    fprintf(stderr, "Can't find main in %s; link it with -rdynamic or don't strip it.\n",
+            path);
+    goto end;
+  }
+
+  if (find_copy_relocs() == -1) {
+    goto end;
+  }
+  dl_iterate_phdr(collect_got_patches, NULL);
+  rc = 0;
+
+  end:
+  free(real);
+  free(origin);
+  munmap(data, size);
+  return rc;
+}
+
+UPROCD_EXPORT int uprocd_module_entry() {
+  const char *program = uprocd_config_string("Program");
+  if (strlen(program) == 0) {
+    fprintf(stderr, "The module must set Program.\n");
+    return 1;
+  } else if (!uprocd_config_number("ForkSafe")) {
+    // Nothing can tell from the outside whether a program's constructors left behind
+    // threads, locks or sockets that a forked child can't use.
+    fprintf(stderr, "Refusing to preload %s: set ForkSafe=1 once you've checked that "
+                    "its constructors are safe to fork after.\n", program);
+    return 1;
+  }
+
+  if (preload(program) == -1) {
+    return 1;
+  }
+
+  uprocd_context *ctx = uprocd_run();
+  uprocd_context_enter(ctx);
+
+  int argc;
+  char **args;
+  uprocd_context_get_args(ctx, &argc, &args);
+
+  // main expects argv[argc] to be NULL. Also, argv[0] is the process title, but
+  // programs like compiler drivers find their resources through it.
+  char **argv = malloc((argc + 1) * sizeof(char *));
+  const char *argv0 = uprocd_config_string("Argv0");
+  argv[0] = strdup(strlen(argv0) ? argv0 : program);
+  for (int i = 1; i < argc; i++) {
+    argv[i] = args[i];
+  }
+  argv[argc] = NULL;
+
+  program_invocation_name = argv[0];
+  char *slash = strrchr(argv[0], '/');
+  program_invocation_short_name = slash ? slash + 1 : argv[0];
+
+  redirect_copy_relocs();
+
+  extern char **environ;
+  exit(g_program.main(argc, argv, environ));
+}
@@ -0,0 +1,163 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "uprocd.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <stdio.h>
+#include <string.h>
+
+// Works with Lua 5.1 through 5.4 and LuaJIT.
+
+static int traceback(lua_State *L) {
+  const char *msg = lua_tostring(L, 1);
+  if (msg == NULL) {
+    msg = "(error object is not a string)";
+  }
+
+#if LUA_VERSION_NUM >= 502
+  luaL_traceback(L, L, msg, 1);
+#else
+  lua_getglobal(L, "debug");
+  lua_getfield(L, -1, "traceback");
+  lua_pushstring(L, msg);
+  lua_pushinteger(L, 2);
+  lua_call(L, 2, 1);
+#endif
+  return 1;
+}
+
+// Calls the function below nargs arguments on the stack, printing any error the way the
+// lua interpreter does. Returns 0 on success.
+static int docall(lua_State *L, int nargs, const char *progname) {
+  int base = lua_gettop(L) - nargs;
+  lua_pushcfunction(L, traceback);
+  lua_insert(L, base);
+
+  int status = lua_pcall(L, nargs, 0, base);
+  lua_remove(L, base);
+
+  if (status != 0) {
+    fprintf(stderr, "%s: %s\n", progname, lua_tostring(L, -1));
+    fflush(stderr);
+    lua_pop(L, 1);
+  }
+  return status;
+}
+
+static int require_module(lua_State *L, const char *name) {
+  lua_getglobal(L, "require");
+  lua_pushstring(L, name);
+  return docall(L, 1, "ulua");
+}
+
+static int preload(lua_State *L) {
+  int count = uprocd_config_list_size("Require");
+  for (int i = 0; i < count; i++) {
+    if (require_module(L, uprocd_config_string_at("Require", i)) != 0) {
+      return 1;
+    }
+  }
+
+  const char *code = uprocd_config_string("Preload");
+  if (strlen(code) != 0) {
+    if (luaL_loadbuffer(L, code, strlen(code), "=Preload") != 0 ||
+        docall(L, 0, "ulua") != 0) {
+      if (lua_isstring(L, -1)) {
+        fprintf(stderr, "ulua: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+      }
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Sets the global arg table like lua(1): the script at index 0, the interpreter before
+// it, and the script's arguments after it. The arguments are also pushed onto the
+// stack, to be passed to the chunk as "...".
+static int push_args(lua_State *L, int argc, char **argv, int script) {
+  lua_createtable(L, argc - script - 1, script + 1);
+  for (int i = 0; i < argc; i++) {
+    lua_pushstring(L, argv[i]);
+    lua_rawseti(L, -2, i - script);
+  }
+  lua_setglobal(L, "arg");
+
+  int nargs = argc - script - 1;
+  luaL_checkstack(L, nargs + 3, "too many arguments to script");
+  for (int i = script + 1; i < argc; i++) {
+    lua_pushstring(L, argv[i]);
+  }
+  return nargs;
+}
+
+static int run_child(lua_State *L, int argc, char **argv) {
+  const char *progname = argv[0];
+  const char *run = uprocd_config_string("Run");
+  int status, script;
+
+  if (strlen(run) != 0) {
+    script = 0;
+    status = luaL_loadbuffer(L, run, strlen(run), "=Run");
+  } else if (argc >= 3 && strcmp(argv[1], "-e") == 0) {
+    script = 2;
+    status = luaL_loadbuffer(L, argv[2], strlen(argv[2]), "=(command line)");
+  } else if (argc >= 2 && strcmp(argv[1], "-") != 0) {
+    script = 1;
+    status = luaL_loadfile(L, argv[1]);
+  } else {
+    // Like lua -, read the script from standard input.
+    script = argc >= 2 ? 1 : 0;
+    status = luaL_loadfile(L, NULL);
+  }
+
+  if (status != 0) {
+    fprintf(stderr, "%s: %s\n", progname, lua_tostring(L, -1));
+    return 1;
+  }
+
+  int nargs = push_args(L, argc, argv, script);
+  return docall(L, nargs, progname) == 0 ? 0 : 1;
+}
+
+UPROCD_EXPORT int uprocd_module_entry() {
+  lua_State *L = luaL_newstate();
+  if (L == NULL) {
+    fprintf(stderr, "ulua: cannot create the Lua state\n");
+    return 1;
+  }
+
+  luaL_openlibs(L);
+  if (preload(L) != 0) {
+    lua_close(L);
+    return 1;
+  }
+
+  // Children would otherwise finish this collection for the template, dirtying the
+  // pages they share with it.
+  lua_gc(L, LUA_GCCOLLECT, 0);
+
+  uprocd_context *ctx = uprocd_run();
+  uprocd_context_enter(ctx);
+
+  if (uprocd_config_number("DisableGC")) {
+    lua_gc(L, LUA_GCSTOP, 0);
+  }
+
+  int argc;
+  char **argv;
+  uprocd_context_get_args(ctx, &argc, &argv);
+
+  int result = run_child(L, argc, argv);
+
+  fflush(stdout);
+  uprocd_context_free(ctx);
+  lua_close(L);
+  return result;
+}
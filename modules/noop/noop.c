@@ -0,0 +1,13 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "uprocd.h"
+
+// Does nothing but take the full spawn path, so load tests measure uprocd itself.
+UPROCD_EXPORT int uprocd_module_entry() {
+  uprocd_context *ctx = uprocd_run();
+  uprocd_context_enter(ctx);
+  uprocd_context_free(ctx);
+  return 0;
+}
@@ -0,0 +1,61 @@
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+# Runs the caller's script inside a forked child of the uprocd Perl module.
+
+package Uprocd;
+
+# Declared before "use strict" so the caller's code doesn't inherit our pragmas.
+sub _eval_main {
+  my ($name, $source) = @_;
+  eval "package main;\n#line 1 \"$name\"\n$source\n;1";
+}
+
+use strict;
+use warnings;
+
+our $RUN;
+
+sub _slurp {
+  my ($path) = @_;
+  open(my $fh, '<', $path) or die "Can't open perl script \"$path\": $!\n";
+  local $/;
+  return scalar <$fh>;
+}
+
+sub serve {
+  my ($args, $env) = Uprocd::run();
+
+  %ENV = %$env;
+  my (undef, @args) = @$args;
+
+  # STDOUT was opened while the template wasn't attached to a terminal, so it would
+  # otherwise stay block buffered.
+  select((select(STDOUT), $| = 1)[0]) if -t STDOUT;
+
+  my ($name, $source);
+  if (defined $RUN && length $RUN) {
+    ($name, $source) = ('-e', $RUN);
+  } elsif (@args >= 2 && $args[0] eq '-e') {
+    (undef, $source) = splice(@args, 0, 2);
+    $name = '-e';
+  } elsif (@args && $args[0] ne '-') {
+    $name = shift @args;
+    $source = _slurp($name);
+  } else {
+    shift @args if @args;
+    $name = '-';
+    $source = do { local $/; <STDIN> };
+  }
+
+  $0 = $name;
+  @ARGV = @args;
+
+  unless (_eval_main($name, $source)) {
+    print STDERR $@;
+    exit 255;
+  }
+}
+
+1;
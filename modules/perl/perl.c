@@ -0,0 +1,112 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "uprocd.h"
+
+#include <EXTERN.h>
+#include <perl.h>
+#include <XSUB.h>
+
+extern char **environ;
+
+static PerlInterpreter *my_perl;
+
+EXTERN_C void boot_DynaLoader(pTHX_ CV *cv);
+
+// Uprocd::run(), which only returns inside a forked child. It enters the caller's
+// context and returns references to the caller's arguments and environment.
+static XS(XS_Uprocd_run) {
+  dXSARGS;
+  PERL_UNUSED_VAR(items);
+
+  // Anything the template left buffered would otherwise be written by every child.
+  PERL_FLUSHALL_FOR_CHILD;
+
+  uprocd_context *ctx = uprocd_run();
+  uprocd_context_enter(ctx);
+
+  int argc;
+  char **argv;
+  uprocd_context_get_args(ctx, &argc, &argv);
+
+  AV *args = newAV();
+  for (int i = 0; i < argc; i++) {
+    av_push(args, newSVpv(argv[i], 0));
+  }
+
+  HV *env = newHV();
+  for (const char **p = uprocd_context_get_env(ctx); *p != NULL; p += 2) {
+    hv_store(env, p[0], strlen(p[0]), newSVpv(p[1], 0), 0);
+  }
+
+  uprocd_context_free(ctx);
+
+  EXTEND(SP, 2);
+  ST(0) = sv_2mortal(newRV_noinc((SV*)args));
+  ST(1) = sv_2mortal(newRV_noinc((SV*)env));
+  XSRETURN(2);
+}
+
+static void xs_init(pTHX) {
+  newXS("DynaLoader::boot_DynaLoader", boot_DynaLoader, __FILE__);
+  newXS("Uprocd::run", XS_Uprocd_run, __FILE__);
+}
+
+UPROCD_EXPORT int uprocd_module_entry() {
+  // Every module in Use becomes a -M option, so preloading behaves exactly like
+  // perl -MModule would, including import arguments written as Module=arg,arg.
+  int nuse = uprocd_config_list_size("Use");
+  const char *preload = uprocd_config_string("Preload");
+
+  char *code = malloc(strlen(preload) + 32);
+  sprintf(code, "%s\n;Uprocd::serve();", preload);
+
+  // Perl writes to argv[0] when a script sets $0, so it can't be a string literal.
+  char perl_name[] = "perl";
+
+  int argc = 0;
+  char **argv = malloc((nuse + 6) * sizeof(char*));
+  argv[argc++] = perl_name;
+  argv[argc++] = "-I";
+  argv[argc++] = (char*)uprocd_module_directory();
+  argv[argc++] = "-M_uprocd_serve";
+
+  char **use_options = malloc(nuse * sizeof(char*));
+  for (int i = 0; i < nuse; i++) {
+    const char *module = uprocd_config_string_at("Use", i);
+    use_options[i] = malloc(strlen(module) + 3);
+    sprintf(use_options[i], "-M%s", module);
+    argv[argc++] = use_options[i];
+  }
+
+  argv[argc++] = "-e";
+  argv[argc++] = code;
+
+  char **env = environ;
+  PERL_SYS_INIT3(&argc, &argv, &env);
+
+  my_perl = perl_alloc();
+  perl_construct(my_perl);
+  PL_exit_flags |= PERL_EXIT_DESTRUCT_END;
+
+  int result = perl_parse(my_perl, xs_init, argc, argv, env);
+  if (result == 0) {
+    sv_setpv(get_sv("Uprocd::RUN", GV_ADD), uprocd_config_string("Run"));
+    result = perl_run(my_perl);
+  } else {
+    fprintf(stderr, "uperl: Error running preload code.\n");
+  }
+
+  perl_destruct(my_perl);
+  perl_free(my_perl);
+  PERL_SYS_TERM();
+
+  for (int i = 0; i < nuse; i++) {
+    free(use_options[i]);
+  }
+  free(use_options);
+  free(argv);
+  free(code);
+  return result;
+}
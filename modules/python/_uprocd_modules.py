@@ -1,1020 +0,0 @@
-
-try:
-    import string
-except Exception as ex:
-    print('string', ex)
-
-try:
-    import re
-except Exception as ex:
-    print('re', ex)
-
-try:
-    import difflib
-except Exception as ex:
-    print('difflib', ex)
-
-try:
-    import textwrap
-except Exception as ex:
-    print('textwrap', ex)
-
-try:
-    import unicodedata
-except Exception as ex:
-    print('unicodedata', ex)
-
-try:
-    import stringprep
-except Exception as ex:
-    print('stringprep', ex)
-
-try:
-    import readline
-except Exception as ex:
-    print('readline', ex)
-
-try:
-    import rlcompleter
-except Exception as ex:
-    print('rlcompleter', ex)
-
-try:
-    import struct
-except Exception as ex:
-    print('struct', ex)
-
-try:
-    import codecs
-except Exception as ex:
-    print('codecs', ex)
-
-try:
-    import datetime
-except Exception as ex:
-    print('datetime', ex)
-
-try:
-    import calendar
-except Exception as ex:
-    print('calendar', ex)
-
-try:
-    import collections
-except Exception as ex:
-    print('collections', ex)
-
-try:
-    import heapq
-except Exception as ex:
-    print('heapq', ex)
-
-try:
-    import bisect
-except Exception as ex:
-    print('bisect', ex)
-
-try:
-    import array
-except Exception as ex:
-    print('array', ex)
-
-try:
-    import weakref
-except Exception as ex:
-    print('weakref', ex)
-
-try:
-    import types
-except Exception as ex:
-    print('types', ex)
-
-try:
-    import copy
-except Exception as ex:
-    print('copy', ex)
-
-try:
-    import pprint
-except Exception as ex:
-    print('pprint', ex)
-
-try:
-    import reprlib
-except Exception as ex:
-    print('reprlib', ex)
-
-try:
-    import enum
-except Exception as ex:
-    print('enum', ex)
-
-try:
-    import numbers
-except Exception as ex:
-    print('numbers', ex)
-
-try:
-    import math
-except Exception as ex:
-    print('math', ex)
-
-try:
-    import cmath
-except Exception as ex:
-    print('cmath', ex)
-
-try:
-    import decimal
-except Exception as ex:
-    print('decimal', ex)
-
-try:
-    import fractions
-except Exception as ex:
-    print('fractions', ex)
-
-try:
-    import random
-except Exception as ex:
-    print('random', ex)
-
-try:
-    import statistics
-except Exception as ex:
-    print('statistics', ex)
-
-try:
-    import itertools
-except Exception as ex:
-    print('itertools', ex)
-
-try:
-    import functools
-except Exception as ex:
-    print('functools', ex)
-
-try:
-    import operator
-except Exception as ex:
-    print('operator', ex)
-
-try:
-    import pathlib
-except Exception as ex:
-    print('pathlib', ex)
-
-try:
-    import fileinput
-except Exception as ex:
-    print('fileinput', ex)
-
-try:
-    import stat
-except Exception as ex:
-    print('stat', ex)
-
-try:
-    import filecmp
-except Exception as ex:
-    print('filecmp', ex)
-
-try:
-    import tempfile
-except Exception as ex:
-    print('tempfile', ex)
-
-try:
-    import glob
-except Exception as ex:
-    print('glob', ex)
-
-try:
-    import fnmatch
-except Exception as ex:
-    print('fnmatch', ex)
-
-try:
-    import linecache
-except Exception as ex:
-    print('linecache', ex)
-
-try:
-    import shutil
-except Exception as ex:
-    print('shutil', ex)
-
-try:
-    import macpath
-except Exception as ex:
-    print('macpath', ex)
-
-try:
-    import pickle
-except Exception as ex:
-    print('pickle', ex)
-
-try:
-    import copyreg
-except Exception as ex:
-    print('copyreg', ex)
-
-try:
-    import pickle
-except Exception as ex:
-    print('pickle', ex)
-
-try:
-    import shelve
-except Exception as ex:
-    print('shelve', ex)
-
-try:
-    import marshal
-except Exception as ex:
-    print('marshal', ex)
-
-try:
-    import dbm
-except Exception as ex:
-    print('dbm', ex)
-
-try:
-    import sqlite3
-except Exception as ex:
-    print('sqlite3', ex)
-
-try:
-    import zlib
-except Exception as ex:
-    print('zlib', ex)
-
-try:
-    import gzip
-except Exception as ex:
-    print('gzip', ex)
-
-try:
-    import bz2
-except Exception as ex:
-    print('bz2', ex)
-
-try:
-    import lzma
-except Exception as ex:
-    print('lzma', ex)
-
-try:
-    import zipfile
-except Exception as ex:
-    print('zipfile', ex)
-
-try:
-    import tarfile
-except Exception as ex:
-    print('tarfile', ex)
-
-try:
-    import csv
-except Exception as ex:
-    print('csv', ex)
-
-try:
-    import configparser
-except Exception as ex:
-    print('configparser', ex)
-
-try:
-    import netrc
-except Exception as ex:
-    print('netrc', ex)
-
-try:
-    import xdrlib
-except Exception as ex:
-    print('xdrlib', ex)
-
-try:
-    import plistlib
-except Exception as ex:
-    print('plistlib', ex)
-
-try:
-    import hashlib
-except Exception as ex:
-    print('hashlib', ex)
-
-try:
-    import hmac
-except Exception as ex:
-    print('hmac', ex)
-
-try:
-    import secrets
-except Exception as ex:
-    print('secrets', ex)
-
-try:
-    import os
-except Exception as ex:
-    print('os', ex)
-
-try:
-    import io
-except Exception as ex:
-    print('io', ex)
-
-try:
-    import time
-except Exception as ex:
-    print('time', ex)
-
-try:
-    import argparse
-except Exception as ex:
-    print('argparse', ex)
-
-try:
-    import getopt
-except Exception as ex:
-    print('getopt', ex)
-
-try:
-    import logging
-except Exception as ex:
-    print('logging', ex)
-
-try:
-    import getpass
-except Exception as ex:
-    print('getpass', ex)
-
-try:
-    import curses
-except Exception as ex:
-    print('curses', ex)
-
-try:
-    import platform
-except Exception as ex:
-    print('platform', ex)
-
-try:
-    import errno
-except Exception as ex:
-    print('errno', ex)
-
-try:
-    import ctypes
-except Exception as ex:
-    print('ctypes', ex)
-
-try:
-    import threading
-except Exception as ex:
-    print('threading', ex)
-
-try:
-    import multiprocessing
-except Exception as ex:
-    print('multiprocessing', ex)
-
-try:
-    import concurrent
-except Exception as ex:
-    print('concurrent', ex)
-
-try:
-    import subprocess
-except Exception as ex:
-    print('subprocess', ex)
-
-try:
-    import sched
-except Exception as ex:
-    print('sched', ex)
-
-try:
-    import queue
-except Exception as ex:
-    print('queue', ex)
-
-try:
-    import dummy_threading
-except Exception as ex:
-    print('dummy_threading', ex)
-
-try:
-    import threading
-except Exception as ex:
-    print('threading', ex)
-
-try:
-    import socket
-except Exception as ex:
-    print('socket', ex)
-
-try:
-    import ssl
-except Exception as ex:
-    print('ssl', ex)
-
-try:
-    import select
-except Exception as ex:
-    print('select', ex)
-
-try:
-    import selectors
-except Exception as ex:
-    print('selectors', ex)
-
-try:
-    import asyncio
-except Exception as ex:
-    print('asyncio', ex)
-
-try:
-    import asyncore
-except Exception as ex:
-    print('asyncore', ex)
-
-try:
-    import asynchat
-except Exception as ex:
-    print('asynchat', ex)
-
-try:
-    import signal
-except Exception as ex:
-    print('signal', ex)
-
-try:
-    import mmap
-except Exception as ex:
-    print('mmap', ex)
-
-try:
-    import email
-except Exception as ex:
-    print('email', ex)
-
-try:
-    import json
-except Exception as ex:
-    print('json', ex)
-
-try:
-    import mailcap
-except Exception as ex:
-    print('mailcap', ex)
-
-try:
-    import mailbox
-except Exception as ex:
-    print('mailbox', ex)
-
-try:
-    import mimetypes
-except Exception as ex:
-    print('mimetypes', ex)
-
-try:
-    import base64
-except Exception as ex:
-    print('base64', ex)
-
-try:
-    import binhex
-except Exception as ex:
-    print('binhex', ex)
-
-try:
-    import binascii
-except Exception as ex:
-    print('binascii', ex)
-
-try:
-    import quopri
-except Exception as ex:
-    print('quopri', ex)
-
-try:
-    import uu
-except Exception as ex:
-    print('uu', ex)
-
-try:
-    import html
-except Exception as ex:
-    print('html', ex)
-
-try:
-    import webbrowser
-except Exception as ex:
-    print('webbrowser', ex)
-
-try:
-    import cgi
-except Exception as ex:
-    print('cgi', ex)
-
-try:
-    import cgitb
-except Exception as ex:
-    print('cgitb', ex)
-
-try:
-    import wsgiref
-except Exception as ex:
-    print('wsgiref', ex)
-
-try:
-    import urllib
-except Exception as ex:
-    print('urllib', ex)
-
-try:
-    import http
-except Exception as ex:
-    print('http', ex)
-
-try:
-    import ftplib
-except Exception as ex:
-    print('ftplib', ex)
-
-try:
-    import poplib
-except Exception as ex:
-    print('poplib', ex)
-
-try:
-    import imaplib
-except Exception as ex:
-    print('imaplib', ex)
-
-try:
-    import nntplib
-except Exception as ex:
-    print('nntplib', ex)
-
-try:
-    import smtplib
-except Exception as ex:
-    print('smtplib', ex)
-
-try:
-    import smtpd
-except Exception as ex:
-    print('smtpd', ex)
-
-try:
-    import telnetlib
-except Exception as ex:
-    print('telnetlib', ex)
-
-try:
-    import uuid
-except Exception as ex:
-    print('uuid', ex)
-
-try:
-    import socketserver
-except Exception as ex:
-    print('socketserver', ex)
-
-try:
-    import xmlrpc
-except Exception as ex:
-    print('xmlrpc', ex)
-
-try:
-    import ipaddress
-except Exception as ex:
-    print('ipaddress', ex)
-
-try:
-    import audioop
-except Exception as ex:
-    print('audioop', ex)
-
-try:
-    import aifc
-except Exception as ex:
-    print('aifc', ex)
-
-try:
-    import sunau
-except Exception as ex:
-    print('sunau', ex)
-
-try:
-    import wave
-except Exception as ex:
-    print('wave', ex)
-
-try:
-    import chunk
-except Exception as ex:
-    print('chunk', ex)
-
-try:
-    import colorsys
-except Exception as ex:
-    print('colorsys', ex)
-
-try:
-    import imghdr
-except Exception as ex:
-    print('imghdr', ex)
-
-try:
-    import sndhdr
-except Exception as ex:
-    print('sndhdr', ex)
-
-try:
-    import ossaudiodev
-except Exception as ex:
-    print('ossaudiodev', ex)
-
-try:
-    import gettext
-except Exception as ex:
-    print('gettext', ex)
-
-try:
-    import locale
-except Exception as ex:
-    print('locale', ex)
-
-try:
-    import turtle
-except Exception as ex:
-    print('turtle', ex)
-
-try:
-    import cmd
-except Exception as ex:
-    print('cmd', ex)
-
-try:
-    import shlex
-except Exception as ex:
-    print('shlex', ex)
-
-try:
-    import tkinter
-except Exception as ex:
-    print('tkinter', ex)
-
-try:
-    import typing
-except Exception as ex:
-    print('typing', ex)
-
-try:
-    import pydoc
-except Exception as ex:
-    print('pydoc', ex)
-
-try:
-    import doctest
-except Exception as ex:
-    print('doctest', ex)
-
-try:
-    import unittest
-except Exception as ex:
-    print('unittest', ex)
-
-try:
-    import test
-except Exception as ex:
-    print('test', ex)
-
-try:
-    import bdb
-except Exception as ex:
-    print('bdb', ex)
-
-try:
-    import faulthandler
-except Exception as ex:
-    print('faulthandler', ex)
-
-try:
-    import pdb
-except Exception as ex:
-    print('pdb', ex)
-
-try:
-    import timeit
-except Exception as ex:
-    print('timeit', ex)
-
-try:
-    import trace
-except Exception as ex:
-    print('trace', ex)
-
-try:
-    import tracemalloc
-except Exception as ex:
-    print('tracemalloc', ex)
-
-try:
-    import distutils
-except Exception as ex:
-    print('distutils', ex)
-
-try:
-    import ensurepip
-except Exception as ex:
-    print('ensurepip', ex)
-
-try:
-    import pip
-except Exception as ex:
-    print('pip', ex)
-
-try:
-    import venv
-except Exception as ex:
-    print('venv', ex)
-
-try:
-    import zipapp
-except Exception as ex:
-    print('zipapp', ex)
-
-try:
-    import sys
-except Exception as ex:
-    print('sys', ex)
-
-try:
-    import sysconfig
-except Exception as ex:
-    print('sysconfig', ex)
-
-try:
-    import builtins
-except Exception as ex:
-    print('builtins', ex)
-
-try:
-    import warnings
-except Exception as ex:
-    print('warnings', ex)
-
-try:
-    import contextlib
-except Exception as ex:
-    print('contextlib', ex)
-
-try:
-    import abc
-except Exception as ex:
-    print('abc', ex)
-
-try:
-    import atexit
-except Exception as ex:
-    print('atexit', ex)
-
-try:
-    import traceback
-except Exception as ex:
-    print('traceback', ex)
-
-try:
-    import gc
-except Exception as ex:
-    print('gc', ex)
-
-try:
-    import inspect
-except Exception as ex:
-    print('inspect', ex)
-
-try:
-    import site
-except Exception as ex:
-    print('site', ex)
-
-try:
-    import fpectl
-except Exception as ex:
-    print('fpectl', ex)
-
-try:
-    import code
-except Exception as ex:
-    print('code', ex)
-
-try:
-    import codeop
-except Exception as ex:
-    print('codeop', ex)
-
-try:
-    import zipimport
-except Exception as ex:
-    print('zipimport', ex)
-
-try:
-    import pkgutil
-except Exception as ex:
-    print('pkgutil', ex)
-
-try:
-    import modulefinder
-except Exception as ex:
-    print('modulefinder', ex)
-
-try:
-    import runpy
-except Exception as ex:
-    print('runpy', ex)
-
-try:
-    import importlib
-except Exception as ex:
-    print('importlib', ex)
-
-try:
-    import parser
-except Exception as ex:
-    print('parser', ex)
-
-try:
-    import ast
-except Exception as ex:
-    print('ast', ex)
-
-try:
-    import symtable
-except Exception as ex:
-    print('symtable', ex)
-
-try:
-    import symbol
-except Exception as ex:
-    print('symbol', ex)
-
-try:
-    import token
-except Exception as ex:
-    print('token', ex)
-
-try:
-    import keyword
-except Exception as ex:
-    print('keyword', ex)
-
-try:
-    import tokenize
-except Exception as ex:
-    print('tokenize', ex)
-
-try:
-    import tabnanny
-except Exception as ex:
-    print('tabnanny', ex)
-
-try:
-    import pyclbr
-except Exception as ex:
-    print('pyclbr', ex)
-
-try:
-    import py_compile
-except Exception as ex:
-    print('py_compile', ex)
-
-try:
-    import compileall
-except Exception as ex:
-    print('compileall', ex)
-
-try:
-    import dis
-except Exception as ex:
-    print('dis', ex)
-
-try:
-    import pickletools
-except Exception as ex:
-    print('pickletools', ex)
-
-try:
-    import formatter
-except Exception as ex:
-    print('formatter', ex)
-
-try:
-    import msilib
-except Exception as ex:
-    print('msilib', ex)
-
-try:
-    import msvcrt
-except Exception as ex:
-    print('msvcrt', ex)
-
-try:
-    import winreg
-except Exception as ex:
-    print('winreg', ex)
-
-try:
-    import winsound
-except Exception as ex:
-    print('winsound', ex)
-
-try:
-    import posix
-except Exception as ex:
-    print('posix', ex)
-
-try:
-    import pwd
-except Exception as ex:
-    print('pwd', ex)
-
-try:
-    import spwd
-except Exception as ex:
-    print('spwd', ex)
-
-try:
-    import grp
-except Exception as ex:
-    print('grp', ex)
-
-try:
-    import crypt
-except Exception as ex:
-    print('crypt', ex)
-
-try:
-    import termios
-except Exception as ex:
-    print('termios', ex)
-
-try:
-    import tty
-except Exception as ex:
-    print('tty', ex)
-
-try:
-    import pty
-except Exception as ex:
-    print('pty', ex)
-
-try:
-    import fcntl
-except Exception as ex:
-    print('fcntl', ex)
-
-try:
-    import fcntl
-except Exception as ex:
-    print('fcntl', ex)
-
-try:
-    import ioctl
-except Exception as ex:
-    print('ioctl', ex)
-
-try:
-    import pipes
-except Exception as ex:
-    print('pipes', ex)
-
-try:
-    import resource
-except Exception as ex:
-    print('resource', ex)
-
-try:
-    import nis
-except Exception as ex:
-    print('nis', ex)
-
-try:
-    import syslog
-except Exception as ex:
-    print('syslog', ex)
-
-try:
-    import optparse
-except Exception as ex:
-    print('optparse', ex)
-
-try:
-    import imp
-except Exception as ex:
-    print('imp', ex)
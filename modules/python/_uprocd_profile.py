@@ -0,0 +1,143 @@
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+'''
+Profile-guided preloading for the uprocd Python module.
+
+Every child appends the modules it used to a log when it exits. When a template boots,
+the log is folded into a persistent per-module profile, and the modules that enough
+children used are imported in the order they were first imported, until the template
+has grown by the configured memory budget.
+'''
+
+import builtins, json, os, sys
+
+
+def _profile_dir():
+    cache = os.environ.get('XDG_CACHE_HOME') or os.path.expanduser('~/.cache')
+    return os.path.join(cache, 'uprocd', 'python')
+
+
+def _paths(name):
+    base = os.path.join(_profile_dir(), name)
+    return base + '.profile.json', base + '.imports'
+
+
+def _rss():
+    with open('/proc/self/statm') as fp:
+        return int(fp.read().split()[1]) * os.sysconf('SC_PAGE_SIZE')
+
+
+def _load_profile(path):
+    try:
+        with open(path) as fp:
+            return json.load(fp)
+    except (OSError, ValueError):
+        return {'runs': 0, 'modules': {}}
+
+
+def _fold_log(profile, log):
+    # Move the log aside first, so children exiting right now start a new one instead
+    # of appending to a file that is about to be deleted.
+    folding = '%s.%d' % (log, os.getpid())
+    try:
+        os.rename(log, folding)
+    except OSError:
+        return False
+
+    with open(folding) as fp:
+        for line in fp:
+            try:
+                used = json.loads(line)
+            except ValueError:
+                continue
+
+            profile['runs'] += 1
+            for position, module in enumerate(used):
+                stats = profile['modules'].setdefault(module, {'count': 0,
+                                                               'position': 0.0})
+                stats['count'] += 1
+                # Running mean of where the module shows up, which approximates
+                # dependency order.
+                stats['position'] += (position - stats['position']) / stats['count']
+
+    os.unlink(folding)
+    return True
+
+
+def _save_profile(profile, path):
+    tmp = '%s.%d' % (path, os.getpid())
+    with open(tmp, 'w') as fp:
+        json.dump(profile, fp)
+    os.rename(tmp, path)
+
+
+def preload(name, min_fraction, budget_mb):
+    profile_path, log = _paths(name)
+    os.makedirs(_profile_dir(), exist_ok=True)
+
+    profile = _load_profile(profile_path)
+    if _fold_log(profile, log):
+        _save_profile(profile, profile_path)
+
+    runs = profile['runs']
+    if runs == 0:
+        return
+
+    candidates = [(stats['position'], module)
+                  for module, stats in profile['modules'].items()
+                  if stats['count'] / runs >= min_fraction and module not in sys.modules]
+    candidates.sort()
+
+    budget = budget_mb * 1024 * 1024
+    start = _rss()
+    for _, module in candidates:
+        if _rss() - start >= budget:
+            print('Preload budget of %d MiB exhausted, skipping the rest.' % budget_mb)
+            break
+
+        try:
+            __import__(module)
+        except BaseException as ex:
+            print('Error preloading %s: %s' % (module, ex))
+
+
+class _Recorder:
+    def __init__(self, name):
+        self.log = _paths(name)[1]
+        self.baseline = set(sys.modules)
+        self.requested = {}
+        self.original_import = builtins.__import__
+        builtins.__import__ = self.hook
+
+    def hook(self, name, globals=None, locals=None, fromlist=(), level=0):
+        # Preloaded modules never show up as new entries in sys.modules, so imports
+        # are tracked as well; otherwise they could never be dropped from the profile.
+        if level == 0 and name not in self.requested:
+            self.requested[name] = len(self.requested)
+        return self.original_import(name, globals, locals, fromlist, level)
+
+    def write(self):
+        builtins.__import__ = self.original_import
+
+        used = [module for module in self.requested if module in sys.modules]
+        seen = set(used)
+        used.extend(module for module in list(sys.modules)
+                    if module not in self.baseline and module not in seen)
+
+        # A single O_APPEND write keeps lines from concurrent children intact.
+        data = (json.dumps(used) + '\n').encode('utf-8')
+        try:
+            fd = os.open(self.log, os.O_WRONLY | os.O_APPEND | os.O_CREAT, 0o600)
+            try:
+                os.write(fd, data)
+            finally:
+                os.close(fd)
+        except OSError:
+            pass
+
+
+def record(name):
+    import atexit
+    atexit.register(_Recorder(name).write)
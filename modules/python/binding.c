@@ -0,0 +1,302 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "private.h"
+
+// The uprocd Python module, which lets Python code pick its own fork point instead of
+// relying on Preload and Run.
+
+static int g_context_returned = 0;
+
+int binding_context_returned() {
+  return g_context_returned;
+}
+
+typedef struct {
+  PyObject_HEAD
+  uprocd_context *ctx;
+  int entered;
+} ContextObject;
+
+static PyTypeObject Context_Type;
+
+static uprocd_context * get_context(ContextObject *self) {
+  if (self->ctx == NULL) {
+    PyErr_SetString(PyExc_ValueError, "The context has already been closed.");
+  }
+  return self->ctx;
+}
+
+static PyObject * Context_enter(ContextObject *self, PyObject *unused) {
+  uprocd_context *ctx = get_context(self);
+  if (ctx == NULL) {
+    return NULL;
+  } else if (self->entered) {
+    PyErr_SetString(PyExc_ValueError, "The context has already been entered.");
+    return NULL;
+  }
+
+  enter_child(ctx);
+  self->entered = 1;
+  Py_RETURN_NONE;
+}
+
+static PyObject * Context_close(ContextObject *self, PyObject *unused) {
+  if (self->ctx) {
+    uprocd_context_free(self->ctx);
+    self->ctx = NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject * Context_get_args(ContextObject *self, void *closure) {
+  uprocd_context *ctx = get_context(self);
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  int argc;
+  char **argv;
+  uprocd_context_get_args(ctx, &argc, &argv);
+
+  PyObject *list = PyList_New(argc);
+  for (int i = 0; list && i < argc; i++) {
+    PyObject *arg = PyUnicode_DecodeFSDefault(argv[i]);
+    if (arg == NULL) {
+      Py_CLEAR(list);
+      break;
+    }
+    PyList_SET_ITEM(list, i, arg);
+  }
+  return list;
+}
+
+static PyObject * Context_get_env(ContextObject *self, void *closure) {
+  uprocd_context *ctx = get_context(self);
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  PyObject *dict = PyDict_New();
+  for (const char **env = uprocd_context_get_env(ctx); dict && *env; env += 2) {
+    PyObject *key = PyUnicode_DecodeFSDefault(env[0]),
+             *value = PyUnicode_DecodeFSDefault(env[1]);
+    if (key == NULL || value == NULL || PyDict_SetItem(dict, key, value) == -1) {
+      Py_CLEAR(dict);
+    }
+    Py_XDECREF(key);
+    Py_XDECREF(value);
+  }
+  return dict;
+}
+
+static PyObject * Context_get_cwd(ContextObject *self, void *closure) {
+  uprocd_context *ctx = get_context(self);
+  return ctx ? PyUnicode_DecodeFSDefault(uprocd_context_get_cwd(ctx)) : NULL;
+}
+
+static void Context_dealloc(ContextObject *self) {
+  if (self->ctx) {
+    uprocd_context_free(self->ctx);
+  }
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyMethodDef Context_methods[] = {
+  {"enter", (PyCFunction)Context_enter, METH_NOARGS,
+   "Attach to the caller's terminal, environment and working directory."},
+  {"close", (PyCFunction)Context_close, METH_NOARGS,
+   "Free the context, closing its copies of the caller's standard streams."},
+  {NULL}
+};
+
+static PyGetSetDef Context_getset[] = {
+  {"args", (getter)Context_get_args, NULL, "The caller's arguments.", NULL},
+  {"env", (getter)Context_get_env, NULL, "The caller's environment.", NULL},
+  {"cwd", (getter)Context_get_cwd, NULL, "The caller's working directory.", NULL},
+  {NULL}
+};
+
+static PyTypeObject Context_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "uprocd.Context",
+  .tp_basicsize = sizeof(ContextObject),
+  .tp_dealloc = (destructor)Context_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "A request received by uprocd.run().",
+  .tp_methods = Context_methods,
+  .tp_getset = Context_getset,
+};
+
+static PyObject * uprocd_py_run(PyObject *module, PyObject *unused) {
+  if (g_context_returned) {
+    PyErr_SetString(PyExc_RuntimeError, "uprocd.run() was already called.");
+    return NULL;
+  }
+
+  freeze_heap();
+
+  // Only ever returns inside a forked child.
+  uprocd_context *ctx = uprocd_run();
+  g_context_returned = 1;
+
+  ContextObject *self = PyObject_New(ContextObject, &Context_Type);
+  if (self == NULL) {
+    uprocd_context_free(ctx);
+    return NULL;
+  }
+
+  self->ctx = ctx;
+  self->entered = 0;
+  return (PyObject*)self;
+}
+
+static PyObject * uprocd_py_enter(PyObject *module, PyObject *arg) {
+  if (!PyObject_TypeCheck(arg, &Context_Type)) {
+    PyErr_SetString(PyExc_TypeError, "Expected a uprocd.Context.");
+    return NULL;
+  }
+  return Context_enter((ContextObject*)arg, NULL);
+}
+
+static void call_exit_handler(void *userdata) {
+  PyObject *result = PyObject_CallObject((PyObject*)userdata, NULL);
+  if (result == NULL) {
+    PyErr_Print();
+  } else {
+    Py_DECREF(result);
+  }
+}
+
+static PyObject * uprocd_py_on_exit(PyObject *module, PyObject *func) {
+  static PyObject *handler = NULL;
+
+  if (!PyCallable_Check(func)) {
+    PyErr_SetString(PyExc_TypeError, "The exit handler must be callable.");
+    return NULL;
+  }
+
+  Py_INCREF(func);
+  Py_XSETREF(handler, func);
+  uprocd_on_exit(call_exit_handler, handler);
+  Py_RETURN_NONE;
+}
+
+static PyObject * uprocd_py_module_name(PyObject *module, PyObject *unused) {
+  return PyUnicode_FromString(uprocd_module_name());
+}
+
+static PyObject * uprocd_py_module_directory(PyObject *module, PyObject *unused) {
+  return PyUnicode_DecodeFSDefault(uprocd_module_directory());
+}
+
+static PyObject * uprocd_py_config_present(PyObject *module, PyObject *args) {
+  const char *key;
+  if (!PyArg_ParseTuple(args, "s", &key)) {
+    return NULL;
+  }
+  return PyBool_FromLong(uprocd_config_present(key));
+}
+
+static PyObject * uprocd_py_config_list_size(PyObject *module, PyObject *args) {
+  const char *key;
+  if (!PyArg_ParseTuple(args, "s", &key)) {
+    return NULL;
+  }
+  return PyLong_FromLong(uprocd_config_list_size(key));
+}
+
+static PyObject * uprocd_py_config_number(PyObject *module, PyObject *args) {
+  const char *key;
+  if (!PyArg_ParseTuple(args, "s", &key)) {
+    return NULL;
+  }
+  return PyFloat_FromDouble(uprocd_config_number(key));
+}
+
+static PyObject * uprocd_py_config_number_at(PyObject *module, PyObject *args) {
+  const char *key;
+  int index;
+  if (!PyArg_ParseTuple(args, "si", &key, &index)) {
+    return NULL;
+  }
+  return PyFloat_FromDouble(uprocd_config_number_at(key, index));
+}
+
+static PyObject * string_or_none(const char *value) {
+  if (value == NULL) {
+    Py_RETURN_NONE;
+  }
+  return PyUnicode_FromString(value);
+}
+
+static PyObject * uprocd_py_config_string(PyObject *module, PyObject *args) {
+  const char *key;
+  if (!PyArg_ParseTuple(args, "s", &key)) {
+    return NULL;
+  }
+  return string_or_none(uprocd_config_string(key));
+}
+
+static PyObject * uprocd_py_config_string_at(PyObject *module, PyObject *args) {
+  const char *key;
+  int index;
+  if (!PyArg_ParseTuple(args, "si", &key, &index)) {
+    return NULL;
+  }
+  return string_or_none(uprocd_config_string_at(key, index));
+}
+
+static PyMethodDef uprocd_methods[] = {
+  {"run", uprocd_py_run, METH_NOARGS,
+   "Serve requests, returning a Context inside each forked child."},
+  {"enter", uprocd_py_enter, METH_O, "Enter the given Context."},
+  {"on_exit", uprocd_py_on_exit, METH_O,
+   "Set a function to be called if serving requests fails."},
+  {"module_name", uprocd_py_module_name, METH_NOARGS,
+   "Return the name of the running module."},
+  {"module_directory", uprocd_py_module_directory, METH_NOARGS,
+   "Return the directory holding the module's .module file."},
+  {"config_present", uprocd_py_config_present, METH_VARARGS,
+   "Return whether the given property is present."},
+  {"config_list_size", uprocd_py_config_list_size, METH_VARARGS,
+   "Return the size of the list at the given property."},
+  {"config_number", uprocd_py_config_number, METH_VARARGS,
+   "Return the number at the given property."},
+  {"config_number_at", uprocd_py_config_number_at, METH_VARARGS,
+   "Return the number at the given index of a list property."},
+  {"config_string", uprocd_py_config_string, METH_VARARGS,
+   "Return the string at the given property."},
+  {"config_string_at", uprocd_py_config_string_at, METH_VARARGS,
+   "Return the string at the given index of a list property."},
+  {NULL}
+};
+
+static struct PyModuleDef uprocd_module = {
+  PyModuleDef_HEAD_INIT,
+  .m_name = "uprocd",
+  .m_doc = "Bindings to the uprocd native module API.",
+  .m_size = -1,
+  .m_methods = uprocd_methods,
+};
+
+PyObject * PyInit_uprocd(void) {
+  if (PyType_Ready(&Context_Type) < 0) {
+    return NULL;
+  }
+
+  PyObject *module = PyModule_Create(&uprocd_module);
+  if (module == NULL) {
+    return NULL;
+  }
+
+  Py_INCREF(&Context_Type);
+  if (PyModule_AddObject(module, "Context", (PyObject*)&Context_Type) < 0) {
+    Py_DECREF(&Context_Type);
+    Py_DECREF(module);
+    return NULL;
+  }
+
+  return module;
+}
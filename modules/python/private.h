@@ -0,0 +1,18 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef PYTHON_PRIVATE_H
+#define PYTHON_PRIVATE_H
+
+#include "uprocd.h"
+
+#include <Python.h>
+
+void freeze_heap();
+void enter_child(uprocd_context *ctx);
+
+PyObject * PyInit_uprocd(void);
+int binding_context_returned();
+
+#endif
@@ -2,9 +2,7 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
-#include "uprocd.h"
-
-#include <Python.h>
+#include "private.h"
 
 void set_environment(uprocd_context *ctx) {
   PyObject *osmod = NULL, *environ = NULL;
@@ -48,39 +46,244 @@ void set_environment(uprocd_context *ctx) {
   }
 }
 
-UPROCD_EXPORT int uprocd_module_entry() {
-  Py_SetProgramName(L"python");
-  Py_Initialize();
+static PyObject * call_gc(const char *method, PyObject *args) {
+  PyObject *gcmod = PyImport_ImportModule("gc");
+  if (gcmod == NULL) {
+    return NULL;
+  }
 
-  char *modules_path = uprocd_module_path("_uprocd_modules.py");
-  FILE *modules = fopen(modules_path, "r");
-  if (modules == NULL) {
-    fprintf(stderr, "Error loading _uprocd_modules.py: %s\n", strerror(errno));
-    return 1;
+  PyObject *func = PyObject_GetAttrString(gcmod, method), *result = NULL;
+  Py_DECREF(gcmod);
+  if (func != NULL) {
+    result = PyObject_CallObject(func, args);
+    Py_DECREF(func);
   }
+  return result;
+}
 
-  PyRun_SimpleFileEx(modules, modules_path, 1);
-  uprocd_module_path_free(modules_path);
+static PyObject *g_profile = NULL;
 
-  const char *preload = uprocd_config_string("Preload");
-  PyRun_SimpleString(preload);
+// Imports _uprocd_profile from the module directory and preloads the modules that
+// this module's children have used frequently.
+PyObject * profile_preload() {
+  PyObject *sys_path = PySys_GetObject("path");
+  PyObject *directory = PyUnicode_FromString(uprocd_module_directory());
+  if (sys_path == NULL || directory == NULL || PyList_Insert(sys_path, 0, directory)) {
+    Py_XDECREF(directory);
+    PyErr_Print();
+    return NULL;
+  }
 
-  uprocd_context *ctx = uprocd_run();
-  uprocd_context_enter(ctx);
+  PyObject *profile = PyImport_ImportModule("_uprocd_profile");
+  PySequence_DelItem(sys_path, 0);
+  Py_DECREF(directory);
+  if (profile == NULL) {
+    PyErr_Print();
+    return NULL;
+  }
 
-  set_environment(ctx);
+  PyObject *result = PyObject_CallMethod(profile, "preload", "sdd", uprocd_module_name(),
+                                         uprocd_config_number("ProfileMinFraction"),
+                                         uprocd_config_number("ProfileBudget"));
+  if (result == NULL) {
+    PyErr_Print();
+  } else {
+    Py_DECREF(result);
+  }
 
-  int argc, has_run_offset = 0;
-  char **argv;
-  uprocd_context_get_args(ctx, &argc, &argv);
+  return profile;
+}
+
+// Reference counting and the cyclic GC write to every object header, so a child's
+// first collection would otherwise copy most of the preloaded heap. Collecting here
+// and moving everything left into the permanent generation keeps those pages shared.
+void freeze_heap() {
+  PyObject *result;
+
+  int nthresholds = uprocd_config_list_size("GcThresholds");
+  if (nthresholds > 0) {
+    PyObject *args = PyTuple_New(nthresholds);
+    for (int i = 0; i < nthresholds; i++) {
+      PyTuple_SET_ITEM(args, i,
+                       PyLong_FromDouble(uprocd_config_number_at("GcThresholds", i)));
+    }
+
+    result = call_gc("set_threshold", args);
+    Py_DECREF(args);
+    if (result == NULL) {
+      PyErr_Print();
+    } else {
+      Py_DECREF(result);
+    }
+  }
+
+  if (!uprocd_config_number("FreezeHeap")) {
+    return;
+  }
+
+  result = call_gc("collect", NULL);
+  if (result == NULL) {
+    PyErr_Print();
+    return;
+  }
+  Py_DECREF(result);
+
+  // gc.freeze is only available on Python 3.7 and newer.
+  result = call_gc("freeze", NULL);
+  if (result == NULL) {
+    if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+      PyErr_Clear();
+    } else {
+      PyErr_Print();
+    }
+    return;
+  }
+  Py_DECREF(result);
+}
+
+// Lets CPython treat uprocd's forks like os.fork: the import lock is held across them,
+// threading state is reset in the child, and os.register_at_fork handlers run (which is
+// also how the random module reseeds itself).
+static void before_fork(void *unused) {
+#if PY_VERSION_HEX >= 0x03070000
+  PyOS_BeforeFork();
+#endif
+}
+
+static void after_fork_parent(void *unused) {
+#if PY_VERSION_HEX >= 0x03070000
+  PyOS_AfterFork_Parent();
+#endif
+}
+
+static void after_fork_child(void *unused) {
+#if PY_VERSION_HEX >= 0x03070000
+  PyOS_AfterFork_Child();
+#else
+  PyOS_AfterFork();
+#endif
+}
+
+// Resolves a console_scripts-style "package.module:func" entry point.
+PyObject * resolve_entry_point(const char *entry) {
+  const char *colon = strchr(entry, ':');
+  if (colon == NULL) {
+    fprintf(stderr, "Invalid EntryPoint %s: expected module:function.\n", entry);
+    return NULL;
+  }
+
+  PyObject *module_name = PyUnicode_FromStringAndSize(entry, colon - entry);
+  PyObject *obj = PyImport_Import(module_name);
+  Py_DECREF(module_name);
+
+  // Extras such as "module:func [extra]" don't matter here.
+  const char *attrs = colon + 1, *attrs_end = attrs + strcspn(attrs, " [");
+  while (obj != NULL && attrs < attrs_end) {
+    const char *dot = memchr(attrs, '.', attrs_end - attrs);
+    const char *end = dot ? dot : attrs_end;
+
+    PyObject *name = PyUnicode_FromStringAndSize(attrs, end - attrs);
+    PyObject *next = PyObject_GetAttr(obj, name);
+    Py_DECREF(name);
+    Py_DECREF(obj);
+    obj = next;
+
+    attrs = end + 1;
+  }
+
+  if (obj == NULL) {
+    fprintf(stderr, "Error resolving EntryPoint %s:\n", entry);
+    PyErr_Print();
+  }
+  return obj;
+}
+
+int set_sys_argv(const char *argv0, int argc, char **argv) {
+  PyObject *list = PyList_New(argc);
+  if (list == NULL) {
+    return -1;
+  }
+
+  for (int i = 0; i < argc; i++) {
+    PyObject *arg = PyUnicode_DecodeFSDefault(i == 0 ? argv0 : argv[i]);
+    if (arg == NULL) {
+      Py_DECREF(list);
+      return -1;
+    }
+    PyList_SET_ITEM(list, i, arg);
+  }
+
+  int rc = PySys_SetObject("argv", list);
+  Py_DECREF(list);
+  return rc;
+}
 
-  const char *run = uprocd_config_string("Run");
-  if (strlen(run) != 0) {
-    has_run_offset = 2;
+// Mirrors how "python -c" treats the result of its code: an uncaught SystemExit is
+// handled (and exits) inside PyErr_Print, anything else is reported as a failure.
+int finish_main(PyObject *result) {
+  int ret = 0;
+
+  if (result == NULL) {
+    PyErr_Print();
+    ret = 1;
+  } else if (result != Py_None && PyLong_Check(result)) {
+    ret = (int)PyLong_AsLong(result);
+  } else if (result != Py_None) {
+    // Like sys.exit, any other value is printed and treated as a failure.
+    PyObject *str = PyObject_Str(result);
+    if (str != NULL) {
+      PySys_FormatStderr("%U\n", str);
+      Py_DECREF(str);
+    }
+    PyErr_Clear();
+    ret = 1;
+  }
+  Py_XDECREF(result);
+
+  if (Py_FinalizeEx() < 0) {
+    ret = 120;
+  }
+  return ret;
+}
+
+int run_entry_point(PyObject *entry_point, int argc, char **argv) {
+  if (set_sys_argv(argv[0], argc, argv) == -1) {
+    PyErr_Print();
+    return 1;
   }
 
-  argc += has_run_offset;
+  PyObject *result = PyObject_CallObject(entry_point, NULL);
+  Py_DECREF(entry_point);
+  return finish_main(result);
+}
+
+int run_compiled(PyObject *code, int argc, char **argv) {
+  if (set_sys_argv("-c", argc, argv) == -1) {
+    PyErr_Print();
+    return 1;
+  }
 
+  // Same as -c, the current directory goes first on sys.path.
+  PyObject *sys_path = PySys_GetObject("path"), *empty = PyUnicode_FromString("");
+  if (sys_path != NULL && empty != NULL) {
+    PyList_Insert(sys_path, 0, empty);
+  }
+  Py_XDECREF(empty);
+
+  PyObject *main_dict = PyModule_GetDict(PyImport_AddModule("__main__"));
+  PyObject *result = PyEval_EvalCode(code, main_dict, main_dict);
+  Py_DECREF(code);
+
+  // The module's own return value is meaningless, only exceptions matter.
+  if (result != NULL) {
+    Py_DECREF(result);
+    result = Py_None;
+    Py_INCREF(result);
+  }
+  return finish_main(result);
+}
+
+int run_interpreter(int argc, char **argv) {
   wchar_t **wargv = PyMem_RawMalloc(sizeof(wchar_t*) * (argc + 1));
   if (wargv == NULL) {
     fprintf(stderr, "Error initializing Python interpreter: Out of memory.\n");
@@ -88,26 +291,94 @@ UPROCD_EXPORT int uprocd_module_entry() {
   }
 
   wargv[0] = L"python";
-
-  if (has_run_offset) {
-    wargv[1] = L"-c";
-    wargv[2] = Py_DecodeLocale(run, NULL);
-    if (wargv[2] == NULL) {
-      fprintf(stderr, "Error decoding Run argument.\n");
+  for (int i = 1; i < argc; i++) {
+    wargv[i] = Py_DecodeLocale(argv[i], NULL);
+    if (wargv[i] == NULL) {
+      fprintf(stderr, "Error initializing Python interpreter: Error decoding argv.\n");
       return 1;
     }
   }
 
-  for (int i = has_run_offset + 1; i < argc; i++) {
-    wargv[i] = Py_DecodeLocale(argv[i - has_run_offset], NULL);
-    if (wargv[i] == NULL) {
-      fprintf(stderr, "Error initializing Python interpreter: Error decoding argv.\n");
+  wargv[argc] = NULL;
+  return Py_Main(argc, wargv);
+}
+
+void enter_child(uprocd_context *ctx) {
+  uprocd_context_enter(ctx);
+  set_environment(ctx);
+
+  if (g_profile) {
+    PyObject *result = PyObject_CallMethod(g_profile, "record", "s",
+                                           uprocd_module_name());
+    if (result == NULL) {
+      PyErr_Print();
+    } else {
+      Py_DECREF(result);
+    }
+    Py_CLEAR(g_profile);
+  }
+}
+
+UPROCD_EXPORT int uprocd_module_entry() {
+  PyImport_AppendInittab("uprocd", PyInit_uprocd);
+  Py_SetProgramName(L"python");
+  Py_Initialize();
+
+  uprocd_on_before_fork(before_fork, NULL);
+  uprocd_on_after_fork_parent(after_fork_parent, NULL);
+  uprocd_on_after_fork_child(after_fork_child, NULL);
+
+  if (uprocd_config_number("ProfilePreload")) {
+    g_profile = profile_preload();
+  }
+
+  const char *preload = uprocd_config_string("Preload");
+  int preload_rc = PyRun_SimpleString(preload);
+
+  if (binding_context_returned()) {
+    // The preload code called uprocd.run() itself, so this is a child that has now
+    // finished running the application.
+    int ret = preload_rc == 0 ? 0 : 1;
+    if (Py_FinalizeEx() < 0) {
+      ret = 120;
+    }
+    return ret;
+  }
+
+  PyObject *run_code = NULL, *entry_point = NULL;
+  const char *run = uprocd_config_string("Run"),
+             *entry = uprocd_config_string("EntryPoint");
+  if (strlen(entry) != 0) {
+    entry_point = resolve_entry_point(entry);
+    if (entry_point == NULL) {
+      return 1;
+    }
+  } else if (strlen(run) != 0) {
+    run_code = Py_CompileString(run, "<string>", Py_file_input);
+    if (run_code == NULL) {
+      fprintf(stderr, "Error compiling Run code:\n");
+      PyErr_Print();
       return 1;
     }
   }
 
-  wargv[argc] = NULL;
-  int ret = Py_Main(argc, wargv);
+  freeze_heap();
+
+  uprocd_context *ctx = uprocd_run();
+  enter_child(ctx);
+
+  int argc;
+  char **argv;
+  uprocd_context_get_args(ctx, &argc, &argv);
+
+  int ret;
+  if (entry_point) {
+    ret = run_entry_point(entry_point, argc, argv);
+  } else if (run_code) {
+    ret = run_compiled(run_code, argc, argv);
+  } else {
+    ret = run_interpreter(argc, argv);
+  }
 
   uprocd_context_free(ctx);
   return ret;
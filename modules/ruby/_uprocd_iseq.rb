@@ -0,0 +1,58 @@
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+# A persistent cache of compiled instruction sequences, so the preload doesn't have to
+# recompile every required file from source on each template boot. Ruby calls
+# RubyVM::InstructionSequence.load_iseq for every file it loads, and falls back to
+# compiling the file itself if it returns nil.
+
+require 'digest/sha1'
+require 'fileutils'
+
+module Uprocd
+  module ISeqCache
+    def self.directory
+      @directory ||= begin
+        cache = ENV['XDG_CACHE_HOME'] || File.join(Dir.home, '.cache')
+        dir = File.join(cache, 'uprocd', 'ruby', 'iseq', "#{RUBY_VERSION}-#{RUBY_PLATFORM}")
+        FileUtils.mkdir_p dir
+        dir
+      end
+    end
+
+    # Entries start with the source's mtime and size, so edited files are recompiled.
+    def self.header(stat)
+      "#{stat.mtime.to_i}.#{stat.mtime.nsec}:#{stat.size}\n"
+    end
+
+    def self.load(path)
+      stat = File.stat(path)
+      entry = File.join(directory, Digest::SHA1.hexdigest(path))
+      header = header(stat)
+
+      begin
+        data = File.binread(entry)
+        if data.start_with? header
+          return RubyVM::InstructionSequence.load_from_binary(data[header.size..-1])
+        end
+      rescue SystemCallError
+      end
+
+      iseq = RubyVM::InstructionSequence.compile_file(path)
+      tmp = "#{entry}.#{Process.pid}"
+      File.binwrite(tmp, header + iseq.to_binary)
+      File.rename(tmp, entry)
+      iseq
+    rescue SyntaxError, StandardError
+      # Let Ruby compile the file normally and report any errors itself.
+      nil
+    end
+  end
+end
+
+class RubyVM::InstructionSequence
+  def self.load_iseq(path)
+    Uprocd::ISeqCache.load(path)
+  end
+end
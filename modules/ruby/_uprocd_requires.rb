@@ -1,12 +1,126 @@
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require 'fileutils'
+require 'json'
 require 'pathname'
 
-$:.each do |path|
-  if path.include? "/ruby/#{RUBY_VERSION}"
-    paths = Pathname.glob("#{path}/*.{rb,so}")
-    paths
-      .map{|p| p.basename.sub_ext ''}
-      .map(&:to_s)
-      .select{|req| !['continuation', 'debug', 'profile'].include? req }
-      .each{|req| require req}
+require_relative '_uprocd_iseq' if Uprocd::ISEQ_CACHE
+
+module Uprocd
+  STDLIB_EXCLUDES = ['continuation', 'debug', 'profile']
+
+  def self.stdlib_requires
+    $:.select{|path| path.include? "/ruby/#{RbConfig::CONFIG['ruby_version']}"}.flat_map do |path|
+      Pathname.glob("#{path}/*.{rb,so}")
+        .map{|p| p.basename.sub_ext('').to_s}
+        .reject{|req| STDLIB_EXCLUDES.include? req}
+    end
+  end
+
+  def self.profile_paths
+    cache = ENV['XDG_CACHE_HOME'] || File.join(Dir.home, '.cache')
+    base = File.join(cache, 'uprocd', 'ruby', MODULE_NAME)
+    FileUtils.mkdir_p File.dirname(base)
+    ["#{base}.profile.json", "#{base}.features"]
+  end
+
+  # Folds the features logged by children into the persistent profile and returns the
+  # ones enough of them used, in the order they were first required.
+  def self.learned_requires
+    profile_path, log = profile_paths
+
+    profile = begin
+      JSON.parse(File.read(profile_path))
+    rescue SystemCallError, JSON::ParserError
+      {'runs' => 0, 'features' => {}}
+    end
+
+    folding = "#{log}.#{Process.pid}"
+    begin
+      File.rename(log, folding)
+    rescue SystemCallError
+    else
+      File.foreach(folding) do |line|
+        used = JSON.parse(line) rescue next
+        profile['runs'] += 1
+        used.each_with_index do |feature, position|
+          stats = profile['features'][feature] ||= {'count' => 0, 'position' => 0.0}
+          stats['count'] += 1
+          stats['position'] += (position - stats['position']) / stats['count']
+        end
+      end
+      File.delete(folding)
+
+      tmp = "#{profile_path}.#{Process.pid}"
+      File.write(tmp, JSON.generate(profile))
+      File.rename(tmp, profile_path)
+    end
+
+    runs = profile['runs']
+    return [] if runs == 0
+
+    profile['features']
+      .select{|_, stats| stats['count'].to_f / runs >= PROFILE_MIN_FRACTION}
+      .sort_by{|_, stats| stats['position']}
+      .map(&:first)
+  end
+
+  def self.profile_requires(profile)
+    case profile
+    when 'minimal'
+      []
+    when 'stdlib'
+      stdlib_requires
+    when 'rails'
+      stdlib_requires + ['bundler/setup', 'rails/all']
+    when 'learned'
+      learned_requires
+    else
+      puts "Unknown PreloadProfile #{profile}, falling back to minimal."
+      []
+    end
+  end
+
+  def self.preload
+    profile_requires(PRELOAD_PROFILE).each do |req|
+      begin
+        require req
+      rescue LoadError, StandardError => ex
+        puts "Error preloading #{req}: #{ex}" unless PRELOAD_PROFILE == 'stdlib'
+      end
+    end
+  end
+
+  module RequireRecorder
+    def self.requested
+      @requested ||= []
+    end
+
+    private def require(name)
+      RequireRecorder.requested << name.to_s
+      super
+    end
+  end
+
+  # Called in each child when the learned profile is used. Logs both what was
+  # required (preloaded features included, so unused ones can drop out of the profile)
+  # and what was newly loaded.
+  def self.record
+    baseline = $LOADED_FEATURES.dup
+    Object.prepend RequireRecorder
+
+    at_exit do
+      used = (RequireRecorder.requested + ($LOADED_FEATURES - baseline)).uniq
+      begin
+        File.open(profile_paths[1], File::WRONLY | File::APPEND | File::CREAT, 0600) do |fp|
+          fp.syswrite(JSON.generate(used) + "\n")
+        end
+      rescue SystemCallError
+      end
+    end
   end
 end
+
+Uprocd.preload
@@ -35,10 +35,75 @@ static void check_error(const char *message) {
   rb_funcall(rb_mKernel, rb_intern("puts"), 2, rb_str_new_cstr(message), msg);
 }
 
+static VALUE compact_gc(VALUE unused) {
+  VALUE gc = rb_const_get(rb_cObject, rb_intern("GC"));
+  // GC.compact only exists on Ruby 2.7 and newer.
+  if (rb_respond_to(gc, rb_intern("compact"))) {
+    rb_funcall(gc, rb_intern("compact"), 0);
+  }
+  return Qnil;
+}
+
+// The preload leaves a fragmented heap full of garbage, which the first GC in every
+// child would sweep and dirty. Collecting and compacting it up front lets the children
+// keep sharing those pages with the template.
+void prepare_heap() {
+  if (!uprocd_config_number("CompactHeap")) {
+    return;
+  }
+
+  rb_gc_start();
+
+  int state;
+  rb_protect(compact_gc, Qnil, &state);
+  if (state) {
+    check_error("Error compacting the heap:");
+  }
+}
+
+// Exposes the properties _uprocd_requires.rb needs as constants of the Uprocd module.
+void define_preload_constants() {
+  VALUE mod = rb_define_module("Uprocd");
+  rb_define_const(mod, "MODULE_NAME", rb_str_new_cstr(uprocd_module_name()));
+  rb_define_const(mod, "PRELOAD_PROFILE",
+                  rb_str_new_cstr(uprocd_config_string("PreloadProfile")));
+  rb_define_const(mod, "PROFILE_MIN_FRACTION",
+                  DBL2NUM(uprocd_config_number("ProfileMinFraction")));
+  rb_define_const(mod, "ISEQ_CACHE", uprocd_config_number("ISeqCache") ? Qtrue : Qfalse);
+}
+
+static VALUE record_features(VALUE unused) {
+  return rb_funcall(rb_const_get(rb_cObject, rb_intern("Uprocd")), rb_intern("record"), 0);
+}
+
+// Ruby starts a timer thread of its own, so without these handlers uprocd would refuse
+// to serve. Flushing first keeps buffered output from being written by every child,
+// and rb_thread_atfork is how Ruby expects to be told about a fork it didn't make: it
+// resets the thread list and the random seed.
+static VALUE flush_io(VALUE io) {
+  return rb_io_flush(io);
+}
+
+static void flush_stdio(void *unused) {
+  // Exceptions mustn't unwind through uprocd's own frames.
+  int state;
+  rb_protect(flush_io, rb_stdout, &state);
+  rb_protect(flush_io, rb_stderr, &state);
+  rb_set_errinfo(Qnil);
+}
+
+static void reset_after_fork(void *unused) {
+  rb_thread_atfork();
+}
+
 VALUE ruby_entry(VALUE udata) {
   VALUE verbose = ruby_verbose;
   ruby_verbose = Qnil;
 
+  define_preload_constants();
+  uprocd_on_before_fork(flush_stdio, NULL);
+  uprocd_on_after_fork_child(reset_after_fork, NULL);
+
   const char *preload = uprocd_config_string("Preload");
   const char *load_options[] = {"ruby", "-I", uprocd_module_directory(),
                                 "-r_uprocd_requires", "-e", preload};
@@ -49,11 +114,24 @@ VALUE ruby_entry(VALUE udata) {
     return 0;
   }
 
+  prepare_heap();
+
   uprocd_context *ctx = uprocd_run();
   uprocd_context_enter(ctx);
 
   set_environment(ctx);
 
+  if (uprocd_config_number("DisableGC")) {
+    rb_gc_disable();
+  }
+
+  if (strcmp(uprocd_config_string("PreloadProfile"), "learned") == 0) {
+    rb_protect(record_features, Qnil, &state);
+    if (state) {
+      check_error("Error setting up feature recording:");
+    }
+  }
+
   int argc;
   char **argv;
   uprocd_context_get_args(ctx, &argc, &argv);
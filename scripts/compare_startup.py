@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+'''
+Compare the latency of running a command through uprocd against a cold start.
+
+The module is started through systemd, then the same arguments are run both as
+uprocctl run MODULE ARGS... and as COLD ARGS..., where COLD defaults to the module
+name. For example:
+
+  scripts/compare_startup.py lua -- -e 'require "lpeg"'
+  scripts/compare_startup.py lua --cold luajit -- script.lua
+  scripts/compare_startup.py perl -- build.pl --help
+  scripts/compare_startup.py moose --cold 'perl -MMoose' -- -e 1
+'''
+
+import argparse, shlex, statistics, subprocess, sys, time
+
+
+def systemctl(*args):
+    subprocess.run(['systemctl', '--user', *args], check=True)
+
+
+def measure(command, runs):
+    results = []
+    for _ in range(runs):
+        start = time.perf_counter()
+        subprocess.run(command, check=True, stdin=subprocess.DEVNULL,
+                       stdout=subprocess.DEVNULL)
+        results.append((time.perf_counter() - start) * 1000)
+    return sorted(results)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument('module', help='The uprocd module to run.')
+    parser.add_argument('args', nargs='*', help='Arguments for both commands.')
+    parser.add_argument('--cold', help='The cold command (default: the module name).')
+    parser.add_argument('-n', '--runs', type=int, default=50,
+                        help='Number of runs per command.')
+    parser.add_argument('-w', '--warmup', type=int, default=3,
+                        help='Untimed runs before measuring each command.')
+    args = parser.parse_args()
+
+    commands = [
+        ('cold', shlex.split(args.cold or args.module) + args.args),
+        ('uprocd', ['uprocctl', 'run', args.module] + args.args),
+    ]
+
+    # uprocd@ is Type=dbus, so this only returns once preloading is done.
+    systemctl('start', 'uprocd@%s' % args.module)
+
+    print('%-8s %10s %10s %10s' % ('', 'median ms', 'p90 ms', 'min ms'))
+    for name, command in commands:
+        measure(command, args.warmup)
+        results = measure(command, args.runs)
+        p90 = results[min(len(results) - 1, int(len(results) * 0.9))]
+        print('%-8s %10.1f %10.1f %10.1f' % (name, statistics.median(results), p90,
+                                              results[0]))
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+'''
+Compare how much of a template's heap its children end up copying.
+
+For each variant, a temporary derived module is written to the user module directory
+and started through systemd. Each child then does a garbage collection, which is what
+normally dirties the shared heap, and reports its Private_Dirty from
+/proc/self/smaps_rollup. For example:
+
+  scripts/measure_cow.py python -v frozen:FreezeHeap=1 -v unfrozen:FreezeHeap=0
+  scripts/measure_cow.py ruby -v compacted:CompactHeap=1 -v fragmented:CompactHeap=0
+'''
+
+from pathlib import Path
+import argparse, os, statistics, subprocess, sys
+
+
+PROBES = {
+    'python': ['-c', 'import gc; gc.collect(); '
+                     'print(next(l.split()[1] for l in open("/proc/self/smaps_rollup") '
+                     'if l.startswith("Private_Dirty")))'],
+    'ruby': ['-e', 'GC.start; puts File.foreach("/proc/self/smaps_rollup")'
+                   '.find{|l| l.start_with?("Private_Dirty")}.split[1]'],
+}
+
+
+def module_dir():
+    config = os.environ.get('XDG_CONFIG_HOME') or os.path.expanduser('~/.config')
+    return Path(config) / 'uprocd' / 'modules'
+
+
+def parse_variant(text):
+    name, _, props = text.partition(':')
+    return name, [prop for prop in props.split(',') if prop]
+
+
+def systemctl(*args):
+    subprocess.run(['systemctl', '--user', *args], check=True)
+
+
+def measure(module, probe, runs):
+    results = []
+    for _ in range(runs):
+        out = subprocess.run(['uprocctl', 'run', module, *probe], check=True,
+                             stdout=subprocess.PIPE, universal_newlines=True).stdout
+        results.append(int(out.split()[-1]))
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument('base', choices=sorted(PROBES),
+                        help='The native module to measure.')
+    parser.add_argument('-v', '--variant', action='append', required=True,
+                        help='name:Key=Value,... properties for one variant.')
+    parser.add_argument('-n', '--runs', type=int, default=20,
+                        help='Number of children to measure per variant.')
+    args = parser.parse_args()
+
+    directory = module_dir()
+    directory.mkdir(parents=True, exist_ok=True)
+
+    print('%-16s %10s %10s %10s' % ('variant', 'median kB', 'min kB', 'max kB'))
+    for name, props in map(parse_variant, args.variant):
+        module = 'cowbench-%s-%s' % (args.base, name)
+        path = directory / ('%s.module' % module)
+        path.write_text('[DerivedModule]\nBase=%s\n%s\n' % (args.base, '\n'.join(props)))
+
+        try:
+            # uprocd@ is Type=dbus, so this only returns once preloading is done.
+            systemctl('start', 'uprocd@%s' % module)
+            results = measure(module, PROBES[args.base], args.runs)
+        finally:
+            systemctl('stop', 'uprocd@%s' % module)
+            path.unlink()
+
+        print('%-16s %10d %10d %10d' % (name, statistics.median(results), min(results),
+                                         max(results)))
+
+
+if __name__ == '__main__':
+    sys.exit(main())
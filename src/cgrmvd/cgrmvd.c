@@ -2,22 +2,39 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#define _GNU_SOURCE
+
 #include "common.h"
+#include "probes.h"
 
 #include <systemd/sd-bus.h>
 #include <systemd/sd-daemon.h>
+#include <systemd/sd-event.h>
 
+#include <linux/magic.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+// The request whose cgroup move is in progress, if its ID is known.
+char g_request_id[REQUEST_ID_SIZE];
+
+void log_fields(int priority, sds message, sds *fields, int nfields) {
+  log_with_fields("cgrmvd", stderr, NULL, g_request_id, priority, message, fields,
+                  nfields);
+}
+
 void _fail(sds message) {
   int errno_ = errno;
 
-  fprintf(stderr, SD_CRIT "%.*s\n", (int)sdslen(message), message);
   sd_notifyf(0, "STATUS=\"Failure: %s\"", message);
-  sdsfree(message);
+  log_fields(LOG_CRIT, message, NULL, 0);
 
   errno = errno_;
 }
@@ -44,51 +61,52 @@ void free_policy(policy_origins *policy) {
 }
 
 void read_policy(sds path) {
-  FILE *fp = fopen(path, "r");
-  if (fp == NULL) {
-    FAIL("Error opening %S: %s", path, strerror(errno));
+  line_reader lr;
+  int rc = line_reader_open(&lr, path);
+  if (rc < 0) {
+    FAIL("Error opening %S: %s", path, strerror(-rc));
     return;
   }
 
-  sds line = NULL;
-  int rc = 0, lineno = 0;
+  char *line;
+  size_t len;
+  int lineno = 0;
 
-  while ((rc = readline(fp, &line)) == 0 && line != NULL) {
+  while ((line = line_reader_next(&lr, &len))) {
     lineno++;
-    sdstrim(line, "\t ");
+    while (len && (line[len - 1] == ' ' || line[len - 1] == '\t')) {
+      line[--len] = 0;
+    }
+    while (*line == ' ' || *line == '\t') {
+      line++;
+      len--;
+    }
 
-    size_t len = sdslen(line);
     if (len == 0 || line[0] == '#') {
-      goto parse_end;
+      continue;
     }
 
     char *mid = strstr(line, " : ");
     if (mid == NULL) {
-      FAIL("Error parsing %S:%d.");
-      goto parse_end;
+      FAIL("Error parsing %S:%i.", path, lineno);
+      continue;
     }
 
-    sds copier = sdsdup(line), origins = sdsdup(line);
-    sdsrange(copier, 0, mid - line - 1);
-    sdsrange(origins, mid - line + 3, -1);
+    // Both halves are used straight from the buffer. Only the split origins are kept.
+    *mid = 0;
+    char *copier = line, *origins = mid + 3;
 
     policy_origins *policy = new(policy_origins);
-    policy->origins = sdssplitlen(origins, sdslen(origins), " ", 1, &policy->len);
+    policy->origins = sdssplitlen(origins, len - (origins - line), " ", 1, &policy->len);
 
     policy_origins *original = table_swap(&g_policies, copier, policy);
     if (original != NULL) {
       FAIL("WARNING: Copier %s has multiple origin values", copier);
       free_policy(original);
     }
-
-    sdsfree(copier);
-    sdsfree(origins);
-
-    parse_end:
-    sdsfree(line);
   }
 
-  fclose(fp);
+  line_reader_free(&lr);
 }
 
 void reload_policies() {
@@ -159,6 +177,16 @@ int readlink_bus(sds path, sds *out, sd_bus_error *err) {
   return 0;
 }
 
+int read_lines_bus(sds path, line_reader *lr, sd_bus_error *err) {
+  int rc = line_reader_open(lr, path);
+  if (rc < 0) {
+    BUSFAIL(err, "Error reading %S: %s", path, strerror(-rc));
+  }
+
+  sdsfree(path);
+  return rc;
+}
+
 int fopen_bus(sds path, FILE **out, char *mode, sd_bus_error *err) {
   *out = fopen(path, mode);
 
@@ -209,62 +237,48 @@ int verify_policy(int64_t copier, int64_t origin, sd_bus_error *err) {
   return 0;
 }
 
-int parse_cgroup_path(int64_t pid, FILE *fp, sds *path, sd_bus_error *err) {
-  sds line = NULL;
-  int rc = 0, nparts = 0;
-  sds *parts;
-
-  rc = readline(fp, &line);
-  if (rc < 0) {
-    BUSFAIL(err, "Error reading line from /proc/%I/cgroup: %s", pid, strerror(errno));
-    return -errno;
-  }
-
+int parse_cgroup_path(int64_t pid, line_reader *lr, sds *path, sd_bus_error *err) {
+  char *line = line_reader_next(lr, NULL);
   if (line == NULL) {
     *path = NULL;
     return 0;
   }
 
-  parts = sdssplitlen(line, sdslen(line), ":", 1, &nparts);
-  if (nparts != 3) {
-    BUSFAIL(err, "Invalid line in /proc/%I/cgroup: %S", pid, line);
-    rc = -EINVAL;
-    goto end;
-  }
-
-  if (strncmp(parts[1], "name=", 5) == 0) {
-    sdsrange(parts[1], 5, -1);
+  // Lines are hierarchy-ID:controllers:path.
+  char *controllers = strchr(line, ':');
+  char *cgroup = controllers ? strchr(controllers + 1, ':') : NULL;
+  if (cgroup == NULL || strchr(cgroup + 1, ':')) {
+    BUSFAIL(err, "Invalid line in /proc/%I/cgroup: %s", pid, line);
+    return -EINVAL;
   }
 
-  if (sdslen(parts[1]) == 0) {
-    sdsfree(parts[1]);
-    parts[1] = sdsnew("unified");
+  *cgroup++ = 0;
+  controllers++;
+  if (strncmp(controllers, "name=", 5) == 0) {
+    controllers += 5;
   }
 
-  *path = sdscatfmt(sdsempty(), "/sys/fs/cgroup/%S%S", parts[1], parts[2]);
+  *path = sdscatfmt(sdsempty(), "/sys/fs/cgroup/%s%s",
+                    *controllers ? controllers : "unified", cgroup);
   if ((*path)[sdslen(*path) - 1] == '/') {
     sdsrange(*path, 0, -2);
   }
 
-  end:
-  sdsfree(line);
-
-  if (parts) {
-    sdsfreesplitres(parts, nparts);
-  }
-  return rc;
+  return 0;
 }
 
-int move_cgroups(int64_t copier, int64_t origin, sd_bus_error *err) {
-  FILE *copier_fp = NULL, *origin_fp = NULL;
+int move_cgroups_legacy(int64_t copier, int64_t origin, sd_bus_error *err) {
+  line_reader copier_lines = {0}, origin_lines = {0};
   int rc = 0;
 
-  rc = fopen_bus(sdscatfmt(sdsempty(), "/proc/%I/cgroup", copier), &copier_fp, "r", err);
+  rc = read_lines_bus(sdscatfmt(sdsempty(), "/proc/%I/cgroup", copier), &copier_lines,
+                      err);
   if (rc < 0) {
     goto end;
   }
 
-  rc = fopen_bus(sdscatfmt(sdsempty(), "/proc/%I/cgroup", origin), &origin_fp, "r", err);
+  rc = read_lines_bus(sdscatfmt(sdsempty(), "/proc/%I/cgroup", origin), &origin_lines,
+                      err);
   if (rc < 0) {
     goto end;
   }
@@ -272,12 +286,12 @@ int move_cgroups(int64_t copier, int64_t origin, sd_bus_error *err) {
   for (;;) {
     sds copier_path = NULL, origin_path = NULL;
 
-    rc = parse_cgroup_path(origin, origin_fp, &origin_path, err);
+    rc = parse_cgroup_path(origin, &origin_lines, &origin_path, err);
     if (rc < 0 || origin_path == NULL) {
       goto end;
     }
 
-    rc = parse_cgroup_path(copier, copier_fp, &copier_path, err);
+    rc = parse_cgroup_path(copier, &copier_lines, &copier_path, err);
     if (rc < 0 || copier_path == NULL) {
       sdsfree(origin_path);
       goto end;
@@ -318,20 +332,192 @@ int move_cgroups(int64_t copier, int64_t origin, sd_bus_error *err) {
   }
 
   end:
-  if (copier_fp) {
-    fclose(copier_fp);
+  line_reader_free(&copier_lines);
+  line_reader_free(&origin_lines);
+  return rc;
+}
+
+int is_unified_hierarchy() {
+  static int unified = -1;
+  if (unified == -1) {
+    struct statfs st;
+    unified = statfs("/sys/fs/cgroup", &st) == 0 && st.f_type == CGROUP2_SUPER_MAGIC;
+  }
+  return unified;
+}
+
+int read_unified_cgroup(int64_t pid, sds *path, sd_bus_error *err) {
+  char proc_path[64], buf[4096];
+  snprintf(proc_path, sizeof(proc_path), "/proc/%" PRId64 "/cgroup", pid);
+
+  int fd = open(proc_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    BUSFAIL(err, "Error reading %s: %s", proc_path, strerror(errno));
+    return -errno;
+  }
+
+  ssize_t sz = read(fd, buf, sizeof(buf) - 1);
+  int errno_ = errno;
+  close(fd);
+  if (sz == -1) {
+    BUSFAIL(err, "Error reading %s: %s", proc_path, strerror(errno_));
+    return -errno_;
+  }
+  buf[sz] = 0;
+
+  // On a pure v2 host, the only entry is "0::<path>".
+  if (strncmp(buf, "0::", 3) != 0) {
+    BUSFAIL(err, "Unexpected contents of %s: %s", proc_path, buf);
+    return -EINVAL;
+  }
+
+  char *start = buf + 3, *end = strchr(start, '\n');
+  *path = sdsnewlen(start, end ? end - start : strlen(start));
+  return 0;
+}
+
+#define CGROUP_FD_CACHE_SIZE 16
+
+struct {
+  sds path;
+  int fd;
+  uint64_t last_used;
+} g_cgroup_fds[CGROUP_FD_CACHE_SIZE];
+uint64_t g_cgroup_fds_clock = 0;
+
+void evict_cgroup_fd(int slot) {
+  sdsfree(g_cgroup_fds[slot].path);
+  close(g_cgroup_fds[slot].fd);
+  g_cgroup_fds[slot].path = NULL;
+}
+
+// Returns the cache slot holding an open directory fd for the given cgroup.
+int get_cgroup_fd(sds path, sd_bus_error *err) {
+  // Prefer an empty slot, otherwise the least recently used one.
+  int victim = -1;
+  for (int i = 0; i < CGROUP_FD_CACHE_SIZE; i++) {
+    if (g_cgroup_fds[i].path == NULL) {
+      if (victim == -1 || g_cgroup_fds[victim].path != NULL) {
+        victim = i;
+      }
+    } else if (strcmp(g_cgroup_fds[i].path, path) == 0) {
+      g_cgroup_fds[i].last_used = ++g_cgroup_fds_clock;
+      return i;
+    } else if (victim == -1 || (g_cgroup_fds[victim].path != NULL &&
+                                g_cgroup_fds[i].last_used <
+                                g_cgroup_fds[victim].last_used)) {
+      victim = i;
+    }
+  }
+
+  sds dir = sdscat(sdsnew("/sys/fs/cgroup"), path);
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    BUSFAIL(err, "Error opening %S: %s", dir, strerror(errno));
+    sdsfree(dir);
+    return -errno;
+  }
+  sdsfree(dir);
+
+  if (g_cgroup_fds[victim].path != NULL) {
+    evict_cgroup_fd(victim);
+  }
+  g_cgroup_fds[victim].path = sdsdup(path);
+  g_cgroup_fds[victim].fd = fd;
+  g_cgroup_fds[victim].last_used = ++g_cgroup_fds_clock;
+  return victim;
+}
+
+int move_cgroups_unified(int64_t copier, int64_t origin, sd_bus_error *err) {
+  sds copier_path = NULL, origin_path = NULL;
+  int rc;
+
+  rc = read_unified_cgroup(origin, &origin_path, err);
+  if (rc < 0) {
+    goto end;
   }
-  if (origin_fp) {
-    fclose(origin_fp);
+
+  rc = read_unified_cgroup(copier, &copier_path, err);
+  if (rc < 0 || strcmp(origin_path, copier_path) == 0) {
+    goto end;
   }
+
+  char pid[32];
+  int pidlen = snprintf(pid, sizeof(pid), "%" PRId64 "\n", copier);
+
+  // A cached fd may refer to a cgroup that has since been removed, so retry once with
+  // a freshly opened directory.
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int slot = get_cgroup_fd(origin_path, err);
+    if (slot < 0) {
+      rc = slot;
+      goto end;
+    }
+
+    int procs = openat(g_cgroup_fds[slot].fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (procs == -1) {
+      rc = -errno;
+      evict_cgroup_fd(slot);
+      if (rc == -ENOENT && attempt == 0) {
+        continue;
+      }
+
+      BUSFAIL(err, "Error opening %S/cgroup.procs: %s", origin_path, strerror(-rc));
+      goto end;
+    }
+
+    if (write(procs, pid, pidlen) == -1) {
+      rc = -errno;
+      BUSFAIL(err, "Error writing to %S/cgroup.procs: %s", origin_path,
+              strerror(-rc));
+    } else {
+      rc = 0;
+    }
+    close(procs);
+    break;
+  }
+
+  end:
+  sdsfree(copier_path);
+  sdsfree(origin_path);
+  return rc;
+}
+
+int move_cgroups(int64_t copier, int64_t origin, const char *request_id,
+                 const char *transport, sd_bus_error *err) {
+  int rc;
+  snprintf(g_request_id, sizeof(g_request_id), "%s", request_id);
+  uint64_t start = monotonic_usec();
+
+  PROBE(cgrmvd, move__start, origin, copier);
+  if (is_unified_hierarchy()) {
+    rc = move_cgroups_unified(copier, origin, err);
+  } else {
+    rc = move_cgroups_legacy(copier, origin, err);
+  }
+  PROBE(cgrmvd, move__done, origin, copier, rc);
+
+  sds fields[] = {
+    sdscatfmt(sdsempty(), "MOVE_USEC=%U", monotonic_usec() - start),
+    sdscatfmt(sdsempty(), "TRANSPORT=%s", transport),
+    sdscatfmt(sdsempty(), "RESULT=%i", rc),
+  };
+  log_fields(LOG_DEBUG, FMT("Moved %I into the cgroups of %I.", copier, origin), fields,
+             3);
+
+  g_request_id[0] = '\0';
   return rc;
 }
 
 int service_method_move_cgroup(sd_bus_message *msg, void *data, sd_bus_error *err) {
   int64_t copier, origin;
+  const char *request_id = "";
   int rc;
 
   rc = sd_bus_message_read(msg, "xx", &copier, &origin);
+  if (rc >= 0 && strcmp(sd_bus_message_get_signature(msg, 1), "xxs") == 0) {
+    rc = sd_bus_message_read(msg, "s", &request_id);
+  }
   if (rc < 0) {
     FAIL("Error parsing bus message: %s", strerror(-rc));
     return rc;
@@ -342,7 +528,7 @@ int service_method_move_cgroup(sd_bus_message *msg, void *data, sd_bus_error *er
     return rc;
   }
 
-  rc = move_cgroups(copier, origin, err);
+  rc = move_cgroups(copier, origin, request_id, "dbus", err);
   if (rc < 0) {
     return rc;
   }
@@ -355,15 +541,213 @@ static const sd_bus_vtable service_vtable[] = {
   // MoveCgroup(Int64 copier_pid, Int64 origin_pid)
   SD_BUS_METHOD("MoveCgroup", "xx", "", service_method_move_cgroup,
                 SD_BUS_VTABLE_UNPRIVILEGED),
+  // MoveCgroupForRequest(Int64 copier_pid, Int64 origin_pid, String request_id)
+  SD_BUS_METHOD("MoveCgroupForRequest", "xxs", "", service_method_move_cgroup,
+                SD_BUS_VTABLE_UNPRIVILEGED),
   SD_BUS_VTABLE_END
 };
 
-void bus_loop() {
-  // XXX: This code is similar to uprocd/bus.c.
+typedef struct socket_client {
+  int fd;
+  struct ucred cred;
+  sd_event_source *source;
+} socket_client;
+
+void socket_client_free(socket_client *client) {
+  sd_event_source_unref(client->source);
+  close(client->fd);
+  free(client);
+}
+
+int read_parent_pid(pid_t pid, pid_t *ppid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+
+  line_reader lr;
+  int rc = line_reader_open(&lr, path);
+  if (rc < 0) {
+    return rc;
+  }
+
+  char *line;
+  *ppid = 0;
+  while ((line = line_reader_next(&lr, NULL))) {
+    if (strncmp(line, "PPid:", 5) == 0) {
+      *ppid = strtol(line + 5, NULL, 10);
+      break;
+    }
+  }
+
+  line_reader_free(&lr);
+  return *ppid ? 0 : -ESRCH;
+}
+
+int socket_move_cgroup(socket_client *client, int copier_fd, int origin_fd,
+                       const char *request_id) {
+  sd_bus_error err = SD_BUS_ERROR_NULL;
+  pid_t copier, origin, ppid;
+  int rc;
+
+  // The pids come from pidfds the client holds, so they cannot have been recycled
+  // while the request was in flight.
+  copier = pidfd_get_pid(copier_fd);
+  origin = pidfd_get_pid(origin_fd);
+  if (copier < 0 || origin < 0) {
+    FAIL("Socket client %i sent a stale or invalid pidfd.", (int)client->cred.pid);
+    return copier < 0 ? copier : origin;
+  }
+
+  // A client may only move its own children, which is what a template does.
+  rc = read_parent_pid(copier, &ppid);
+  if (rc < 0) {
+    FAIL("Error reading parent of %i: %s", (int)copier, strerror(-rc));
+    return rc;
+  }
+  if (ppid != client->cred.pid) {
+    FAIL("Socket client %i tried to move %i, which is not its child.",
+         (int)client->cred.pid, (int)copier);
+    return -EPERM;
+  }
+
+  rc = verify_policy(copier, origin, &err);
+  if (rc == 0) {
+    rc = move_cgroups(copier, origin, request_id, "socket", &err);
+  }
+  sd_bus_error_free(&err);
+  if (rc < 0) {
+    return rc;
+  }
+
+  if (pidfd_get_pid(copier_fd) != copier) {
+    FAIL("WARNING: copier %i exited during the cgroup move.", (int)copier);
+    return -ESRCH;
+  }
+
+  return 0;
+}
+
+int socket_client_handler(sd_event_source *source, int fd, uint32_t revents,
+                          void *userdata) {
+  socket_client *client = userdata;
+  cgrmvd_request req;
+  int fds[2], nfds = 2;
+
+  ssize_t sz = recv_fds(fd, &req, sizeof(req), fds, &nfds);
+  if (sz == -EAGAIN) {
+    return 0;
+  } else if (sz <= 0) {
+    if (sz < 0) {
+      FAIL("Error reading from socket client %i: %s", (int)client->cred.pid,
+           strerror(-sz));
+    }
+    socket_client_free(client);
+    return 0;
+  }
+
+  // Version 1 requests are still accepted, they just have no request ID.
+  int valid = nfds == 2 && ((sz == sizeof(req) && req.version == CGRMVD_PROTOCOL_VERSION) ||
+                            (sz == CGRMVD_REQUEST_V1_SIZE && req.version == 1));
+  if (valid && sz == CGRMVD_REQUEST_V1_SIZE) {
+    req.request_id[0] = '\0';
+  }
+  req.request_id[sizeof(req.request_id) - 1] = '\0';
+
+  cgrmvd_response resp = { .serial = req.serial, .status = 0 };
+  if (!valid) {
+    FAIL("Invalid request from socket client %i.", (int)client->cred.pid);
+    resp.status = -EINVAL;
+  } else {
+    resp.status = socket_move_cgroup(client, fds[0], fds[1], req.request_id);
+  }
+
+  for (int i = 0; i < nfds; i++) {
+    close(fds[i]);
+  }
+
+  sz = send_fds(fd, &resp, sizeof(resp), NULL, 0);
+  if (sz < 0) {
+    FAIL("Error replying to socket client %i: %s", (int)client->cred.pid,
+         strerror(-sz));
+    socket_client_free(client);
+  }
+
+  return 0;
+}
+
+int socket_accept_handler(sd_event_source *source, int fd, uint32_t revents,
+                          void *userdata) {
+  int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (client_fd == -1) {
+    if (errno != EAGAIN && errno != EINTR) {
+      FAIL("accept4 failed: %s", strerror(errno));
+    }
+    return 0;
+  }
+
+  socket_client *client = new(socket_client);
+  client->fd = client_fd;
+
+  socklen_t len = sizeof(client->cred);
+  if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &client->cred, &len) == -1) {
+    FAIL("Error retrieving socket client credentials: %s", strerror(errno));
+    close(client_fd);
+    free(client);
+    return 0;
+  }
+
+  int rc = sd_event_add_io(sd_event_source_get_event(source), &client->source,
+                           client_fd, EPOLLIN, socket_client_handler, client);
+  if (rc < 0) {
+    FAIL("sd_event_add_io failed: %s", strerror(-rc));
+    close(client_fd);
+    free(client);
+  }
+
+  return 0;
+}
+
+int get_listen_socket() {
+  int n = sd_listen_fds(1);
+  if (n < 0) {
+    FAIL("sd_listen_fds failed: %s", strerror(-n));
+    return -1;
+  } else if (n == 0) {
+    return -1;
+  }
+
+  int fd = SD_LISTEN_FDS_START;
+  if (n > 1 || sd_is_socket_unix(fd, SOCK_SEQPACKET, 1, NULL, 0) <= 0) {
+    FAIL("WARNING: Expected a single listening AF_UNIX SOCK_SEQPACKET socket.");
+    return -1;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+void event_loop() {
   int rc;
+  sd_event *event = NULL;
+  sd_event_source *listen_source = NULL;
   sd_bus *bus = NULL;
   sd_bus_slot *slot = NULL;
 
+  rc = sd_event_default(&event);
+  if (rc < 0) {
+    FAIL("sd_event_default failed: %s", strerror(-rc));
+    goto end;
+  }
+
+  int listen_fd = get_listen_socket();
+  if (listen_fd != -1) {
+    rc = sd_event_add_io(event, &listen_source, listen_fd, EPOLLIN,
+                         socket_accept_handler, NULL);
+    if (rc < 0) {
+      FAIL("sd_event_add_io failed: %s", strerror(-rc));
+      goto end;
+    }
+  }
+
   rc = sd_bus_open_system(&bus);
   if (rc < 0) {
     FAIL("sd_bus_open_user failed: %s", strerror(-rc));
@@ -383,25 +767,22 @@ void bus_loop() {
     goto end;
   }
 
-  for (;;) {
-    rc = sd_bus_process(bus, NULL);
-    if (rc < 0) {
-      FAIL("sd_bus_process failed: %s", strerror(-rc));
-      goto end;
-    } else if (rc > 0) {
-      continue;
-    }
+  rc = sd_bus_attach_event(bus, event, 0);
+  if (rc < 0) {
+    FAIL("sd_bus_attach_event failed: %s", strerror(-rc));
+    goto end;
+  }
 
-    rc = sd_bus_wait(bus, (uint64_t)-1);
-    if (rc < 0 && rc != -EINTR) {
-      FAIL("sd_bus_wait failed: %s", strerror(-rc));
-      goto end;
-    }
+  rc = sd_event_loop(event);
+  if (rc < 0) {
+    FAIL("sd_event_loop failed: %s", strerror(-rc));
   }
 
   end:
   sd_bus_slot_unref(slot);
   sd_bus_unref(bus);
+  sd_event_source_unref(listen_source);
+  sd_event_unref(event);
 }
 
 int main(int argc, char **argv) {
@@ -410,5 +791,5 @@ int main(int argc, char **argv) {
   signal(SIGHUP, reload_policies);
   reload_policies();
 
-  bus_loop();
+  event_loop();
 }
@@ -4,7 +4,23 @@
 
 #include "common.h"
 
+#include <systemd/sd-id128.h>
+#include <systemd/sd-journal.h>
+
 #include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
 void * alloc(size_t sz) {
   void *res = calloc(sz, 1);
@@ -54,96 +70,630 @@ void setproctitle(const char *fmt, ...) {
   sdsfree(name);
 }
 
-int readline(FILE *fp, sds *pline) {
-  sds result = sdsempty();
-  *pline = NULL;
-  char buf[128];
-  buf[0] = 0;
+int line_reader_open(line_reader *lr, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    memset(lr, 0, sizeof(*lr));
+    return -errno;
+  }
+
+  int rc = line_reader_read_fd(lr, fd);
+  close(fd);
+  return rc;
+}
+
+int line_reader_read_fd(line_reader *lr, int fd) {
+  memset(lr, 0, sizeof(*lr));
+
+  // Files in /proc claim to be empty, but fit in a page, so one read() gets them.
+  struct stat st;
+  size_t expected = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0;
+  size_t cap = expected ? expected + 1 : 4096;
+  lr->data = ralloc(NULL, cap);
+
   for (;;) {
-    if (fgets(buf, sizeof(buf), fp) == NULL) {
-      if (ferror(fp)) {
-        int errno_ = errno;
-        sdsfree(result);
-        return -errno_;
-      } else if (feof(fp)) {
-        break;
-      }
+    if (lr->len + 1 == cap) {
+      cap *= 2;
+      lr->data = ralloc(lr->data, cap);
     }
 
-    result = sdscat(result, buf);
-    if (result[sdslen(result) - 1] == '\n') {
+    ssize_t sz = read(fd, lr->data + lr->len, cap - lr->len - 1);
+    if (sz == -1 && errno == EINTR) {
+      continue;
+    } else if (sz == -1) {
+      int errno_ = errno;
+      line_reader_free(lr);
+      return -errno_;
+    } else if (sz == 0) {
+      break;
+    }
+
+    lr->len += sz;
+    if (expected && lr->len == expected) {
       break;
     }
   }
-  if (sdslen(result) == 0) {
-    sdsfree(result);
-    return 0;
-  }
-  sdstrim(result, "\n");
-  *pline = result;
+
+  lr->data[lr->len] = 0;
   return 0;
 }
 
+char * line_reader_next(line_reader *lr, size_t *len) {
+  if (lr->pos >= lr->len) {
+    return NULL;
+  }
+
+  char *line = lr->data + lr->pos;
+  char *nl = memchr(line, '\n', lr->len - lr->pos);
+  size_t line_len = nl ? nl - line : lr->len - lr->pos;
+
+  line[line_len] = 0;
+  lr->pos += line_len + (nl != NULL);
+  if (len) {
+    *len = line_len;
+  }
+  return line;
+}
+
+void line_reader_free(line_reader *lr) {
+  free(lr->data);
+  memset(lr, 0, sizeof(*lr));
+}
+
+int pidfd_open_pid(pid_t pid) {
+  return syscall(SYS_pidfd_open, pid, 0);
+}
+
+pid_t pidfd_get_pid(int pidfd) {
+  char path[64], buf[1024];
+  snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", pidfd);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -errno;
+  }
+
+  ssize_t sz = read(fd, buf, sizeof(buf) - 1);
+  int errno_ = errno;
+  close(fd);
+  if (sz == -1) {
+    return -errno_;
+  }
+  buf[sz] = 0;
+
+  char *line = strstr(buf, "\nPid:");
+  if (line == NULL) {
+    return -EBADF;
+  }
+
+  // The kernel reports a pid of -1 once the process has exited.
+  long pid = strtol(line + 5, NULL, 10);
+  return pid > 0 ? pid : -ESRCH;
+}
+
+ssize_t send_fds(int sock, const void *buf, size_t len, const int *fds, int nfds) {
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * MAX_SENT_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = (void*)buf, .iov_len = len };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+  assert(nfds <= MAX_SENT_FDS);
+  if (nfds > 0) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+  }
+
+  ssize_t sz;
+  do {
+    sz = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (sz == -1 && errno == EINTR);
+  return sz == -1 ? -errno : sz;
+}
+
+ssize_t recv_fds(int sock, void *buf, size_t len, int *fds, int *nfds) {
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * MAX_SENT_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                        .msg_controllen = sizeof(control.buf) };
+
+  ssize_t sz;
+  do {
+    sz = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (sz == -1 && errno == EINTR);
+  if (sz == -1) {
+    return -errno;
+  }
+
+  int received = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int *incoming = (int*)CMSG_DATA(cmsg);
+    for (int i = 0; i < count; i++) {
+      if (received < *nfds) {
+        fds[received++] = incoming[i];
+      } else {
+        close(incoming[i]);
+      }
+    }
+  }
+
+  *nfds = received;
+  if (msg.msg_flags & (MSG_CTRUNC | MSG_TRUNC)) {
+    for (int i = 0; i < received; i++) {
+      close(fds[i]);
+    }
+    *nfds = 0;
+    return -EMSGSIZE;
+  }
+
+  return sz;
+}
+
+struct table_entry {
+  const char *key;
+  void *value;
+  uint32_t hash;
+};
+
+struct table_chunk {
+  table_chunk *next;
+  size_t used, cap;
+  char data[];
+};
+
+#define TABLE_MIN_SLOTS 16
+#define TABLE_MIN_CHUNK 256
+#define TABLE_MAX_CHUNK 65536
+
+// FNV-1a, which is plenty for environment variable and property names.
+static uint32_t table_hash(const char *key) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char*)key; *p; p++) {
+    hash = (hash ^ *p) * 16777619u;
+  }
+  return hash;
+}
+
+// Returns the slot holding key, or the empty slot where it would go. There is always
+// at least one empty slot, since entries never take up more than half of them.
+static uint32_t * table_find(table *tbl, const char *key, uint32_t hash) {
+  size_t mask = tbl->cap - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    uint32_t slot = tbl->slots[i];
+    if (slot == 0) {
+      return &tbl->slots[i];
+    }
+
+    table_entry *entry = &tbl->entries[slot - 1];
+    if (entry->hash == hash && entry->key && strcmp(entry->key, key) == 0) {
+      return &tbl->slots[i];
+    }
+  }
+}
+
+// Drops deleted entries and rehashes everything into cap slots.
+static void table_rebuild(table *tbl, size_t cap) {
+  size_t live = 0;
+  for (size_t i = 0; i < tbl->used; i++) {
+    if (tbl->entries[i].key) {
+      tbl->entries[live++] = tbl->entries[i];
+    }
+  }
+  tbl->used = live;
+
+  free(tbl->slots);
+  tbl->slots = newa(uint32_t, cap);
+  tbl->entries = ralloc(tbl->entries, cap / 2 * sizeof(table_entry));
+  tbl->cap = cap;
+
+  size_t mask = cap - 1;
+  for (size_t i = 0; i < tbl->used; i++) {
+    size_t j = tbl->entries[i].hash & mask;
+    while (tbl->slots[j]) {
+      j = (j + 1) & mask;
+    }
+    tbl->slots[j] = i + 1;
+  }
+}
+
+static const char * table_intern(table *tbl, const char *key) {
+  size_t len = strlen(key) + 1;
+  table_chunk *chunk = tbl->keys;
+  if (chunk == NULL || chunk->cap - chunk->used < len) {
+    size_t cap = chunk ? chunk->cap * 2 : TABLE_MIN_CHUNK;
+    if (cap > TABLE_MAX_CHUNK) {
+      cap = TABLE_MAX_CHUNK;
+    }
+    if (cap < len) {
+      cap = len;
+    }
+
+    chunk = ralloc(NULL, sizeof(table_chunk) + cap);
+    chunk->next = tbl->keys;
+    chunk->used = 0;
+    chunk->cap = cap;
+    tbl->keys = chunk;
+  }
+
+  char *copy = chunk->data + chunk->used;
+  memcpy(copy, key, len);
+  chunk->used += len;
+  return copy;
+}
+
 void table_init(table *tbl) {
-  tbl->p = NULL;
-  tbl->sz = 0;
+  memset(tbl, 0, sizeof(*tbl));
 }
 
 void table_add(table *tbl, const char *key, void *value) {
-  Word_t *pvalue;
-  JSLI(pvalue, tbl->p, (const uint8_t*)key);
-  *pvalue = (Word_t)value;
-  tbl->sz++;
+  table_swap(tbl, key, value);
 }
 
 void * table_get(table *tbl, const char *key) {
-  Word_t *pvalue;
-  JSLG(pvalue, tbl->p, (const uint8_t*)key);
-  if (pvalue) {
-    return *(void**)pvalue;
-  } else {
+  if (tbl->sz == 0) {
     return NULL;
   }
+
+  uint32_t slot = *table_find(tbl, key, table_hash(key));
+  return slot ? tbl->entries[slot - 1].value : NULL;
 }
 
 void * table_swap(table *tbl, const char *key, void *value) {
-  void *orig = table_get(tbl, key);
-  table_add(tbl, key, value);
-  return orig;
+  if ((tbl->used + 1) * 2 > tbl->cap) {
+    size_t cap = tbl->cap ? tbl->cap : TABLE_MIN_SLOTS;
+    while ((tbl->sz + 1) * 2 > cap) {
+      cap *= 2;
+    }
+    table_rebuild(tbl, cap);
+  }
+
+  uint32_t hash = table_hash(key);
+  uint32_t *slot = table_find(tbl, key, hash);
+  if (*slot) {
+    table_entry *entry = &tbl->entries[*slot - 1];
+    void *orig = entry->value;
+    entry->value = value;
+    return orig;
+  }
+
+  tbl->entries[tbl->used] = (table_entry){ .key = table_intern(tbl, key), .value = value,
+                                           .hash = hash };
+  *slot = ++tbl->used;
+  tbl->sz++;
+  return NULL;
 }
 
 int table_del(table *tbl, const char *key) {
-  int rc;
-  JSLD(rc, tbl->p, (const uint8_t*)key);
-  if (rc) {
-    tbl->sz--;
+  if (tbl->sz == 0) {
+    return 0;
   }
-  return rc;
+
+  // The slot stays taken, so that probes for other keys still go past it.
+  uint32_t slot = *table_find(tbl, key, table_hash(key));
+  if (slot == 0) {
+    return 0;
+  }
+
+  tbl->entries[slot - 1].key = NULL;
+  tbl->sz--;
+  return 1;
 }
 
-char * table_next(table *tbl, char *prev, void **value) {
-  Word_t *pvalue;
-  uint8_t idx[4096];
-  if (prev == NULL) {
-    idx[0] = 0;
-    JSLF(pvalue, tbl->p, idx);
-  } else {
-    strncpy((char*)idx, prev, sizeof(idx));
-    JSLN(pvalue, tbl->p, idx);
+const char * table_iter(table *tbl, table_cursor *cursor, void **value) {
+  while (*cursor < tbl->used) {
+    table_entry *entry = &tbl->entries[(*cursor)++];
+    if (entry->key) {
+      if (value) {
+        *value = entry->value;
+      }
+      return entry->key;
+    }
   }
-  free(prev);
-  if (!pvalue) {
-    return NULL;
+
+  return NULL;
+}
+
+void table_free(table *tbl) {
+  while (tbl->keys) {
+    table_chunk *next = tbl->keys->next;
+    free(tbl->keys);
+    tbl->keys = next;
   }
-  size_t len = strlen((char*)idx);
-  char *res = alloc(len + 1);
-  memcpy(res, idx, len + 1);
-  if (value) {
-    *value = (void*)*pvalue;
+
+  free(tbl->entries);
+  free(tbl->slots);
+  memset(tbl, 0, sizeof(*tbl));
+}
+
+struct arena_chunk {
+  arena_chunk *next;
+  size_t used, cap;
+  _Alignas(max_align_t) char data[];
+};
+
+void arena_init(arena *a, size_t first) {
+  a->chunks = NULL;
+  a->first = first;
+}
+
+static void * arena_take(arena *a, size_t sz, size_t align) {
+  arena_chunk *chunk = a->chunks;
+  size_t start = chunk ? (chunk->used + align - 1) & ~(align - 1) : 0;
+
+  if (chunk == NULL || start + sz > chunk->cap) {
+    size_t cap = chunk ? chunk->cap * 2 : a->first;
+    if (cap < sz) {
+      cap = sz;
+    }
+
+    chunk = ralloc(NULL, sizeof(arena_chunk) + cap);
+    chunk->next = a->chunks;
+    chunk->cap = cap;
+    a->chunks = chunk;
+    start = 0;
   }
-  return res;
+
+  chunk->used = start + sz;
+  return chunk->data + start;
 }
 
-void table_free(table *tbl) {
-  JudySLFreeArray((PPvoid_t)&tbl->p, PJE0);
+void * arena_alloc(arena *a, size_t sz) {
+  void *p = arena_take(a, sz, _Alignof(max_align_t));
+  memset(p, 0, sz);
+  return p;
+}
+
+char * arena_strdup(arena *a, const char *s) {
+  size_t len = strlen(s) + 1;
+  return memcpy(arena_take(a, len, 1), s, len);
+}
+
+void arena_free(arena *a) {
+  // The arena itself may live in one of its chunks, so don't touch it after the loop.
+  arena_chunk *chunk = a->chunks;
+  while (chunk) {
+    arena_chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+int capture_fd_type(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    return CAPTURE_FD_OTHER;
+  }
+
+  switch (st.st_mode & S_IFMT) {
+  case S_IFCHR:
+    if (isatty(fd)) {
+      return CAPTURE_FD_TTY;
+    }
+    return st.st_rdev == makedev(1, 3) ? CAPTURE_FD_NULL : CAPTURE_FD_OTHER;
+  case S_IFREG: return CAPTURE_FD_FILE;
+  case S_IFIFO: return CAPTURE_FD_PIPE;
+  case S_IFSOCK: return CAPTURE_FD_SOCKET;
+  default: return CAPTURE_FD_OTHER;
+  }
+}
+
+// Integers are stored as LEB128, so the common small lengths take a single byte.
+static sds capture_put(sds buf, uint64_t value) {
+  unsigned char bytes[10];
+  int len = 0;
+  do {
+    bytes[len] = value & 0x7f;
+    value >>= 7;
+    if (value) {
+      bytes[len] |= 0x80;
+    }
+    len++;
+  } while (value);
+
+  return sdscatlen(buf, bytes, len);
+}
+
+static int capture_get(const char **pp, const char *end, uint64_t *value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *pp < end; shift += 7) {
+    unsigned char byte = *(*pp)++;
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+sds capture_encode_header(sds buf, uint64_t start) {
+  buf = sdscatlen(buf, "H" CAPTURE_MAGIC, 1 + strlen(CAPTURE_MAGIC));
+  buf = capture_put(buf, CAPTURE_VERSION);
+  return capture_put(buf, start);
+}
+
+sds capture_encode_record(sds buf, const capture_record *rec) {
+  buf = sdscatlen(buf, "R", 1);
+  buf = capture_put(buf, rec->offset);
+  buf = capture_put(buf, rec->argc);
+  buf = capture_put(buf, rec->envc);
+  buf = capture_put(buf, rec->cwd_len);
+  buf = sdscatlen(buf, rec->fd_types, 3);
+  for (uint32_t i = 0; i < rec->argc + 2 * rec->envc; i++) {
+    buf = capture_put(buf, rec->lens[i]);
+  }
+  return buf;
+}
+
+int capture_decode(const char **pp, const char *end, uint64_t *start,
+                   capture_record *rec) {
+  if (*pp == end) {
+    return CAPTURE_END;
+  }
+
+  uint64_t value;
+  char tag = *(*pp)++;
+  if (tag == 'H') {
+    size_t magic_len = strlen(CAPTURE_MAGIC);
+    if (end - *pp < magic_len || memcmp(*pp, CAPTURE_MAGIC, magic_len) != 0) {
+      return -1;
+    }
+    *pp += magic_len;
+
+    if (capture_get(pp, end, &value) < 0 || value != CAPTURE_VERSION ||
+        capture_get(pp, end, start) < 0) {
+      return -1;
+    }
+    return CAPTURE_HEADER;
+  } else if (tag != 'R') {
+    return -1;
+  }
+
+  uint64_t fields[4];
+  for (int i = 0; i < 4; i++) {
+    if (capture_get(pp, end, &fields[i]) < 0) {
+      return -1;
+    }
+  }
+  rec->offset = fields[0];
+
+  // Every length takes at least a byte, so this also bounds the allocation below.
+  uint64_t nlens = fields[1] + 2 * fields[2];
+  if (fields[1] > UINT32_MAX || fields[2] > UINT32_MAX || fields[3] > UINT32_MAX ||
+      end - *pp < 3 || nlens > end - *pp - 3) {
+    return -1;
+  }
+  rec->argc = fields[1];
+  rec->envc = fields[2];
+  rec->cwd_len = fields[3];
+
+  memcpy(rec->fd_types, *pp, 3);
+  *pp += 3;
+
+  rec->lens = ralloc(rec->lens, (nlens ? nlens : 1) * sizeof(uint32_t));
+  for (uint64_t i = 0; i < nlens; i++) {
+    if (capture_get(pp, end, &value) < 0 || value > UINT32_MAX) {
+      return -1;
+    }
+    rec->lens[i] = value;
+  }
+
+  return CAPTURE_RECORD;
+}
+
+void request_id_generate(char *id) {
+  sd_id128_t uuid;
+  if (sd_id128_randomize(&uuid) < 0) {
+    // Only used to correlate logs, so uniqueness beats failing the request.
+    snprintf(id, REQUEST_ID_SIZE, "%016" PRIx64 "%016" PRIx64, (uint64_t)getpid(),
+             (uint64_t)time(NULL));
+    return;
+  }
+
+  sd_id128_to_string(uuid, id);
+}
+
+int stderr_is_journal() {
+  // systemd sets JOURNAL_STREAM to the device and inode of the stream it connected.
+  static int result = -1;
+  if (result == -1) {
+    const char *stream = getenv("JOURNAL_STREAM");
+    struct stat st;
+    unsigned long long dev, ino;
+
+    result = stream && sscanf(stream, "%llu:%llu", &dev, &ino) == 2 &&
+             fstat(2, &st) == 0 && st.st_dev == dev && st.st_ino == ino;
+  }
+
+  return result;
+}
+
+void journal_log(const char *identifier, int priority, const char *message,
+                 sds *fields, int nfields) {
+  sds builtin[] = {
+    sdscatfmt(sdsempty(), "MESSAGE=%s", message),
+    sdscatfmt(sdsempty(), "PRIORITY=%i", priority),
+    sdscatfmt(sdsempty(), "SYSLOG_IDENTIFIER=%s", identifier),
+  };
+  int nbuiltin = sizeof(builtin) / sizeof(builtin[0]);
+
+  struct iovec *iov = newa(struct iovec, nbuiltin + nfields);
+  for (int i = 0; i < nbuiltin; i++) {
+    iov[i].iov_base = builtin[i];
+    iov[i].iov_len = sdslen(builtin[i]);
+  }
+  for (int i = 0; i < nfields; i++) {
+    iov[nbuiltin + i].iov_base = fields[i];
+    iov[nbuiltin + i].iov_len = sdslen(fields[i]);
+  }
+
+  sd_journal_sendv(iov, nbuiltin + nfields);
+
+  for (int i = 0; i < nbuiltin; i++) {
+    sdsfree(builtin[i]);
+  }
+  free(iov);
+}
+
+void log_with_fields(const char *identifier, FILE *stream, const char *module,
+                     const char *request_id, int priority, sds message, sds *fields,
+                     int nfields) {
+  if (!stderr_is_journal()) {
+    // Without the journal's fields, debug messages would only be noise.
+    if (priority != LOG_DEBUG) {
+      fprintf(stream, "<%d>%.*s\n", priority, (int)sdslen(message), message);
+    }
+  } else {
+    sds *all = newa(sds, nfields + 2);
+    int nall = 0;
+    if (module && *module) {
+      all[nall++] = sdscatfmt(sdsempty(), "MODULE=%s", module);
+    }
+    if (request_id && *request_id) {
+      all[nall++] = sdscatfmt(sdsempty(), "REQUEST_ID=%s", request_id);
+    }
+
+    if (nfields) {
+      memcpy(all + nall, fields, nfields * sizeof(sds));
+    }
+    journal_log(identifier, priority, message, all, nall + nfields);
+    for (int i = 0; i < nall; i++) {
+      sdsfree(all[i]);
+    }
+    free(all);
+  }
+
+  for (int i = 0; i < nfields; i++) {
+    sdsfree(fields[i]);
+  }
+  sdsfree(message);
+}
+
+double clock_seconds(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t monotonic_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
 }
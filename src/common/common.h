@@ -8,11 +8,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
 
-#include <Judy.h>
 #include <sds.h>
 
 void * alloc(size_t sz);
@@ -26,18 +29,136 @@ void __setproctitle_init(char **argv);
 #define setproctitle_init(argc, argv, ...) __setproctitle_init(argv)
 void setproctitle(const char *fmt, ...);
 
-int readline(FILE *fp, sds *pline);
+// Reads a whole file into memory at once, then hands out its lines as slices of that
+// buffer. Each line has its newline replaced by a NUL, and stays valid until the
+// reader is freed.
+typedef struct line_reader {
+  char *data;
+  size_t len, pos;
+} line_reader;
+
+int line_reader_open(line_reader *lr, const char *path);
+int line_reader_read_fd(line_reader *lr, int fd);
+char * line_reader_next(line_reader *lr, size_t *len);
+void line_reader_free(line_reader *lr);
+
+int pidfd_open_pid(pid_t pid);
+pid_t pidfd_get_pid(int pidfd);
+
+#define MAX_SENT_FDS 4
+ssize_t send_fds(int sock, const void *buf, size_t len, const int *fds, int nfds);
+ssize_t recv_fds(int sock, void *buf, size_t len, int *fds, int *nfds);
+
+// Request IDs are generated by uprocctl as 32 hex digits, and tie together the log
+// entries of every process involved in a request.
+#define REQUEST_ID_SIZE 33
+void request_id_generate(char *id);
+
+int stderr_is_journal();
+void journal_log(const char *identifier, int priority, const char *message,
+                 sds *fields, int nfields);
+// Sends message and fields to the journal if stderr is connected to it, along with MODULE
+// and REQUEST_ID unless those are NULL or empty. Otherwise, only the message is written
+// to stream, and debug messages are dropped. Frees message and fields.
+void log_with_fields(const char *identifier, FILE *stream, const char *module,
+                     const char *request_id, int priority, sds message, sds *fields,
+                     int nfields);
+
+double clock_seconds(clockid_t clock);
+// CLOCK_MONOTONIC, which sd-bus and sd-event timeouts are also measured on.
+uint64_t monotonic_usec();
+
+#define CGRMVD_SOCKET_PATH "/run/cgrmvd/cgrmvd.sock"
+#define CGRMVD_PROTOCOL_VERSION 2
+
+// Sent over CGRMVD_SOCKET_PATH, with pidfds for the copier and origin attached.
+typedef struct cgrmvd_request {
+  uint32_t version, serial;
+  // Added in version 2. Empty if unknown.
+  char request_id[REQUEST_ID_SIZE];
+} cgrmvd_request;
+
+#define CGRMVD_REQUEST_V1_SIZE offsetof(cgrmvd_request, request_id)
+
+typedef struct cgrmvd_response {
+  uint32_t serial;
+  int32_t status;
+} cgrmvd_response;
+
+// Run requests recorded through a module's CaptureFile, and replayed by uprocd-load.
+// Each daemon start appends a header, followed by one record per request. Only the
+// shape of a request is kept: lengths and fd types, never the strings themselves.
+#define CAPTURE_MAGIC "UPRCAP"
+#define CAPTURE_VERSION 1
+
+enum { CAPTURE_FD_OTHER, CAPTURE_FD_NULL, CAPTURE_FD_TTY, CAPTURE_FD_FILE,
+       CAPTURE_FD_PIPE, CAPTURE_FD_SOCKET };
+
+typedef struct capture_record {
+  // Microseconds since the header was written.
+  uint64_t offset;
+  uint32_t argc, envc, cwd_len;
+  // The length of each argument, followed by the key and value lengths of each
+  // environment variable.
+  uint32_t *lens;
+  uint8_t fd_types[3];
+} capture_record;
+
+enum { CAPTURE_END, CAPTURE_HEADER, CAPTURE_RECORD };
+
+int capture_fd_type(int fd);
+sds capture_encode_header(sds buf, uint64_t start);
+sds capture_encode_record(sds buf, const capture_record *rec);
+// Decodes the next entry from *pp, setting *start for headers, and returns one of the
+// values above, or -1 if the data is corrupt or truncated. rec->lens is reallocated
+// as needed, and must be freed by the caller.
+int capture_decode(const char **pp, const char *end, uint64_t *start,
+                   capture_record *rec);
+
+// A string-keyed hash table. Keys are copied into chunks owned by the table, and
+// iteration follows insertion order, not the sorted order of the JudySL array it
+// replaced.
+typedef struct table_entry table_entry;
+typedef struct table_chunk table_chunk;
 
 typedef struct {
-  Pvoid_t p;
-  size_t sz;
+  table_entry *entries;
+  // Open-addressed with linear probing. Each slot is 0 if empty, or an index into
+  // entries plus one.
+  uint32_t *slots;
+  table_chunk *keys;
+  // sz is the number of keys, used the number of entries including deleted ones.
+  size_t sz, used, cap;
 } table;
 
+// Positions an iteration, starting from TABLE_CURSOR_INIT.
+typedef size_t table_cursor;
+#define TABLE_CURSOR_INIT 0
+
 void table_init(table *tbl);
 void table_add(table *tbl, const char *key, void *value);
 void * table_get(table *tbl, const char *key);
 void * table_swap(table *tbl, const char *key, void *value);
-char * table_next(table *tbl, char *prev, void **value);
+int table_del(table *tbl, const char *key);
+// Returns the next key, which stays valid until the table is freed, or NULL at the end.
+const char * table_iter(table *tbl, table_cursor *cursor, void **value);
 void table_free(table *tbl);
 
+// A bump allocator for memory that is freed all at once. Allocations are carved out of
+// chunks, each twice the size of the last, so that a request's worth of strings usually
+// costs a single malloc.
+typedef struct arena_chunk arena_chunk;
+
+typedef struct arena {
+  arena_chunk *chunks;
+  // The first chunk is only allocated once it is needed, with this size.
+  size_t first;
+} arena;
+
+void arena_init(arena *a, size_t first);
+// Aligned for any type, and zeroed.
+void * arena_alloc(arena *a, size_t sz);
+char * arena_strdup(arena *a, const char *s);
+void arena_free(arena *a);
+
 #endif
@@ -0,0 +1,22 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT probes on the spawn path, for bpftrace and friends. Each one compiles down to a
+// single nop plus an ELF note, so they cost nothing until a tracer attaches. Without
+// sys/sdt.h they compile to nothing at all.
+//
+// Every probe's first argument is the PID of the uprocctl process that made the request,
+// so a tracer can follow one spawn across uprocctl, uprocd, and cgrmvd.
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE(provider, name, ...) STAP_PROBEV(provider, name, ##__VA_ARGS__)
+#else
+#define PROBE(provider, name, ...) do {} while (0)
+#endif
+
+#endif
@@ -2,18 +2,23 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
-#include "common.h"
+#include "private.h"
+#include "probes.h"
 
 #include <systemd/sd-bus.h>
 
 #include <sys/prctl.h>
 #include <sys/ptrace.h>
 #include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 extern char **environ;
 int64_t target_pid = -1;
 
+char request_id[REQUEST_ID_SIZE];
+
 #define STATUS_USAGE "status [-h] module"
 #define RUN_USAGE "run [-h] module [args...]"
 #define U_USAGE "[-h] module [args...]"
@@ -23,8 +28,6 @@ void _fail(sds message) {
   sdsfree(message);
 }
 
-#define FAIL(...) _fail(sdscatfmt(sdsempty(), __VA_ARGS__))
-
 char * last_path_component(char *path) {
   char *p = strrchr(path, '/');
   return p ? p + 1 : path;
@@ -34,6 +37,7 @@ void usage() {
   puts("usage: uprocctl -h");
   puts("       uprocctl " STATUS_USAGE);
   puts("       uprocctl " RUN_USAGE);
+  puts("       uprocctl " TOP_USAGE);
   puts("       u " U_USAGE);
 }
 
@@ -56,6 +60,7 @@ void help() {
   puts("");
   puts("  status      Show the status of a uprocd module.");
   puts("  run         Run a command through a uprocd module.");
+  puts("  top         Show the resource usage and latency of every uprocd module.");
   puts("");
   puts("The u command is a shortcut for uprocctl run.");
 }
@@ -181,6 +186,31 @@ int wait_for_process() {
   }
 }
 
+// Records the end of a request, so the whole thing can be found alongside uprocd's and
+// cgrmvd's entries with journalctl REQUEST_ID=... This goes straight to the journal
+// rather than stderr, so nothing is shown on the terminal.
+void log_request(const char *module, uint64_t start, uint64_t replied, int status) {
+  uint64_t now = monotonic_usec();
+  sds fields[] = {
+    sdscatfmt(sdsempty(), "REQUEST_ID=%s", request_id),
+    sdscatfmt(sdsempty(), "MODULE=%s", module),
+    sdscatfmt(sdsempty(), "TARGET_PID=%I", target_pid),
+    sdscatfmt(sdsempty(), "CALL_USEC=%U", replied - start),
+    sdscatfmt(sdsempty(), "TOTAL_USEC=%U", now - start),
+    sdscatfmt(sdsempty(), "EXIT_STATUS=%i", status),
+  };
+  int nfields = sizeof(fields) / sizeof(fields[0]);
+
+  sds message = sdscatfmt(sdsempty(), "Request to %s exited with status %i.", module,
+                          status);
+  journal_log("uprocctl", LOG_DEBUG, message, fields, nfields);
+
+  sdsfree(message);
+  for (int i = 0; i < nfields; i++) {
+    sdsfree(fields[i]);
+  }
+}
+
 void forward_signal(int sig) {
   if (target_pid < 1) {
     FAIL("target_pid == %I in forward_signal", target_pid);
@@ -189,33 +219,40 @@ void forward_signal(int sig) {
   kill(target_pid, sig);
 }
 
-int run(char *module, int argc, char **argv) {
-  sd_bus *bus = NULL;
-  sd_bus_message *msg = NULL, *reply = NULL;
-  sd_bus_error err = SD_BUS_ERROR_NULL;
-  int rc;
-  char *title;
+// Runs the module's ColdExec= command, for when a keyed template isn't warm yet.
+void cold_exec(const char *command, int argc, char **argv) {
+  int nwords;
+  sds *words = sdssplitlen(command, strlen(command), " ", 1, &nwords);
 
-  char *cwd = getcwd(NULL, 0);
-  if (cwd == NULL) {
-    FAIL("Error retrieving current working directory: %s", strerror(errno));
-    rc = -errno;
-    goto end;
+  char **exec_argv = newa(char*, nwords + argc + 1), **p = exec_argv;
+  for (int i = 0; i < nwords; i++) {
+    if (sdslen(words[i])) {
+      *(p++) = words[i];
+    }
+  }
+  for (int i = 0; i < argc; i++) {
+    *(p++) = argv[i];
   }
+  *p = NULL;
 
-  rc = sd_bus_open_user(&bus);
-  if (rc < 0) {
-    FAIL("sd_bus_open_user failed: %s", strerror(-rc));
-    goto end;
+  if (exec_argv[0] == NULL) {
+    FAIL("The module's ColdExec command is empty.");
+    return;
   }
 
-  sds service, object;
-  get_bus_params(module, &service, &object);
+  execvp(exec_argv[0], exec_argv);
+  FAIL("Error executing %s: %s", exec_argv[0], strerror(errno));
+}
 
-  rc = sd_bus_message_new_method_call(bus, &msg, service, object, service, "Run");
+static int new_run_message(sd_bus *bus, const char *service, const char *object,
+                           const char *cwd, int argc, char **argv, int with_id,
+                           sd_bus_message **pmsg) {
+  sd_bus_message *msg = NULL;
+  int rc = sd_bus_message_new_method_call(bus, &msg, service, object, service,
+                                          with_id ? "RunWithRequestId" : "Run");
   if (rc < 0) {
     FAIL("sd_bus_message_new_method_call failed: %s", strerror(-rc));
-    goto end;
+    return rc;
   }
 
   rc = sd_bus_message_open_container(msg, 'a', "{ss}");
@@ -274,15 +311,172 @@ int run(char *module, int argc, char **argv) {
     goto write_end;
   }
 
+  if (with_id) {
+    rc = sd_bus_message_append(msg, "s", request_id);
+    if (rc < 0) {
+      goto write_end;
+    }
+  }
+
   write_end:
   if (rc < 0) {
     FAIL("Error writing bus message: %s", strerror(-rc));
+    sd_bus_message_unref(msg);
+    return rc;
+  }
+
+  *pmsg = msg;
+  return 0;
+}
+
+// sd-bus's own default, after which the module is asked how long a Run may take.
+#define RUN_TIMEOUT_USEC 25000000
+
+typedef struct run_call {
+  int done;
+  sd_bus_message *reply;
+} run_call;
+
+static int on_run_reply(sd_bus_message *reply, void *userdata, sd_bus_error *err) {
+  run_call *call = userdata;
+  call->reply = sd_bus_message_ref(reply);
+  call->done = 1;
+  return 0;
+}
+
+// How long the module says a Run may take, or 0 for the default. Daemons from before
+// GetRunTimeout never take longer.
+static uint64_t get_run_timeout(sd_bus *bus, const char *service, const char *object) {
+  sd_bus_message *reply = NULL;
+  uint64_t usec = 0;
+  if (sd_bus_call_method(bus, service, object, service, "GetRunTimeout", NULL, &reply,
+                         "") < 0 ||
+      sd_bus_message_read(reply, "t", &usec) < 0) {
+    usec = 0;
+  }
+  sd_bus_message_unref(reply);
+  return usec;
+}
+
+// Like sd_bus_call, but modules that serve requests in-process only reply once they're
+// done, so a call that outlasts the default timeout is only given up on if the module
+// says it shouldn't take that long.
+static int call_run(sd_bus *bus, sd_bus_message *msg, const char *service,
+                    const char *object, sd_bus_error *err, sd_bus_message **preply) {
+  run_call call = { 0 };
+  sd_bus_slot *slot = NULL;
+  uint64_t start = monotonic_usec(), deadline = start + RUN_TIMEOUT_USEC;
+  int extended = 0;
+
+  int rc = sd_bus_call_async(bus, &slot, msg, on_run_reply, &call, UINT64_MAX);
+  while (rc >= 0 && !call.done) {
+    rc = sd_bus_process(bus, NULL);
+    if (rc != 0) {
+      continue;
+    }
+
+    uint64_t now = monotonic_usec();
+    if (now >= deadline && !extended) {
+      extended = 1;
+      uint64_t timeout = get_run_timeout(bus, service, object);
+      deadline = timeout == UINT64_MAX ? UINT64_MAX : start + timeout;
+      continue;
+    } else if (now >= deadline) {
+      rc = -ETIMEDOUT;
+      break;
+    }
+
+    rc = sd_bus_wait(bus, deadline == UINT64_MAX ? UINT64_MAX : deadline - now);
+    if (rc == -EINTR) {
+      rc = 0;
+    }
+  }
+
+  // Dropping the slot cancels the call if it's still pending.
+  sd_bus_slot_unref(slot);
+  if (rc < 0) {
+    return sd_bus_error_set_errno(err, rc);
+  }
+
+  const sd_bus_error *reply_err = sd_bus_message_get_error(call.reply);
+  if (reply_err) {
+    rc = sd_bus_error_copy(err, reply_err);
+    sd_bus_message_unref(call.reply);
+    return rc < 0 ? rc : -EIO;
+  }
+
+  *preply = call.reply;
+  return 0;
+}
+
+// How long to keep retrying while a module that hit ServeMaxRequests= is replaced, or
+// while one serving requests in-process has too many queued.
+#define DRAINING_RETRY_USEC 100000
+#define DRAINING_RETRIES 50
+
+int run(char *module, int argc, char **argv) {
+  sd_bus *bus = NULL;
+  sd_bus_message *msg = NULL, *reply = NULL;
+  sd_bus_error err = SD_BUS_ERROR_NULL;
+  int rc;
+  char *title;
+  int32_t served_status = 0;
+  int with_id = 1;
+  uint64_t start = monotonic_usec(), replied = 0;
+
+  PROBE(uprocctl, request__start, getpid());
+  request_id_generate(request_id);
+
+  char *cwd = getcwd(NULL, 0);
+  if (cwd == NULL) {
+    FAIL("Error retrieving current working directory: %s", strerror(errno));
+    rc = -errno;
     goto end;
   }
 
-  rc = sd_bus_call(bus, msg, 0, &err, &reply);
+  rc = sd_bus_open_user(&bus);
   if (rc < 0) {
-    if (strcmp(err.name, SD_BUS_ERROR_SERVICE_UNKNOWN) == 0) {
+    FAIL("sd_bus_open_user failed: %s", strerror(-rc));
+    goto end;
+  }
+
+  sds service, object;
+  get_bus_params(module, &service, &object);
+
+  // A draining module has already released its name, so once it's gone the service is
+  // briefly unknown until systemd restarts it.
+  for (int attempt = 0, draining = 0;; attempt++) {
+    rc = new_run_message(bus, service, object, cwd, argc, argv, with_id, &msg);
+    if (rc < 0) {
+      goto end;
+    }
+
+    PROBE(uprocctl, request__send, getpid());
+
+    rc = call_run(bus, msg, service, object, &err, &reply);
+    if (rc < 0 && with_id && sd_bus_error_has_name(&err, SD_BUS_ERROR_UNKNOWN_METHOD)) {
+      // Daemons from before request IDs only know the original Run.
+      with_id = 0;
+    } else if (rc >= 0 || attempt == DRAINING_RETRIES ||
+               !(sd_bus_error_has_name(&err, "com.refi64.uprocd.Draining") ||
+                 sd_bus_error_has_name(&err, "com.refi64.uprocd.Busy") ||
+                 (draining &&
+                  sd_bus_error_has_name(&err, SD_BUS_ERROR_SERVICE_UNKNOWN)))) {
+      break;
+    } else {
+      draining = draining || sd_bus_error_has_name(&err, "com.refi64.uprocd.Draining");
+      usleep(DRAINING_RETRY_USEC);
+    }
+
+    sd_bus_error_free(&err);
+    sd_bus_message_unref(msg);
+    msg = NULL;
+  }
+
+  if (rc < 0) {
+    if (sd_bus_error_has_name(&err, "com.refi64.uprocd.ColdExec")) {
+      cold_exec(err.message, argc, argv);
+    } else if (strcmp(err.name, SD_BUS_ERROR_SERVICE_UNKNOWN) == 0) {
       FAIL("Failed to locate %s's D-Bus service.", module);
       FAIL("Are you sure it has been started? (Try systemctl --user status uprocd@%s.)",
            module);
@@ -293,12 +487,16 @@ int run(char *module, int argc, char **argv) {
     goto end;
   }
 
-  rc = sd_bus_message_read(reply, "xs", &target_pid, &title);
+  rc = with_id ? sd_bus_message_read(reply, "xsi", &target_pid, &title, &served_status) :
+                 sd_bus_message_read(reply, "xs", &target_pid, &title);
   if (rc < 0) {
     FAIL("uprocd process bus failed to return the new PID.");
     goto end;
   }
 
+  replied = monotonic_usec();
+  PROBE(uprocctl, reply__received, getpid(), target_pid);
+
   setproctitle("-%s", title);
 
   end:
@@ -315,6 +513,11 @@ int run(char *module, int argc, char **argv) {
 
   if (rc < 0) {
     return 1;
+  } else if (target_pid == 0) {
+    // The module served the request in-process, so there's no process to wait on.
+    PROBE(uprocctl, exit__observed, getpid(), served_status);
+    log_request(module, start, replied, served_status);
+    return served_status;
   } else {
     for (int sig = 0; sig < 31; sig++) {
       if (sig == SIGCHLD) {
@@ -323,7 +526,10 @@ int run(char *module, int argc, char **argv) {
       signal(sig, forward_signal);
     }
 
-    return wait_for_process();
+    int status = wait_for_process();
+    PROBE(uprocctl, exit__observed, getpid(), status);
+    log_request(module, start, replied, status);
+    return status;
   }
 }
 
@@ -398,6 +604,8 @@ int main(int argc, char **argv) {
         return rc < 0 ? 1 : 0;
       }
       return run(argv[2], argc - 3, argv + 3);
+    } else if (strcmp(argv[1], "top") == 0) {
+      return top(argc - 1, argv + 1);
     } else {
       FAIL("Invalid command.");
       usage();
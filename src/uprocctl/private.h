@@ -0,0 +1,20 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef PRIVATE_H
+#define PRIVATE_H
+
+#include "common.h"
+
+void _fail(sds message);
+
+#define FAIL(...) _fail(sdscatfmt(sdsempty(), __VA_ARGS__))
+
+#define TOP_USAGE "top [-h] [-b] [-n count] [-d delay] [-s column]"
+
+void top_usage();
+void top_help();
+int top(int argc, char **argv);
+
+#endif
@@ -0,0 +1,589 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "private.h"
+
+#include <systemd/sd-bus.h>
+
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MODULE_SERVICE_PREFIX "com.refi64.uprocd.modules."
+
+// A histogram as returned by GetStats: upper bounds and cumulative counts, with the
+// empty buckets left out.
+typedef struct histogram {
+  int n;
+  double *bounds;
+  uint64_t *counts;
+} histogram;
+
+typedef struct template_row {
+  sds module;
+  // The refresh the module was last seen in.
+  int generation;
+  int64_t pid;
+  double uptime, rss, pss, children, rate, p99;
+
+  // Totals as of the previous refresh, to turn them into per-interval values.
+  double sampled_at, requests;
+  histogram spawn;
+} template_row;
+
+enum {
+  COLUMN_MODULE,
+  COLUMN_PID,
+  COLUMN_UPTIME,
+  COLUMN_RSS,
+  COLUMN_PSS,
+  COLUMN_CHILDREN,
+  COLUMN_RATE,
+  COLUMN_P99,
+  COLUMN_COUNT,
+};
+
+static const char *column_names[] = {
+  [COLUMN_MODULE] = "module",
+  [COLUMN_PID] = "pid",
+  [COLUMN_UPTIME] = "uptime",
+  [COLUMN_RSS] = "rss",
+  [COLUMN_PSS] = "pss",
+  [COLUMN_CHILDREN] = "children",
+  [COLUMN_RATE] = "rate",
+  [COLUMN_P99] = "p99",
+};
+
+static int g_sort_column = COLUMN_MODULE;
+
+void top_usage() {
+  puts("usage: uprocctl " TOP_USAGE);
+}
+
+void top_help() {
+  puts("uprocctl top shows every running uprocd module, refreshing in place.");
+  puts("");
+  puts("  -h          Show this screen.");
+  puts("  -b          Batch mode: print tab-separated raw values instead of refreshing");
+  puts("              the screen. This is the default if stdout isn't a terminal.");
+  puts("  -n count    Exit after this many refreshes. Defaults to 1 in batch mode.");
+  puts("  -d delay    Seconds between refreshes. Defaults to 2.");
+  puts("  -s column   Sort by module (the default), pid, uptime, rss, pss, children,");
+  puts("              rate, or p99. Columns other than module sort largest first.");
+}
+
+static void histogram_free(histogram *hist) {
+  free(hist->bounds);
+  free(hist->counts);
+  memset(hist, 0, sizeof(*hist));
+}
+
+static int read_histogram(sd_bus_message *reply, histogram *hist) {
+  int rc, cap = 0;
+
+  rc = sd_bus_message_enter_container(reply, 'a', "(dt)");
+  if (rc < 0) {
+    return rc;
+  }
+
+  for (;;) {
+    double bound;
+    uint64_t count;
+    rc = sd_bus_message_read(reply, "(dt)", &bound, &count);
+    if (rc <= 0) {
+      break;
+    }
+
+    if (hist && hist->n == cap) {
+      cap = cap ? cap * 2 : 16;
+      hist->bounds = ralloc(hist->bounds, sizeof(double) * cap);
+      hist->counts = ralloc(hist->counts, sizeof(uint64_t) * cap);
+    }
+    if (hist) {
+      hist->bounds[hist->n] = bound;
+      hist->counts[hist->n] = count;
+      hist->n++;
+    }
+  }
+
+  if (rc < 0) {
+    return rc;
+  }
+  return sd_bus_message_exit_container(reply);
+}
+
+// The cumulative count of observations <= bound. Buckets missing from the histogram had
+// no observations, so this is the count of the closest bound present below it.
+static uint64_t cumulative_at(histogram *hist, double bound) {
+  uint64_t count = 0;
+  for (int i = 0; i < hist->n && hist->bounds[i] <= bound; i++) {
+    count = hist->counts[i];
+  }
+  return count;
+}
+
+// Estimates a quantile of the observations made in cur but not yet in prev, if given,
+// interpolating linearly within the bucket it falls into.
+static double histogram_quantile(histogram *cur, histogram *prev, double q) {
+  if (cur->n == 0) {
+    return NAN;
+  }
+
+  uint64_t *window = newa(uint64_t, cur->n);
+  for (int i = 0; i < cur->n; i++) {
+    window[i] = cur->counts[i] - (prev ? cumulative_at(prev, cur->bounds[i]) : 0);
+  }
+
+  double result = NAN, rank = q * window[cur->n - 1];
+  double lower = 0;
+  uint64_t below = 0;
+  for (int i = 0; i < cur->n && window[cur->n - 1]; i++) {
+    double bound = cur->bounds[i];
+    if (window[i] < rank) {
+      lower = bound;
+      below = window[i];
+      continue;
+    }
+
+    if (isinf(bound)) {
+      // Nothing to interpolate towards, so the largest finite bound is all that's known.
+      result = lower > 0 ? lower : NAN;
+      break;
+    }
+
+    // The daemon's buckets double in size, so an observation here was at least half
+    // the bound even if the previous buckets were left out.
+    if (lower < bound / 2) {
+      lower = bound / 2;
+    }
+    result = lower + (bound - lower) * (rank - below) / (window[i] - below);
+    break;
+  }
+
+  free(window);
+  return result;
+}
+
+static void read_memory(template_row *row) {
+  row->rss = row->pss = NAN;
+  if (row->pid <= 0) {
+    return;
+  }
+
+  sds path = sdscatfmt(sdsempty(), "/proc/%I/smaps_rollup", row->pid);
+  line_reader lr;
+  int rc = line_reader_open(&lr, path);
+  sdsfree(path);
+  if (rc < 0) {
+    return;
+  }
+
+  char *line;
+  while ((line = line_reader_next(&lr, NULL))) {
+    unsigned long kb;
+    if (sscanf(line, "Rss: %lu kB", &kb) == 1) {
+      row->rss = kb * 1024.0;
+    } else if (sscanf(line, "Pss: %lu kB", &kb) == 1) {
+      row->pss = kb * 1024.0;
+    }
+  }
+
+  line_reader_free(&lr);
+}
+
+static int64_t get_pid(sd_bus *bus, const char *service) {
+  sd_bus_creds *creds = NULL;
+  pid_t pid = 0;
+
+  if (sd_bus_get_name_creds(bus, service, SD_BUS_CREDS_PID, &creds) >= 0) {
+    if (sd_bus_creds_get_pid(creds, &pid) < 0) {
+      pid = 0;
+    }
+    sd_bus_creds_unref(creds);
+  }
+
+  return pid;
+}
+
+// Fills in the row from the module's GetStats reply.
+static int read_stats(sd_bus *bus, template_row *row, double now) {
+  sd_bus_message *reply = NULL;
+  sd_bus_error err = SD_BUS_ERROR_NULL;
+  histogram spawn = {0};
+  int rc;
+
+  double start_time = NAN, started = NAN, reaped = NAN, requests = NAN;
+
+  sds service, object;
+  get_bus_params(row->module, &service, &object);
+
+  rc = sd_bus_call_method(bus, service, object, service, "GetStats", &err, &reply, "");
+  if (rc < 0) {
+    goto end;
+  }
+
+  rc = sd_bus_message_enter_container(reply, 'a', "(ssdta(dt))");
+  if (rc < 0) {
+    goto end;
+  }
+
+  while ((rc = sd_bus_message_enter_container(reply, 'r', "ssdta(dt)")) > 0) {
+    const char *name, *kind;
+    double value;
+    uint64_t count;
+
+    rc = sd_bus_message_read(reply, "ssdt", &name, &kind, &value, &count);
+    if (rc < 0) {
+      goto end;
+    }
+
+    int is_spawn = strcmp(name, "uprocd_spawn_seconds") == 0;
+    rc = read_histogram(reply, is_spawn ? &spawn : NULL);
+    if (rc < 0) {
+      goto end;
+    }
+
+    if (strcmp(name, "uprocd_start_time_seconds") == 0) {
+      start_time = value;
+    } else if (strcmp(name, "uprocd_children_started_total") == 0) {
+      started = value;
+    } else if (strcmp(name, "uprocd_children_reaped_total") == 0) {
+      reaped = value;
+    } else if (strcmp(name, "uprocd_run_requests_total") == 0) {
+      requests = value;
+    }
+
+    rc = sd_bus_message_exit_container(reply);
+    if (rc < 0) {
+      goto end;
+    }
+  }
+
+  end:
+  row->uptime = clock_seconds(CLOCK_REALTIME) - start_time;
+  row->children = started - reaped;
+
+  if (rc < 0 || isnan(requests)) {
+    row->rate = row->p99 = NAN;
+    row->sampled_at = 0;
+    histogram_free(&row->spawn);
+    histogram_free(&spawn);
+  } else if (row->sampled_at > 0 && requests >= row->requests) {
+    row->rate = (requests - row->requests) / (now - row->sampled_at);
+    row->p99 = histogram_quantile(&spawn, &row->spawn, 0.99);
+  } else {
+    // Nothing to compare against yet (or the module restarted), so use the whole
+    // lifetime of the template.
+    row->rate = requests / row->uptime;
+    row->p99 = histogram_quantile(&spawn, NULL, 0.99);
+  }
+
+  if (rc >= 0 && !isnan(requests)) {
+    row->sampled_at = now;
+    row->requests = requests;
+    histogram_free(&row->spawn);
+    row->spawn = spawn;
+  }
+
+  sd_bus_error_free(&err);
+  if (reply) {
+    sd_bus_message_unref(reply);
+  }
+  sdsfree(service);
+  sdsfree(object);
+  return rc;
+}
+
+static double column_value(template_row *row, int column) {
+  switch (column) {
+  case COLUMN_PID: return row->pid;
+  case COLUMN_UPTIME: return row->uptime;
+  case COLUMN_RSS: return row->rss;
+  case COLUMN_PSS: return row->pss;
+  case COLUMN_CHILDREN: return row->children;
+  case COLUMN_RATE: return row->rate;
+  case COLUMN_P99: return row->p99;
+  default: return NAN;
+  }
+}
+
+static int compare_rows(const void *a, const void *b) {
+  template_row *x = *(template_row**)a, *y = *(template_row**)b;
+  if (g_sort_column != COLUMN_MODULE) {
+    double vx = column_value(x, g_sort_column), vy = column_value(y, g_sort_column);
+    // Largest first, with unknown values last.
+    if (isnan(vx) != isnan(vy)) {
+      return isnan(vx) ? 1 : -1;
+    } else if (!isnan(vx) && vx != vy) {
+      return vx < vy ? 1 : -1;
+    }
+  }
+
+  return strcmp(x->module, y->module);
+}
+
+// Looks up every module on the bus, returning those found sorted for display.
+static template_row ** refresh(sd_bus *bus, table *rows, int generation, int *pcount) {
+  char **names = NULL;
+  int rc = sd_bus_list_names(bus, &names, NULL);
+  if (rc < 0) {
+    FAIL("Error listing bus names: %s", strerror(-rc));
+    return NULL;
+  }
+
+  size_t prefix_len = strlen(MODULE_SERVICE_PREFIX);
+  double now = clock_seconds(CLOCK_MONOTONIC);
+  int count = 0;
+
+  for (char **p = names; *p; p++) {
+    if (strncmp(*p, MODULE_SERVICE_PREFIX, prefix_len) != 0) {
+      free(*p);
+      continue;
+    }
+
+    const char *module = *p + prefix_len;
+    template_row *row = table_get(rows, module);
+    if (row == NULL) {
+      row = new(template_row);
+      memset(row, 0, sizeof(*row));
+      row->module = sdsnew(module);
+      table_add(rows, module, row);
+    }
+
+    row->generation = generation;
+    row->pid = get_pid(bus, *p);
+    read_memory(row);
+    read_stats(bus, row, now);
+
+    count++;
+    free(*p);
+  }
+  free(names);
+
+  template_row **sorted = newa(template_row*, count + 1), *row;
+  int i = 0;
+  table_cursor cursor = TABLE_CURSOR_INIT;
+  while (table_iter(rows, &cursor, (void**)&row)) {
+    if (row->generation == generation) {
+      sorted[i++] = row;
+    }
+  }
+
+  qsort(sorted, count, sizeof(template_row*), compare_rows);
+  *pcount = count;
+  return sorted;
+}
+
+static sds format_raw(sds line, double value, const char *fmt) {
+  if (isnan(value)) {
+    return sdscat(line, "\t-");
+  }
+  line = sdscat(line, "\t");
+  return sdscatprintf(line, fmt, value);
+}
+
+static sds format_duration(sds line, double seconds) {
+  if (isnan(seconds)) {
+    return sdscatprintf(line, " %8s", "-");
+  }
+
+  long s = seconds;
+  if (s >= 86400) {
+    return sdscatprintf(line, " %5ldd%02ldh", s / 86400, s % 86400 / 3600);
+  } else if (s >= 3600) {
+    return sdscatprintf(line, " %5ldh%02ldm", s / 3600, s % 3600 / 60);
+  } else if (s >= 60) {
+    return sdscatprintf(line, " %5ldm%02lds", s / 60, s % 60);
+  } else {
+    return sdscatprintf(line, " %7lds", s);
+  }
+}
+
+static sds format_bytes(sds line, double bytes) {
+  if (isnan(bytes)) {
+    return sdscatprintf(line, " %8s", "-");
+  }
+
+  const char *units = "KMGT";
+  int unit = 0;
+  bytes /= 1024;
+  while (bytes >= 1024 && units[unit + 1]) {
+    bytes /= 1024;
+    unit++;
+  }
+
+  return sdscatprintf(line, " %7.1f%c", bytes, units[unit]);
+}
+
+static sds format_latency(sds line, double seconds) {
+  if (isnan(seconds)) {
+    return sdscatprintf(line, " %9s", "-");
+  } else if (seconds >= 1) {
+    return sdscatprintf(line, " %8.2fs", seconds);
+  } else if (seconds >= 1e-3) {
+    return sdscatprintf(line, " %7.1fms", seconds * 1e3);
+  } else {
+    return sdscatprintf(line, " %7.0fus", seconds * 1e6);
+  }
+}
+
+static void print_batch(template_row **sorted, int count) {
+  printf("MODULE\tPID\tUPTIME\tRSS\tPSS\tCHILDREN\tRATE\tP99\n");
+
+  for (int i = 0; i < count; i++) {
+    template_row *row = sorted[i];
+    sds line = sdsnew(row->module);
+    line = row->pid ? sdscatfmt(line, "\t%I", row->pid) : sdscat(line, "\t-");
+    line = format_raw(line, row->uptime, "%.0f");
+    line = format_raw(line, row->rss, "%.0f");
+    line = format_raw(line, row->pss, "%.0f");
+    line = format_raw(line, row->children, "%.0f");
+    line = format_raw(line, row->rate, "%.3f");
+    line = format_raw(line, row->p99, "%.6f");
+    puts(line);
+    sdsfree(line);
+  }
+
+  fflush(stdout);
+}
+
+static void print_screen(template_row **sorted, int count, double delay) {
+  // Draw over the previous screen, clearing only what's left of it, to avoid flicker.
+  sds screen = sdsnew("\033[H");
+
+  time_t now = time(NULL);
+  char clock[16];
+  strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&now));
+  screen = sdscatprintf(screen, "uprocd - %s - %d module%s, refreshing every %gs, "
+                        "sorted by %s\033[K\n\033[K\n", clock, count,
+                        count == 1 ? "" : "s", delay, column_names[g_sort_column]);
+  screen = sdscatprintf(screen, "%-24s %7s %8s %8s %8s %8s %8s %9s\033[K\n", "MODULE",
+                        "PID", "UPTIME", "RSS", "PSS", "CHILDREN", "REQ/S", "P99");
+
+  for (int i = 0; i < count; i++) {
+    template_row *row = sorted[i];
+    screen = sdscatprintf(screen, "%-24s", row->module);
+    screen = row->pid ? sdscatprintf(screen, " %7" PRId64, row->pid)
+                      : sdscatprintf(screen, " %7s", "-");
+    screen = format_duration(screen, row->uptime);
+    screen = format_bytes(screen, row->rss);
+    screen = format_bytes(screen, row->pss);
+    screen = isnan(row->children) ? sdscatprintf(screen, " %8s", "-")
+                                  : sdscatprintf(screen, " %8.0f", row->children);
+    screen = isnan(row->rate) ? sdscatprintf(screen, " %8s", "-")
+                              : sdscatprintf(screen, " %8.1f", row->rate);
+    screen = format_latency(screen, row->p99);
+    screen = sdscat(screen, "\033[K\n");
+  }
+
+  screen = sdscat(screen, "\033[J");
+  fwrite(screen, 1, sdslen(screen), stdout);
+  fflush(stdout);
+  sdsfree(screen);
+}
+
+int top(int argc, char **argv) {
+  sd_bus *bus = NULL;
+  table rows;
+  int rc = 0, opt, batch = !isatty(STDOUT_FILENO), count = -1;
+  double delay = 2;
+
+  while ((opt = getopt(argc, argv, "+hbn:d:s:")) != -1) {
+    char *end = NULL;
+    switch (opt) {
+    case 'h':
+      top_usage();
+      putchar('\n');
+      top_help();
+      return 0;
+    case 'b':
+      batch = 1;
+      break;
+    case 'n':
+      count = strtol(optarg, &end, 10);
+      if (*end || count < 1) {
+        FAIL("Invalid refresh count: %s.", optarg);
+        return 1;
+      }
+      break;
+    case 'd':
+      delay = strtod(optarg, &end);
+      if (*end || !(delay > 0)) {
+        FAIL("Invalid delay: %s.", optarg);
+        return 1;
+      }
+      break;
+    case 's':
+      g_sort_column = -1;
+      for (int i = 0; i < COLUMN_COUNT; i++) {
+        if (strcmp(optarg, column_names[i]) == 0) {
+          g_sort_column = i;
+        }
+      }
+      if (g_sort_column == -1) {
+        FAIL("Invalid sort column: %s.", optarg);
+        return 1;
+      }
+      break;
+    default:
+      top_usage();
+      return 1;
+    }
+  }
+
+  if (optind != argc) {
+    FAIL("top takes no arguments.");
+    top_usage();
+    return 1;
+  }
+
+  if (count == -1 && batch) {
+    count = 1;
+  }
+
+  rc = sd_bus_open_user(&bus);
+  if (rc < 0) {
+    FAIL("sd_bus_open_user failed: %s", strerror(-rc));
+    return 1;
+  }
+
+  table_init(&rows);
+
+  for (int generation = 1; count == -1 || generation <= count; generation++) {
+    int nrows;
+    template_row **sorted = refresh(bus, &rows, generation, &nrows);
+    if (sorted == NULL) {
+      rc = -1;
+      break;
+    }
+
+    if (batch) {
+      if (generation > 1) {
+        putchar('\n');
+      }
+      print_batch(sorted, nrows);
+    } else {
+      print_screen(sorted, nrows, delay);
+    }
+    free(sorted);
+
+    if (count == -1 || generation < count) {
+      struct timespec ts = { .tv_sec = delay, .tv_nsec = (delay - (long)delay) * 1e9 };
+      nanosleep(&ts, NULL);
+    }
+  }
+
+  template_row *row;
+  table_cursor cursor = TABLE_CURSOR_INIT;
+  while (table_iter(&rows, &cursor, (void**)&row)) {
+    sdsfree(row->module);
+    histogram_free(&row->spawn);
+    free(row);
+  }
+  table_free(&rows);
+  sd_bus_unref(bus);
+
+  return rc < 0 ? 1 : 0;
+}
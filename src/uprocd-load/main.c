@@ -0,0 +1,932 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define _GNU_SOURCE
+
+#include "common.h"
+
+#include <systemd/sd-bus.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+// Fires Run requests at a module at increasing concurrency levels, reporting the
+// throughput and latency at each. By default, the module is started on a private
+// dbus-daemon, so nothing else on the system is involved except cgrmvd, if present.
+// Given a trace recorded through a module's CaptureFile, each level instead replays the
+// requests in it, with the same timing and sizes.
+
+#define USAGE "[-h] [-c levels] [-d seconds] [-w seconds] [-r rate] [-t trace] " \
+              "[-s speed] [-j] [-e] [-u uprocd] [-m modules] module [args...]"
+#define DEFAULT_UPROCD "/usr/share/uprocd/bin/uprocd"
+#define DEFAULT_LEVELS "1,2,4,8,16,32"
+// Replays are paced by the trace, so by default only a single level is run, with
+// enough room that bursts from the trace are rarely held back.
+#define DEFAULT_REPLAY_LEVELS "256"
+
+// How long to wait for requests still in flight once a level's time is up.
+#define DRAIN_SECONDS 30
+
+extern char **environ;
+
+void _fail(sds message) {
+  fprintf(stderr, "uprocd-load: %s\n", message);
+  sdsfree(message);
+}
+
+#define FAIL(...) _fail(sdscatfmt(sdsempty(), __VA_ARGS__))
+
+typedef struct samples {
+  double *values;
+  size_t len, cap;
+} samples;
+
+typedef struct level_result {
+  int concurrency;
+  double elapsed;
+  long sent, completed, errors;
+  // Latencies in seconds: until uprocd replied, and until the child exited.
+  samples spawn, total;
+} level_result;
+
+typedef struct trace {
+  capture_record *records;
+  size_t len;
+  double speed;
+  // Strings of every length in the trace are suffixes of this.
+  sds padding;
+} trace;
+
+typedef struct request {
+  int active;
+  // When the request was meant to be sent, so time spent waiting for a free slot
+  // counts towards its latency.
+  double start;
+  int pidfd;
+} request;
+
+static struct {
+  sd_bus *bus;
+  sds service, object;
+  int argc;
+  char **argv;
+  char *cwd;
+  int devnull;
+
+  trace *trace;
+  // For each capture fd type, the fds passed as stdin and as stdout or stderr.
+  int replay_fds[CAPTURE_FD_SOCKET + 1][2];
+
+  request *requests;
+  int inflight;
+  // NULL while warming up.
+  level_result *current;
+} g_load;
+
+static double now() {
+  return clock_seconds(CLOCK_MONOTONIC);
+}
+
+static void samples_add(samples *s, double value) {
+  if (s->len == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->values = ralloc(s->values, s->cap * sizeof(double));
+  }
+  s->values[s->len++] = value;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static double samples_percentile(samples *s, double q) {
+  if (s->len == 0) {
+    return 0;
+  }
+
+  size_t index = q * s->len;
+  return s->values[index < s->len ? index : s->len - 1];
+}
+
+static void finish_request(request *req, int error) {
+  if (g_load.current) {
+    if (error) {
+      g_load.current->errors++;
+    } else {
+      g_load.current->completed++;
+      samples_add(&g_load.current->total, now() - req->start);
+    }
+  }
+
+  if (req->pidfd != -1) {
+    close(req->pidfd);
+    req->pidfd = -1;
+  }
+  req->active = 0;
+  g_load.inflight--;
+}
+
+static int on_reply(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+  request *req = userdata;
+
+  const sd_bus_error *err = sd_bus_message_get_error(reply);
+  if (err) {
+    if (g_load.current && g_load.current->errors == 0) {
+      FAIL("Run failed: %s", err->message);
+    }
+    finish_request(req, 1);
+    return 0;
+  }
+
+  int64_t pid;
+  const char *title;
+  int32_t status;
+  if (sd_bus_message_read(reply, "xsi", &pid, &title, &status) < 0) {
+    finish_request(req, 1);
+    return 0;
+  }
+
+  if (g_load.current) {
+    samples_add(&g_load.current->spawn, now() - req->start);
+  }
+
+  // Requests served in-process are already done. Otherwise, wait for the child to
+  // exit, unless it already has.
+  req->pidfd = pid ? pidfd_open_pid(pid) : -1;
+  if (req->pidfd == -1) {
+    finish_request(req, 0);
+  }
+  return 0;
+}
+
+// A string of the given length, which must not exceed the longest in the trace.
+static const char * replay_string(uint32_t len) {
+  return g_load.trace->padding + sdslen(g_load.trace->padding) - len;
+}
+
+static int append_env(sd_bus_message *msg, const capture_record *shape) {
+  int rc = 0;
+
+  if (shape) {
+    // Keys only need to be distinct, and as long as the originals where possible.
+    for (uint32_t i = 0; i < shape->envc && rc >= 0; i++) {
+      uint32_t key_len = shape->lens[shape->argc + 2 * i],
+               value_len = shape->lens[shape->argc + 2 * i + 1];
+      sds key = sdscatfmt(sdsempty(), "R%u", i);
+      if (sdslen(key) < key_len) {
+        key = sdscat(key, replay_string(key_len - sdslen(key)));
+      }
+      rc = sd_bus_message_append(msg, "{ss}", key, replay_string(value_len));
+      sdsfree(key);
+    }
+    return rc;
+  }
+
+  for (char **p = environ; *p; p++) {
+    char *eq = strchr(*p, '=');
+    if (eq == NULL) {
+      continue;
+    }
+
+    sds key = sdsnewlen(*p, eq - *p);
+    rc = sd_bus_message_append(msg, "{ss}", key, eq + 1);
+    sdsfree(key);
+    if (rc < 0) {
+      return rc;
+    }
+  }
+
+  return rc;
+}
+
+// Sends a request with the module's arguments and uprocd-load's own environment, or
+// one shaped like the given trace record.
+static int send_request(request *req, double start, const capture_record *shape) {
+  sd_bus_message *msg = NULL;
+  int rc;
+
+  rc = sd_bus_message_new_method_call(g_load.bus, &msg, g_load.service, g_load.object,
+                                      g_load.service, "RunWithRequestId");
+  if (rc < 0) {
+    goto end;
+  }
+
+  rc = sd_bus_message_open_container(msg, 'a', "{ss}");
+  if (rc < 0) {
+    goto end;
+  }
+
+  rc = append_env(msg, shape);
+  if (rc < 0) {
+    goto end;
+  }
+
+  rc = sd_bus_message_close_container(msg);
+  if (rc < 0) {
+    goto end;
+  }
+
+  rc = sd_bus_message_open_container(msg, 'a', "s");
+  if (rc < 0) {
+    goto end;
+  }
+
+  int argc = shape ? shape->argc : g_load.argc;
+  for (int i = 0; i < argc; i++) {
+    rc = sd_bus_message_append_basic(msg, 's', shape ? replay_string(shape->lens[i]) :
+                                                       g_load.argv[i]);
+    if (rc < 0) {
+      goto end;
+    }
+  }
+
+  rc = sd_bus_message_close_container(msg);
+  if (rc < 0) {
+    goto end;
+  }
+
+  int fds[3] = {g_load.devnull, g_load.devnull, g_load.devnull};
+  if (shape) {
+    for (int i = 0; i < 3; i++) {
+      int type = shape->fd_types[i] <= CAPTURE_FD_SOCKET ? shape->fd_types[i] :
+                 CAPTURE_FD_OTHER;
+      fds[i] = g_load.replay_fds[type][i != 0];
+    }
+  }
+
+  char request_id[REQUEST_ID_SIZE];
+  request_id_generate(request_id);
+  rc = sd_bus_message_append(msg, "s(hhh)xs", g_load.cwd, fds[0], fds[1], fds[2],
+                             (int64_t)getpid(), request_id);
+  if (rc < 0) {
+    goto end;
+  }
+
+  rc = sd_bus_call_async(g_load.bus, NULL, msg, on_reply, req, 0);
+  if (rc < 0) {
+    goto end;
+  }
+
+  req->active = 1;
+  req->start = start;
+  req->pidfd = -1;
+  g_load.inflight++;
+  if (g_load.current) {
+    g_load.current->sent++;
+  }
+
+  end:
+  if (rc < 0) {
+    FAIL("Error sending a Run request: %s", strerror(-rc));
+  }
+  if (msg) {
+    sd_bus_message_unref(msg);
+  }
+  return rc;
+}
+
+// Keeps concurrency requests in flight for the given time, at most rate per second if
+// rate is positive, then waits for them to finish. While replaying a trace, requests
+// are instead sent when they're due, until the whole trace has been sent.
+static int run_level(int concurrency, double duration, double rate) {
+  double start = now(), end = start + duration, next = start;
+  int rc = 0;
+
+  trace *tr = g_load.current ? g_load.trace : NULL;
+  size_t replayed = 0;
+  int paced = tr || rate > 0;
+  if (tr) {
+    next = start + tr->records[0].offset / 1e6 / tr->speed;
+  }
+
+  struct pollfd *pfds = newa(struct pollfd, concurrency + 1);
+
+  for (;;) {
+    double t = now();
+    int sending = tr ? replayed < tr->len : t < end;
+    while (sending && g_load.inflight < concurrency && (!paced || next <= t)) {
+      request *req = NULL;
+      for (int i = 0; i < concurrency; i++) {
+        if (!g_load.requests[i].active) {
+          req = &g_load.requests[i];
+          break;
+        }
+      }
+
+      rc = send_request(req, paced ? next : t, tr ? &tr->records[replayed] : NULL);
+      if (rc < 0) {
+        goto end;
+      }
+
+      if (tr) {
+        replayed++;
+        if (replayed < tr->len) {
+          next = start + tr->records[replayed].offset / 1e6 / tr->speed;
+        } else {
+          sending = 0;
+          end = t;
+        }
+      } else if (rate > 0) {
+        next += 1 / rate;
+      }
+    }
+
+    if (!sending && g_load.inflight == 0) {
+      break;
+    } else if (!sending && t >= end + DRAIN_SECONDS) {
+      FAIL("Giving up on %i requests that never finished.", g_load.inflight);
+      for (int i = 0; i < concurrency; i++) {
+        if (g_load.requests[i].active) {
+          finish_request(&g_load.requests[i], 1);
+        }
+      }
+      break;
+    }
+
+    while ((rc = sd_bus_process(g_load.bus, NULL)) > 0);
+    if (rc < 0) {
+      FAIL("Error processing the bus: %s", strerror(-rc));
+      goto end;
+    }
+
+    int npfds = 0;
+    pfds[npfds++] = (struct pollfd){ .fd = sd_bus_get_fd(g_load.bus),
+                                     .events = sd_bus_get_events(g_load.bus) };
+    for (int i = 0; i < concurrency; i++) {
+      if (g_load.requests[i].active && g_load.requests[i].pidfd != -1) {
+        pfds[npfds++] = (struct pollfd){ .fd = g_load.requests[i].pidfd,
+                                         .events = POLLIN };
+      }
+    }
+
+    // Wake up for the next send, the end of the level, or sd-bus's own timeouts. A
+    // replay with every slot taken waits for one to free up instead.
+    double wake = !sending ? end + DRAIN_SECONDS : tr ? INFINITY : end;
+    if (sending && paced && g_load.inflight < concurrency && next < wake) {
+      wake = next;
+    }
+    uint64_t bus_timeout;
+    if (sd_bus_get_timeout(g_load.bus, &bus_timeout) >= 0 && bus_timeout != UINT64_MAX &&
+        bus_timeout / 1e6 < wake) {
+      wake = bus_timeout / 1e6;
+    }
+    int timeout = isinf(wake) ? -1 : wake > t ? (int)((wake - t) * 1000) + 1 : 0;
+    // Replies processed above may have freed up slots to send from right away.
+    if (sending && g_load.inflight < concurrency && (!paced || next <= t)) {
+      timeout = 0;
+    }
+
+    if (poll(pfds, npfds, timeout) == -1 && errno != EINTR) {
+      FAIL("poll failed: %s", strerror(errno));
+      rc = -errno;
+      goto end;
+    }
+
+    for (int i = 1; i < npfds; i++) {
+      if (!pfds[i].revents) {
+        continue;
+      }
+
+      for (int j = 0; j < concurrency; j++) {
+        if (g_load.requests[j].active && g_load.requests[j].pidfd == pfds[i].fd) {
+          finish_request(&g_load.requests[j], 0);
+          break;
+        }
+      }
+    }
+  }
+
+  if (g_load.current) {
+    g_load.current->elapsed = now() - start;
+  }
+
+  end:
+  free(pfds);
+  return rc;
+}
+
+// Reads every request in a trace, placing the segments left by each daemon start one
+// after the other.
+static trace * load_trace(const char *path, double speed) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    FAIL("Error opening %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  sds data = sdsempty();
+  char buf[65536];
+  size_t sz;
+  while ((sz = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    data = sdscatlen(data, buf, sz);
+  }
+  int read_error = ferror(fp);
+  fclose(fp);
+
+  trace *tr = new(trace);
+  tr->speed = speed;
+  size_t cap = 0;
+  uint32_t longest = 0;
+  uint64_t base = 0, last = 0, start;
+
+  const char *p = data, *end = data + sdslen(data);
+  capture_record rec = {0};
+  int kind = CAPTURE_END;
+  while (!read_error && (kind = capture_decode(&p, end, &start, &rec)) > 0) {
+    if (kind == CAPTURE_HEADER) {
+      base = last;
+      continue;
+    }
+
+    rec.offset += base;
+    last = rec.offset;
+
+    uint32_t nlens = rec.argc + 2 * rec.envc;
+    for (uint32_t i = 0; i < nlens; i++) {
+      if (rec.lens[i] > longest) {
+        longest = rec.lens[i];
+      }
+    }
+
+    if (tr->len == cap) {
+      cap = cap ? cap * 2 : 1024;
+      tr->records = ralloc(tr->records, cap * sizeof(capture_record));
+    }
+    tr->records[tr->len] = rec;
+    tr->records[tr->len].lens = newa(uint32_t, nlens + 1);
+    memcpy(tr->records[tr->len].lens, rec.lens, nlens * sizeof(uint32_t));
+    tr->len++;
+  }
+  free(rec.lens);
+  sdsfree(data);
+
+  if (read_error || kind < 0) {
+    FAIL("Error reading %s: %s", path, read_error ? "I/O error" : "corrupt trace");
+  } else if (tr->len == 0) {
+    FAIL("%s doesn't contain any requests.", path);
+  } else {
+    tr->padding = sdsgrowzero(sdsempty(), longest);
+    memset(tr->padding, 'x', longest);
+    return tr;
+  }
+
+  for (size_t i = 0; i < tr->len; i++) {
+    free(tr->records[i].lens);
+  }
+  free(tr->records);
+  free(tr);
+  return NULL;
+}
+
+static void free_trace(trace *tr) {
+  if (tr == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < tr->len; i++) {
+    free(tr->records[i].lens);
+  }
+  free(tr->records);
+  sdsfree(tr->padding);
+  free(tr);
+}
+
+// Opens an fd of each type a trace may ask for. Nothing reads what the children write
+// to pipes or sockets, or writes to their stdin, so traces are best replayed against a
+// module that leaves its fds alone, like noop.
+static int open_replay_fds() {
+  int pipefds[2], sockfds[2];
+  if (pipe2(pipefds, O_CLOEXEC) == -1 ||
+      socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockfds) == -1) {
+    FAIL("Error creating fds to replay with: %s", strerror(errno));
+    return -1;
+  }
+
+  const char *tmpdir = getenv("TMPDIR");
+  sds path = sdscatfmt(sdsempty(), "%s/uprocd-load.XXXXXX", tmpdir ? tmpdir : "/tmp");
+  int file = mkostemp(path, O_CLOEXEC);
+  if (file == -1) {
+    FAIL("Error creating %S: %s", path, strerror(errno));
+    sdsfree(path);
+    return -1;
+  }
+  unlink(path);
+  sdsfree(path);
+
+  // Fall back to /dev/null where there are no ptys to be had. The master is kept
+  // open for as long as uprocd-load runs, so the terminal never hangs up.
+  int tty = g_load.devnull;
+  int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (master != -1 && grantpt(master) == 0 && unlockpt(master) == 0) {
+    char *name = ptsname(master);
+    int slave = name ? open(name, O_RDWR | O_NOCTTY | O_CLOEXEC) : -1;
+    if (slave != -1) {
+      tty = slave;
+    }
+  }
+
+  int fds[][2] = {
+    [CAPTURE_FD_OTHER] = {g_load.devnull, g_load.devnull},
+    [CAPTURE_FD_NULL] = {g_load.devnull, g_load.devnull},
+    [CAPTURE_FD_TTY] = {tty, tty},
+    [CAPTURE_FD_FILE] = {file, file},
+    [CAPTURE_FD_PIPE] = {pipefds[0], pipefds[1]},
+    [CAPTURE_FD_SOCKET] = {sockfds[0], sockfds[0]},
+  };
+  memcpy(g_load.replay_fds, fds, sizeof(fds));
+  return 0;
+}
+
+static void print_table(level_result *results, int nresults) {
+  printf("%5s %9s %8s %7s  %8s %8s %8s  %8s %8s %8s\n", "CONC", "REQ/S", "DONE",
+         "ERR%", "SPAWN50", "SPAWN90", "SPAWN99", "TOTAL50", "TOTAL90", "TOTAL99");
+
+  for (int i = 0; i < nresults; i++) {
+    level_result *r = &results[i];
+    long finished = r->completed + r->errors;
+    printf("%5d %9.1f %8ld %6.2f%%", r->concurrency,
+           r->elapsed > 0 ? r->completed / r->elapsed : 0, r->completed,
+           finished ? 100.0 * r->errors / finished : 0);
+
+    samples *latencies[] = {&r->spawn, &r->total};
+    for (int j = 0; j < 2; j++) {
+      putchar(' ');
+      double qs[] = {0.5, 0.9, 0.99};
+      for (int k = 0; k < 3; k++) {
+        printf(" %6.2fms", samples_percentile(latencies[j], qs[k]) * 1e3);
+      }
+    }
+    putchar('\n');
+  }
+}
+
+static void print_json(const char *module, double rate, const char *trace_path,
+                       level_result *results, int nresults) {
+  printf("{\n  \"module\": \"%s\",\n  \"rate\": %g,\n", module, rate);
+  if (trace_path) {
+    printf("  \"trace\": \"%s\",\n  \"speed\": %g,\n", trace_path, g_load.trace->speed);
+  }
+  printf("  \"levels\": [");
+
+  for (int i = 0; i < nresults; i++) {
+    level_result *r = &results[i];
+    printf("%s\n    {\"concurrency\":%d,\"elapsed\":%.6f,\"sent\":%ld,\"completed\":%ld,"
+           "\"errors\":%ld,\"throughput\":%.3f", i ? "," : "", r->concurrency, r->elapsed,
+           r->sent, r->completed, r->errors,
+           r->elapsed > 0 ? r->completed / r->elapsed : 0);
+
+    const char *names[] = {"spawn", "total"};
+    samples *latencies[] = {&r->spawn, &r->total};
+    for (int j = 0; j < 2; j++) {
+      printf(",\"%s\":{\"p50\":%.6f,\"p90\":%.6f,\"p99\":%.6f,\"max\":%.6f}", names[j],
+             samples_percentile(latencies[j], 0.5), samples_percentile(latencies[j], 0.9),
+             samples_percentile(latencies[j], 0.99), samples_percentile(latencies[j], 1));
+    }
+    putchar('}');
+  }
+
+  printf("\n  ]\n}\n");
+}
+
+typedef struct private_bus {
+  sds dir, log;
+  pid_t daemon, uprocd;
+} private_bus;
+
+static pid_t spawn(char **argv, int stdout_fd, int stderr_fd) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (stdout_fd != -1) {
+      dup2(stdout_fd, 1);
+    }
+    if (stderr_fd != -1) {
+      dup2(stderr_fd, 2);
+    }
+    execvp(argv[0], argv);
+    fprintf(stderr, "uprocd-load: Error executing %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+
+  if (pid == -1) {
+    FAIL("fork failed: %s", strerror(errno));
+  }
+  return pid;
+}
+
+static int wait_for_name(sd_bus *bus, const char *service, pid_t uprocd) {
+  double deadline = now() + 30;
+  while (now() < deadline) {
+    sd_bus_message *reply = NULL;
+    int has_owner = 0;
+    if (sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                           "org.freedesktop.DBus", "NameHasOwner", NULL, &reply, "s",
+                           service) >= 0) {
+      sd_bus_message_read(reply, "b", &has_owner);
+      sd_bus_message_unref(reply);
+    }
+
+    if (has_owner) {
+      return 0;
+    }
+
+    if (waitpid(uprocd, NULL, WNOHANG) == uprocd) {
+      FAIL("uprocd exited before acquiring %s.", service);
+      return -1;
+    }
+
+    usleep(50 * 1000);
+  }
+
+  FAIL("Timed out waiting for uprocd to acquire %s.", service);
+  return -1;
+}
+
+static void stop_private_bus(private_bus *pb, int failed) {
+  if (pb->uprocd > 0) {
+    kill(pb->uprocd, SIGTERM);
+    waitpid(pb->uprocd, NULL, 0);
+  }
+  if (pb->daemon > 0) {
+    kill(pb->daemon, SIGTERM);
+    waitpid(pb->daemon, NULL, 0);
+  }
+
+  if (failed && pb->log) {
+    FAIL("uprocd's log follows:");
+    line_reader lr;
+    if (line_reader_open(&lr, pb->log) == 0) {
+      char *line;
+      while ((line = line_reader_next(&lr, NULL))) {
+        fprintf(stderr, "  %s\n", line);
+      }
+      line_reader_free(&lr);
+    }
+  }
+
+  if (pb->dir) {
+    sds path = sdscat(sdsdup(pb->dir), "/uprocd/modules");
+    unlink(path);
+    sdsrange(path, 0, -(int)strlen("/modules") - 1);
+    rmdir(path);
+    sdsfree(path);
+    unlink(pb->log);
+    rmdir(pb->dir);
+  }
+
+  sdsfree(pb->dir);
+  sdsfree(pb->log);
+}
+
+// Starts a dbus-daemon and the module's uprocd in a temporary directory, pointing the
+// session bus at it. If modules is given, it replaces the user's module directory.
+static int start_private_bus(private_bus *pb, const char *uprocd, const char *modules,
+                             const char *module) {
+  memset(pb, 0, sizeof(*pb));
+
+  const char *tmpdir = getenv("TMPDIR");
+  pb->dir = sdscatfmt(sdsempty(), "%s/uprocd-load.XXXXXX", tmpdir ? tmpdir : "/tmp");
+  if (mkdtemp(pb->dir) == NULL) {
+    FAIL("Error creating %S: %s", pb->dir, strerror(errno));
+    sdsfree(pb->dir);
+    pb->dir = NULL;
+    return -1;
+  }
+  pb->log = sdscat(sdsdup(pb->dir), "/uprocd.log");
+
+  int address_pipe[2];
+  if (pipe(address_pipe) == -1) {
+    FAIL("Error creating a pipe: %s", strerror(errno));
+    return -1;
+  }
+
+  sds listen = sdscatfmt(sdsempty(), "--address=unix:path=%S/bus", pb->dir);
+  char *daemon_argv[] = {"dbus-daemon", "--session", "--nofork", "--nopidfile",
+                         listen, "--print-address=1", NULL};
+  pb->daemon = spawn(daemon_argv, address_pipe[1], -1);
+  close(address_pipe[1]);
+  sdsfree(listen);
+
+  // dbus-daemon keeps the pipe open, so only read up to the end of the address.
+  FILE *fp = fdopen(address_pipe[0], "r");
+  char address[4096];
+  if (pb->daemon == -1 || fgets(address, sizeof(address), fp) == NULL) {
+    FAIL("Error starting dbus-daemon.");
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  address[strcspn(address, "\n")] = 0;
+  setenv("DBUS_SESSION_BUS_ADDRESS", address, 1);
+
+  if (modules) {
+    // uprocd searches $XDG_CONFIG_HOME/uprocd/modules.
+    char *resolved = realpath(modules, NULL);
+    sds dir = sdscat(sdsdup(pb->dir), "/uprocd");
+    sds link = sdscat(sdsdup(dir), "/modules");
+    int ok = resolved && mkdir(dir, 0700) != -1 && symlink(resolved, link) != -1;
+    if (!ok) {
+      FAIL("Error setting up the module directory %s: %s", modules, strerror(errno));
+    }
+
+    free(resolved);
+    sdsfree(dir);
+    sdsfree(link);
+    if (!ok) {
+      return -1;
+    }
+
+    setenv("XDG_CONFIG_HOME", pb->dir, 1);
+  }
+
+  int log = open(pb->log, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  char *uprocd_argv[] = {(char*)uprocd, "+", (char*)module, NULL};
+  pb->uprocd = spawn(uprocd_argv, -1, log);
+  if (log != -1) {
+    close(log);
+  }
+
+  return pb->uprocd == -1 ? -1 : 0;
+}
+
+static void usage() {
+  puts("usage: uprocd-load " USAGE);
+}
+
+static void help() {
+  puts("uprocd-load measures how many Run requests per second a uprocd module can serve.");
+  puts("");
+  puts("  -h             Show this screen.");
+  puts("  -c levels      Comma-separated concurrency levels to sweep. (default: "
+       DEFAULT_LEVELS ")");
+  puts("  -d seconds     How long to run each level. (default: 5)");
+  puts("  -w seconds     How long to warm up before the first level. (default: 1)");
+  puts("  -r rate        Send at most this many requests per second. (default: no limit)");
+  puts("  -t trace       Replay the requests recorded in a module's CaptureFile, once per");
+  puts("                 level. (default levels: " DEFAULT_REPLAY_LEVELS ")");
+  puts("  -s speed       Replay the trace this many times faster. (default: 1)");
+  puts("  -j             Print the results as JSON.");
+  puts("  -e             Use the module already running on the session bus, instead of");
+  puts("                 starting it on a private dbus-daemon.");
+  puts("  -u uprocd      The uprocd binary to start. (default: " DEFAULT_UPROCD ")");
+  puts("  -m modules     A directory to look for the module in, in place of the user's.");
+  puts("  module         The module to send requests to.");
+  puts("  [args...]      Arguments for each request, except those from a trace.");
+}
+
+int main(int argc, char **argv) {
+  const char *levels_arg = NULL, *uprocd = DEFAULT_UPROCD, *modules = NULL,
+             *trace_path = NULL;
+  double duration = 5, warmup = 1, rate = 0, speed = 1;
+  int json = 0, existing = 0, opt, rc = 1;
+
+  while ((opt = getopt(argc, argv, "+hc:d:w:r:t:s:jeu:m:")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage();
+      putchar('\n');
+      help();
+      return 0;
+    case 'c': levels_arg = optarg; break;
+    case 'd': duration = atof(optarg); break;
+    case 'w': warmup = atof(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 't': trace_path = optarg; break;
+    case 's': speed = atof(optarg); break;
+    case 'j': json = 1; break;
+    case 'e': existing = 1; break;
+    case 'u': uprocd = optarg; break;
+    case 'm': modules = optarg; break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    FAIL("A module is required.");
+    usage();
+    return 1;
+  }
+
+  if (!(duration > 0) || warmup < 0 || rate < 0 || !(speed > 0)) {
+    FAIL("Durations, rates and speeds must be positive.");
+    return 1;
+  }
+  if (trace_path && rate > 0) {
+    FAIL("A trace sets its own rate, so -r can't be used with -t.");
+    return 1;
+  }
+  if (levels_arg == NULL) {
+    levels_arg = trace_path ? DEFAULT_REPLAY_LEVELS : DEFAULT_LEVELS;
+  }
+
+  char *module = argv[optind];
+  g_load.argc = argc - optind - 1;
+  g_load.argv = argv + optind + 1;
+
+  int nlevels;
+  sds *levels = sdssplitlen(levels_arg, strlen(levels_arg), ",", 1, &nlevels);
+  level_result *results = newa(level_result, nlevels);
+  memset(results, 0, sizeof(level_result) * nlevels);
+
+  int max_concurrency = 0;
+  for (int i = 0; i < nlevels; i++) {
+    results[i].concurrency = atoi(levels[i]);
+    if (results[i].concurrency < 1) {
+      FAIL("Invalid concurrency level: %S.", levels[i]);
+      sdsfreesplitres(levels, nlevels);
+      return 1;
+    }
+    if (results[i].concurrency > max_concurrency) {
+      max_concurrency = results[i].concurrency;
+    }
+  }
+  sdsfreesplitres(levels, nlevels);
+
+  if (trace_path && (g_load.trace = load_trace(trace_path, speed)) == NULL) {
+    free(results);
+    return 1;
+  }
+
+  // If dbus-daemon dies, report the failed requests instead of dying with it.
+  signal(SIGPIPE, SIG_IGN);
+
+  private_bus pb = {0};
+  if (!existing && start_private_bus(&pb, uprocd, modules, module) < 0) {
+    goto end;
+  }
+
+  get_bus_params(module, &g_load.service, &g_load.object);
+  g_load.cwd = getcwd(NULL, 0);
+  g_load.devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (g_load.trace && open_replay_fds() < 0) {
+    goto end;
+  }
+  g_load.requests = newa(request, max_concurrency);
+  memset(g_load.requests, 0, sizeof(request) * max_concurrency);
+
+  int brc = sd_bus_open_user(&g_load.bus);
+  if (brc < 0) {
+    FAIL("sd_bus_open_user failed: %s", strerror(-brc));
+    goto end;
+  }
+
+  if (!existing && wait_for_name(g_load.bus, g_load.service, pb.uprocd) < 0) {
+    goto end;
+  }
+
+  if (warmup > 0 && run_level(1, warmup, 0) < 0) {
+    goto end;
+  }
+
+  for (int i = 0; i < nlevels; i++) {
+    g_load.current = &results[i];
+    if (run_level(results[i].concurrency, duration, rate) < 0) {
+      goto end;
+    }
+    qsort(results[i].spawn.values, results[i].spawn.len, sizeof(double), compare_doubles);
+    qsort(results[i].total.values, results[i].total.len, sizeof(double), compare_doubles);
+
+    if (!json) {
+      fprintf(stderr, "Finished concurrency %i.\n", results[i].concurrency);
+    }
+  }
+
+  if (json) {
+    print_json(module, rate, trace_path, results, nlevels);
+  } else {
+    print_table(results, nlevels);
+  }
+  rc = 0;
+
+  end:
+  if (g_load.bus) {
+    sd_bus_flush_close_unref(g_load.bus);
+  }
+  if (!existing) {
+    stop_private_bus(&pb, rc != 0);
+  }
+
+  for (int i = 0; i < nlevels; i++) {
+    free(results[i].spawn.values);
+    free(results[i].total.values);
+  }
+  free(results);
+  free(g_load.requests);
+  free(g_load.cwd);
+  free_trace(g_load.trace);
+  sdsfree(g_load.service);
+  sdsfree(g_load.object);
+  return rc;
+}
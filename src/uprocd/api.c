@@ -3,17 +3,27 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "private.h"
+#include "probes.h"
 #include "uprocd.h"
 
 #include <systemd/sd-bus.h>
 
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
 #include <unistd.h>
 
 extern char **environ;
 
+UPROCD_EXPORT const char * uprocd_module_name() {
+  return global_run_data.module;
+}
+
 UPROCD_EXPORT const char * uprocd_module_directory() {
   return global_run_data.module_dir;
 }
@@ -31,7 +41,7 @@ static user_value *config_get(const char *key) {
 }
 
 static int is_index_valid(user_value *usr, int index) {
-  return index > 0 && index < usr->list.len;
+  return index >= 0 && index < usr->list.len;
 }
 
 UPROCD_EXPORT int uprocd_config_present(const char *key) {
@@ -65,13 +75,6 @@ UPROCD_EXPORT const char *uprocd_config_string_at(const char *list,
   return usr && is_index_valid(usr, index) ? usr->list.items[index]->string : NULL;
 }
 
-struct uprocd_context {
-  int argc;
-  sds *argv, *env;
-  sds cwd;
-  int fds[3], pid;
-};
-
 UPROCD_EXPORT void uprocd_context_get_args(uprocd_context *ctx, int *pargc,
                                            char ***pargv) {
   *pargc = ctx->argc;
@@ -82,24 +85,27 @@ UPROCD_EXPORT const char ** uprocd_context_get_env(uprocd_context *ctx) {
   return (const char **)ctx->env;
 }
 
+UPROCD_EXPORT void uprocd_context_get_fds(uprocd_context *ctx, int *fds) {
+  memcpy(fds, ctx->fds, sizeof(ctx->fds));
+}
+
 UPROCD_EXPORT const char * uprocd_context_get_cwd(uprocd_context *ctx) {
   return ctx->cwd;
 }
 
 UPROCD_EXPORT void uprocd_context_free(uprocd_context *ctx) {
-  for (sds *p = ctx->env; *p; p++) {
-    sdsfree(*p);
+  for (int i = 0; i < 3; i++) {
+    if (ctx->fds[i] != -1) {
+      close(ctx->fds[i]);
+    }
   }
-  free(ctx->env);
-  for (int i = 0; i < ctx->argc; i++) {
-    sdsfree(ctx->argv[i]);
+  if (ctx->moved_fd != -1) {
+    close(ctx->moved_fd);
   }
-  free(ctx->argv);
-  sdsfree(ctx->cwd);
-  close(ctx->fds[0]);
-  close(ctx->fds[1]);
-  close(ctx->fds[2]);
-  free(ctx);
+
+  // ctx lives in its own arena.
+  arena a = ctx->arena;
+  arena_free(&a);
 }
 
 static void move_cgroups(int64_t origin) {
@@ -118,9 +124,18 @@ static void move_cgroups(int64_t origin) {
 
   rc = sd_bus_call_method(bus, "com.refi64.uprocd.Cgrmvd",
                           "/com/refi64/uprocd/Cgrmvd", "com.refi64.uprocd.Cgrmvd",
-                          "MoveCgroup", &err, &msg, "xx", pid, origin);
+                          "MoveCgroupForRequest", &err, &msg, "xxs", pid, origin,
+                          global_run_data.request.id);
+  if (rc < 0 && sd_bus_error_has_name(&err, SD_BUS_ERROR_UNKNOWN_METHOD)) {
+    // An older cgrmvd, which can't log the request ID.
+    sd_bus_error_free(&err);
+    rc = sd_bus_call_method(bus, "com.refi64.uprocd.Cgrmvd",
+                            "/com/refi64/uprocd/Cgrmvd", "com.refi64.uprocd.Cgrmvd",
+                            "MoveCgroup", &err, &msg, "xx", pid, origin);
+  }
   if (rc < 0) {
     FAIL("Error calling com.refi64.uprocd.Cgrmvd.MoveCgroup: %s", err.message);
+    uprocd_metric_counter_add(g_stats.cgroup_failures, 1);
     goto end;
   }
 
@@ -130,7 +145,198 @@ static void move_cgroups(int64_t origin) {
   sd_bus_unref(bus);
 }
 
+// How long a move may go unanswered before cgrmvd is taken to be wedged, and every
+// child still waiting falls back to D-Bus.
+#define CGRMVD_TIMEOUT 5.0
+
+// A move sent to cgrmvd that hasn't been answered yet. Both ends of the child's pipe
+// are kept, so writing the result can't raise SIGPIPE if the child already died.
+typedef struct cgroup_move {
+  uint32_t serial;
+  pid_t child;
+  int moved[2];
+  double sent;
+  struct cgroup_move *next;
+} cgroup_move;
+
+static int g_cgrmvd_sock = -1, g_pidfd_unsupported = 0;
+static uint32_t g_cgrmvd_serial = 0;
+static cgroup_move *g_moves = NULL;
+
+static void finish_move(cgroup_move *move, char handled) {
+  write(move->moved[1], &handled, 1);
+  close(move->moved[0]);
+  close(move->moved[1]);
+  free(move);
+}
+
+// Drops the connection, sending every child still waiting on it to D-Bus instead.
+static void reset_cgrmvd() {
+  while (g_moves) {
+    cgroup_move *next = g_moves->next;
+    finish_move(g_moves, 0);
+    g_moves = next;
+  }
+
+  if (g_cgrmvd_sock != -1) {
+    close(g_cgrmvd_sock);
+    g_cgrmvd_sock = -1;
+  }
+}
+
+static int connect_cgrmvd() {
+  // Non-blocking, so a stalled cgrmvd can never hold up the template.
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    FAIL("Error creating cgrmvd socket: %s", strerror(errno));
+    return -1;
+  }
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strncpy(addr.sun_path, CGRMVD_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    // No socket means an older or D-Bus-only cgrmvd, so stay quiet about it.
+    if (errno != ENOENT && errno != ECONNREFUSED) {
+      FAIL("Error connecting to %s: %s", CGRMVD_SOCKET_PATH, strerror(errno));
+    }
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Asks cgrmvd to move a newly forked child into the origin's cgroups over the
+// template's persistent connection, without waiting for the answer, which is written
+// to the child's pipe by cgroup_moves_process. Returns 1 if the request was sent and
+// the pipe taken over, otherwise the child has to fall back to D-Bus.
+static int move_child_cgroups(pid_t child, int64_t origin, int moved[2]) {
+  if (g_pidfd_unsupported) {
+    return 0;
+  }
+
+  int queued = 0;
+  int pidfds[2] = { pidfd_open_pid(child), pidfd_open_pid(origin) };
+  if (pidfds[0] == -1 || pidfds[1] == -1) {
+    if (errno == ENOSYS) {
+      g_pidfd_unsupported = 1;
+    }
+    goto end;
+  }
+
+  // One retry, in case cgrmvd was restarted and the old connection is dead.
+  for (int attempt = 0; attempt < 2 && !queued; attempt++) {
+    if (g_cgrmvd_sock == -1) {
+      g_cgrmvd_sock = connect_cgrmvd();
+      if (g_cgrmvd_sock == -1) {
+        break;
+      }
+    }
+
+    cgrmvd_request req = { .version = CGRMVD_PROTOCOL_VERSION,
+                           .serial = ++g_cgrmvd_serial };
+    memcpy(req.request_id, global_run_data.request.id, sizeof(req.request_id));
+    ssize_t sz = send_fds(g_cgrmvd_sock, &req, sizeof(req), pidfds, 2);
+    if (sz == sizeof(req)) {
+      cgroup_move *move = new(cgroup_move);
+      move->serial = req.serial;
+      move->child = child;
+      memcpy(move->moved, moved, sizeof(move->moved));
+      move->sent = stats_now();
+      move->next = g_moves;
+      g_moves = move;
+      queued = 1;
+    } else if (sz == -EAGAIN) {
+      // cgrmvd is far enough behind that the socket is full.
+      break;
+    } else {
+      reset_cgrmvd();
+    }
+  }
+
+  end:
+  for (int i = 0; i < 2; i++) {
+    if (pidfds[i] != -1) {
+      close(pidfds[i]);
+    }
+  }
+  return queued;
+}
+
+void cgroup_moves_prepare(struct pollfd *pfd, int *timeout) {
+  pfd->fd = g_moves ? g_cgrmvd_sock : -1;
+  pfd->events = POLLIN;
+  pfd->revents = 0;
+
+  double now = stats_now();
+  for (cgroup_move *move = g_moves; move; move = move->next) {
+    double left = move->sent + CGRMVD_TIMEOUT - now;
+    int ms = left > 0 ? (int)(left * 1000) + 1 : 0;
+    if (*timeout < 0 || ms < *timeout) {
+      *timeout = ms;
+    }
+  }
+}
+
+void cgroup_moves_process() {
+  while (g_moves) {
+    cgrmvd_response resp;
+    int nfds = 0;
+    ssize_t sz = recv_fds(g_cgrmvd_sock, &resp, sizeof(resp), NULL, &nfds);
+    if (sz == -EAGAIN) {
+      break;
+    } else if (sz != sizeof(resp)) {
+      FAIL("WARNING: Lost the cgrmvd connection, falling back to D-Bus.");
+      reset_cgrmvd();
+      return;
+    }
+
+    for (cgroup_move **pmove = &g_moves; *pmove; pmove = &(*pmove)->next) {
+      cgroup_move *move = *pmove;
+      if (move->serial != resp.serial) {
+        continue;
+      }
+
+      *pmove = move->next;
+      if (resp.status < 0) {
+        FAIL("cgrmvd failed to move %i: %s", (int)move->child, strerror(-resp.status));
+        uprocd_metric_counter_add(g_stats.cgroup_failures, 1);
+      }
+      uprocd_metric_histogram_observe(g_stats.cgroup_seconds, stats_now() - move->sent);
+      finish_move(move, 1);
+      break;
+    }
+  }
+
+  double now = stats_now();
+  for (cgroup_move *move = g_moves; move; move = move->next) {
+    if (now - move->sent >= CGRMVD_TIMEOUT) {
+      FAIL("WARNING: cgrmvd didn't answer in time, falling back to D-Bus.");
+      reset_cgrmvd();
+      break;
+    }
+  }
+}
+
+static void wait_for_cgroup_move(uprocd_context *ctx) {
+  char handled = 0;
+  if (read(ctx->moved_fd, &handled, 1) != 1) {
+    handled = 0;
+  }
+  close(ctx->moved_fd);
+  ctx->moved_fd = -1;
+
+  if (!handled) {
+    move_cgroups(ctx->pid);
+  }
+
+  PROBE(uprocd, cgroup__moved, ctx->pid, (int)handled);
+}
+
 UPROCD_EXPORT void uprocd_context_enter(uprocd_context *ctx) {
+  PROBE(uprocd, context__enter__begin, ctx->pid);
+  double start = stats_now();
+
   for (char **p = environ; *p; p++) {
     sds env = sdsnew(*p);
     sds eq = strchr(env, '=');
@@ -139,12 +345,12 @@ UPROCD_EXPORT void uprocd_context_enter(uprocd_context *ctx) {
     sdsfree(env);
   }
 
-  for (sds *p = ctx->env; *p; p+=2) {
+  for (char **p = ctx->env; *p; p+=2) {
     setenv(p[0], p[1], 1);
   }
 
   if (chdir(ctx->cwd) == -1) {
-    FAIL("WARNING: chdir into new cwd %S failed: %s", ctx->cwd, strerror(errno));
+    FAIL("WARNING: chdir into new cwd %s failed: %s", ctx->cwd, strerror(errno));
   }
 
   close(0);
@@ -154,50 +360,122 @@ UPROCD_EXPORT void uprocd_context_enter(uprocd_context *ctx) {
   dup2(ctx->fds[1], 1);
   dup2(ctx->fds[2], 2);
 
-  move_cgroups(ctx->pid);
+  double cgroup_start = stats_now();
+  wait_for_cgroup_move(ctx);
+  double cgroup_wait = stats_now() - cgroup_start;
 
   if (setpgrp() == -1) {
     FAIL("WARNING: setpgrp failed: %s", strerror(errno));
   }
+
+  PROBE(uprocd, context__enter__end, ctx->pid);
+
+  sds fields[] = {
+    sdscatfmt(sdsempty(), "ENTER_USEC=%U", (uint64_t)((stats_now() - start) * 1e6)),
+    sdscatfmt(sdsempty(), "CGROUP_WAIT_USEC=%U", (uint64_t)(cgroup_wait * 1e6)),
+  };
+  log_fields(LOG_DEBUG, sdsnew("Entered the caller's context."), fields, 2);
 }
 
-sds * convert_env_to_api_format(table *penv) {
-  sds *entries = newa(sds, penv->sz * 2 + 1), *current = entries;
-  char *name = NULL, *value;
-  while ((name = table_next(penv, name, (void**)&value))) {
-    *(current++) = sdsnew(name);
-    *(current++) = sdsnew(value);
+// Makes room for n more strings in a NULL-terminated vector of len strings. The old
+// vector is simply abandoned, since the arena is freed as a whole.
+static char ** grow_vector(uprocd_context *ctx, char **vec, int len, int n, int *cap) {
+  if (len + n + 1 <= *cap) {
+    return vec;
+  }
+
+  int grown = *cap ? *cap * 2 : 16;
+  while (grown < len + n + 1) {
+    grown *= 2;
+  }
+
+  char **res = arena_alloc(&ctx->arena, grown * sizeof(char*));
+  if (len) {
+    memcpy(res, vec, len * sizeof(char*));
   }
+  *cap = grown;
+  return res;
+}
+
+// Big enough for the arguments and environment of most requests, so that decoding one
+// takes a single allocation.
+#define CONTEXT_ARENA_SIZE 16384
+
+uprocd_context * context_new() {
+  arena a;
+  arena_init(&a, CONTEXT_ARENA_SIZE);
+  uprocd_context *ctx = arena_alloc(&a, sizeof(uprocd_context));
+  ctx->arena = a;
+  ctx->fds[0] = ctx->fds[1] = ctx->fds[2] = -1;
+  ctx->moved_fd = -1;
+  // Even an empty request has both vectors, so they never need to be checked for NULL.
+  ctx->argv = grow_vector(ctx, NULL, 0, 0, &ctx->argv_cap);
+  ctx->env = grow_vector(ctx, NULL, 0, 0, &ctx->env_cap);
+  return ctx;
+}
+
+void context_add_arg(uprocd_context *ctx, char *arg) {
+  ctx->argv = grow_vector(ctx, ctx->argv, ctx->argc, 1, &ctx->argv_cap);
+  ctx->argv[ctx->argc++] = arg;
+  ctx->argv[ctx->argc] = NULL;
+}
+
+void context_add_env(uprocd_context *ctx, char *name, char *value) {
+  ctx->env = grow_vector(ctx, ctx->env, ctx->envc * 2, 2, &ctx->env_cap);
+  char **p = ctx->env + ctx->envc++ * 2;
+  p[0] = name;
+  p[1] = value;
+  p[2] = NULL;
+}
 
-  *current = NULL;
-  return entries;
+static void call_fork_handler(void *func, void *userdata) {
+  if (func) {
+    uprocd_fork_handler handler = func;
+    handler(userdata);
+  }
 }
 
-int prepare_context_and_fork(int argc, char **argv, table *env, char *cwd, int *fds,
-                             pid_t pid) {
+int prepare_context_and_fork(uprocd_context *ctx) {
+  pid_t pid = ctx->pid;
+  global_run_data.upcoming_context = ctx;
+
   int wait_for_set_ptracer[2];
   if (pipe(wait_for_set_ptracer) == -1) {
     FAIL("Error creating pipe to wait for prctl: %s", strerror(errno));
     return -errno;
   }
 
-  sds *entries = convert_env_to_api_format(env);
+  int cgroup_moved[2];
+  if (pipe(cgroup_moved) == -1) {
+    FAIL("Error creating pipe to wait for the cgroup move: %s", strerror(errno));
+    close(wait_for_set_ptracer[0]);
+    close(wait_for_set_ptracer[1]);
+    return -errno;
+  }
+
+  ctx->moved_fd = cgroup_moved[0];
 
-  uprocd_context *ctx = new(uprocd_context);
-  ctx->argc = argc;
-  ctx->argv = argv;
-  ctx->env = entries;
-  ctx->cwd = sdsnew(cwd);
-  ctx->fds[0] = dup(fds[0]);
-  ctx->fds[1] = dup(fds[1]);
-  ctx->fds[2] = dup(fds[2]);
-  ctx->pid = pid;
-  global_run_data.upcoming_context = ctx;
+  call_fork_handler(global_run_data.before_fork, global_run_data.before_fork_userdata);
+
+  // Page table copying makes fork slower as the template grows, so keep both around.
+  double rss = stats_sample_rss();
+  double fork_start = stats_now();
+  PROBE(uprocd, fork__start, pid);
 
   pid_t child = fork();
   if (child == -1) {
-    FAIL("fork failed: %s", strerror(errno));
-    return -errno;
+    int err = errno;
+    FAIL("fork failed: %s", strerror(err));
+    uprocd_metric_counter_add(g_stats.fork_failures, 1);
+    call_fork_handler(global_run_data.after_fork_parent,
+                      global_run_data.after_fork_parent_userdata);
+
+    close(wait_for_set_ptracer[0]);
+    close(wait_for_set_ptracer[1]);
+    close(cgroup_moved[0]);
+    close(cgroup_moved[1]);
+    ctx->moved_fd = -1;
+    return -err;
   } else if (child == 0) {
     prctl(PR_SET_PTRACER, pid, 0, 0);
     ioctl(0, TIOCSCTTY, 1);
@@ -205,17 +483,59 @@ int prepare_context_and_fork(int argc, char **argv, table *env, char *cwd, int *
     write(wait_for_set_ptracer[1], "", 1);
     close(wait_for_set_ptracer[0]);
     close(wait_for_set_ptracer[1]);
+    close(cgroup_moved[1]);
+    // Moves still pending belong to the template and the child's siblings.
+    while (g_moves) {
+      cgroup_move *next = g_moves->next;
+      close(g_moves->moved[0]);
+      close(g_moves->moved[1]);
+      free(g_moves);
+      g_moves = next;
+    }
+    if (g_cgrmvd_sock != -1) {
+      close(g_cgrmvd_sock);
+      g_cgrmvd_sock = -1;
+    }
 
     setproctitle("-uprocd:%s", global_run_data.module);
     signal(SIGINT, SIG_DFL);
     signal(SIGCHLD, SIG_DFL);
 
+    call_fork_handler(global_run_data.after_fork_child,
+                      global_run_data.after_fork_child_userdata);
     return 0;
   } else {
+    PROBE(uprocd, fork__end, pid, child);
+    double fork_seconds = stats_stage(g_stats.fork_seconds, &global_run_data.request.fork,
+                                      fork_start);
+    if (rss > 0) {
+      uprocd_metric_histogram_observe(g_stats.fork_seconds_per_gib,
+                                      fork_seconds / (rss / (1 << 30)));
+    }
+    uprocd_metric_counter_add(g_stats.children_started, 1);
+
+    call_fork_handler(global_run_data.after_fork_parent,
+                      global_run_data.after_fork_parent_userdata);
+
+    double handshake_start = stats_now();
     char byte;
     read(wait_for_set_ptracer[0], &byte, 1);
     close(wait_for_set_ptracer[0]);
     close(wait_for_set_ptracer[1]);
+    stats_stage(g_stats.handshake_seconds, &global_run_data.request.handshake,
+                handshake_start);
+
+    // Only sending the move is timed here; the round trip is observed once cgrmvd
+    // answers.
+    double cgroup_start = stats_now();
+    if (!move_child_cgroups(child, pid, cgroup_moved)) {
+      char handled = 0;
+      write(cgroup_moved[1], &handled, 1);
+      close(cgroup_moved[0]);
+      close(cgroup_moved[1]);
+    }
+    global_run_data.request.cgroup = stats_now() - cgroup_start;
+    ctx->moved_fd = -1;
 
     return child;
   }
@@ -226,13 +546,67 @@ UPROCD_EXPORT void uprocd_on_exit(uprocd_exit_handler func, void *userdata) {
   global_run_data.exit_handler_userdata = userdata;
 }
 
+UPROCD_EXPORT void uprocd_on_before_fork(uprocd_fork_handler func, void *userdata) {
+  global_run_data.before_fork = func;
+  global_run_data.before_fork_userdata = userdata;
+}
+
+UPROCD_EXPORT void uprocd_on_after_fork_parent(uprocd_fork_handler func,
+                                               void *userdata) {
+  global_run_data.after_fork_parent = func;
+  global_run_data.after_fork_parent_userdata = userdata;
+}
+
+UPROCD_EXPORT void uprocd_on_after_fork_child(uprocd_fork_handler func, void *userdata) {
+  global_run_data.after_fork_child = func;
+  global_run_data.after_fork_child_userdata = userdata;
+}
+
+static int count_threads() {
+  DIR *dir = opendir("/proc/self/task");
+  if (dir == NULL) {
+    return -errno;
+  }
+
+  int count = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    if (ent->d_name[0] != '.') {
+      count++;
+    }
+  }
+
+  closedir(dir);
+  return count;
+}
+
 UPROCD_EXPORT uprocd_context * uprocd_run() {
   int rc;
   bus_data *data = NULL;
 
   if (setjmp(global_run_data.return_to_loop) != 0) {
     bus_free(data);
-    return global_run_data.upcoming_context;
+    uprocd_context *ctx = global_run_data.upcoming_context;
+    PROBE(uprocd, module__entered, ctx->pid);
+    return ctx;
+  }
+
+  // Only the calling thread survives fork, so any others have to be dealt with by the
+  // module's fork handlers.
+  int threads = count_threads();
+  if (threads > 1 && global_run_data.before_fork == NULL) {
+    FAIL("Refusing to serve: the module is running %i threads, but only the calling "
+         "thread survives a fork.", threads);
+    FAIL("Stop them before calling uprocd_run, or quiesce them with "
+         "uprocd_on_before_fork.");
+    goto failure;
+  }
+
+  if (global_run_data.router_fd != -1) {
+    // A keyed template takes its requests from the router instead of the bus.
+    rc = keyed_template_serve();
+    FAIL("Lost connection to the keyed template router: %s", strerror(-rc));
+    goto failure;
   }
 
   data = bus_new();
@@ -240,14 +614,18 @@ UPROCD_EXPORT uprocd_context * uprocd_run() {
     goto failure;
   }
 
+  stats_flush();
+
   for (;;) {
     rc = bus_pump(data);
     if (rc < 0) {
       goto failure;
     }
     else if (rc == 1) {
-      free(global_run_data.upcoming_context);
-      global_run_data.upcoming_context = NULL;
+      if (global_run_data.upcoming_context) {
+        uprocd_context_free(global_run_data.upcoming_context);
+        global_run_data.upcoming_context = NULL;
+      }
     }
   }
 
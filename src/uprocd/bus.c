@@ -3,9 +3,15 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "private.h"
+#include "probes.h"
+#include "uprocd.h"
 
 #include <systemd/sd-bus.h>
 
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
 int service_method_status(sd_bus_message *msg, void *data, sd_bus_error *err) {
   char *name = global_run_data.module;
   char *description = global_run_data.description ? global_run_data.description :
@@ -14,13 +20,98 @@ int service_method_status(sd_bus_message *msg, void *data, sd_bus_error *err) {
   return sd_bus_reply_method_return(msg, "ss", name, description);
 }
 
+int service_method_get_run_timeout(sd_bus_message *msg, void *data,
+                                   sd_bus_error *err) {
+  uint64_t usec = 0;
+  if (global_run_data.serving) {
+    // Served requests only reply once the handler is done, however long that takes.
+    usec = UINT64_MAX;
+  } else if (global_run_data.key_by && !global_run_data.cold_exec) {
+    // With room to spare for the spawn itself once the template is warm.
+    usec = KEYED_WARMUP_TIMEOUT * 2 * 1000000;
+  }
+
+  return sd_bus_reply_method_return(msg, "t", usec);
+}
+
+int service_method_metrics(sd_bus_message *msg, void *data, sd_bus_error *err) {
+  return metrics_reply(msg, 0);
+}
+
+int service_method_get_stats(sd_bus_message *msg, void *data, sd_bus_error *err) {
+  return metrics_reply(msg, 1);
+}
+
+// The original Run predates request IDs and served statuses, so its callers expect a
+// shorter reply.
+static int run_has_request_id(sd_bus_message *msg) {
+  return strcmp(sd_bus_message_get_member(msg), "Run") != 0;
+}
+
+static int reply_run(sd_bus_message *msg, int64_t pid, int64_t child, char *title) {
+  int rc = run_has_request_id(msg) ?
+           sd_bus_reply_method_return(msg, "xsi", child, title, 0) :
+           sd_bus_reply_method_return(msg, "xs", child, title);
+  PROBE(uprocd, reply__sent, pid, child);
+  if (rc < 0) {
+    uprocd_metric_counter_add(g_stats.reply_failures, 1);
+  }
+
+  stats_finish_request(child);
+  return rc;
+}
+
+int bus_reply_keyed(sd_bus_message *msg, int64_t child) {
+  request_trace *req = &global_run_data.request;
+  char *title = global_run_data.process_name ? global_run_data.process_name :
+                global_run_data.module;
+
+  if (child < 0) {
+    memset(req, 0, sizeof(*req));
+    return sd_bus_reply_method_errno(msg, -child, NULL);
+  } else if (child == 0) {
+    memset(req, 0, sizeof(*req));
+    return sd_bus_reply_method_errorf(msg, KEYED_COLD_EXEC_ERROR, "%s",
+                                      global_run_data.cold_exec);
+  } else {
+    return reply_run(msg, req->pid, child, title);
+  }
+}
+
 int service_method_run(sd_bus_message *msg, void *data, sd_bus_error *err) {
   char *title = global_run_data.process_name ? global_run_data.process_name :
                 global_run_data.module;
 
+  // The caller's PID isn't known until the message is parsed, so tracers have to tie
+  // this to env__parsed by thread.
+  PROBE(uprocd, request__received);
+  request_trace *req = &global_run_data.request;
+  memset(req, 0, sizeof(*req));
+  req->start = stats_now();
+  uprocd_metric_counter_add(g_stats.requests, 1);
+
+  // Forking from here would leave the workers behind in the child, so a draining
+  // server only turns requests away.
+  if (global_run_data.draining) {
+    memset(req, 0, sizeof(*req));
+    return sd_bus_reply_method_errorf(msg, SERVE_DRAINING_ERROR,
+                                      "The module is restarting, try again.");
+  }
+
+  int with_id = run_has_request_id(msg);
+  if (global_run_data.serving && !with_id) {
+    memset(req, 0, sizeof(*req));
+    return sd_bus_reply_method_errorf(msg, SD_BUS_ERROR_NOT_SUPPORTED,
+                                      "This module serves requests in-process, which "
+                                      "needs a newer uprocctl.");
+  }
+
+  // Strings are read in place from the message, and copied once into the context's
+  // arena, which is all the child needs.
   int rc;
-  table env;
-  table_init(&env);
+  uprocd_context *ctx = context_new();
+  arena *a = &ctx->arena;
+  context_add_arg(ctx, arena_strdup(a, title));
 
   rc = sd_bus_message_enter_container(msg, 'a', "{ss}");
   if (rc < 0) {
@@ -33,7 +124,7 @@ int service_method_run(sd_bus_message *msg, void *data, sd_bus_error *err) {
     if (rc < 0) {
       goto read_end;
     }
-    table_add(&env, name, value);
+    context_add_env(ctx, arena_strdup(a, name), arena_strdup(a, value));
 
     rc = sd_bus_message_exit_container(msg);
     if (rc < 0) {
@@ -51,15 +142,9 @@ int service_method_run(sd_bus_message *msg, void *data, sd_bus_error *err) {
     goto read_end;
   }
 
-  int argc = 1;
-  sds *argv = new(sds);
-  argv[0] = sdsnew(title);
-
   char *arg;
   while ((rc = sd_bus_message_read(msg, "s", &arg)) > 0) {
-    argc++;
-    argv = ralloc(argv, argc * sizeof(sds));
-    argv[argc - 1] = sdsnew(arg);
+    context_add_arg(ctx, arena_strdup(a, arg));
   }
 
   rc = sd_bus_message_exit_container(msg);
@@ -67,7 +152,7 @@ int service_method_run(sd_bus_message *msg, void *data, sd_bus_error *err) {
     goto read_end;
   }
 
-  char *cwd;
+  char *cwd, *request_id = "";
   int fds[3];
   int64_t pid;
   rc = sd_bus_message_read(msg, "s(hhh)x", &cwd, &fds[0], &fds[1], &fds[2], &pid);
@@ -75,14 +160,50 @@ int service_method_run(sd_bus_message *msg, void *data, sd_bus_error *err) {
     goto read_end;
   }
 
+  if (with_id) {
+    rc = sd_bus_message_read(msg, "s", &request_id);
+    if (rc < 0) {
+      goto read_end;
+    }
+  }
+
+  ctx->cwd = arena_strdup(a, cwd);
+  ctx->pid = pid;
+  snprintf(req->id, sizeof(req->id), "%s", request_id);
+  req->pid = pid;
+
   read_end:
   if (rc < 0) {
     FAIL("Error parsing bus message: %s", strerror(-rc));
+    uprocd_metric_counter_add(g_stats.parse_failures, 1);
+    memset(req, 0, sizeof(*req));
+    uprocd_context_free(ctx);
+    return rc;
+  }
+
+  stats_stage(g_stats.parse_seconds, &req->parse, req->start);
+  PROBE(uprocd, env__parsed, pid, ctx->argc, ctx->envc);
+
+  // A router only passes the caller's stdio on, so it can borrow the message's.
+  int borrow_fds = global_run_data.key_by && !global_run_data.serving;
+  for (int i = 0; i < 3; i++) {
+    ctx->fds[i] = borrow_fds ? fds[i] : dup(fds[i]);
+  }
+  capture_request(ctx);
+
+  if (global_run_data.serving) {
+    rc = serve_enqueue(msg, ctx);
+    memset(req, 0, sizeof(*req));
     return rc;
   }
 
-  int child = prepare_context_and_fork(argc, argv, &env, cwd, fds, pid);
+  if (global_run_data.key_by) {
+    return keyed_dispatch(msg, ctx);
+  }
+
+  int child = prepare_context_and_fork(ctx);
   if (child < 0) {
+    memset(req, 0, sizeof(*req));
     sd_bus_message_unref(msg);
     return child;
   }
@@ -91,7 +212,7 @@ int service_method_run(sd_bus_message *msg, void *data, sd_bus_error *err) {
     sd_bus_message_unref(msg);
     longjmp(global_run_data.return_to_loop, 1);
   } else {
-    return sd_bus_reply_method_return(msg, "xs", child, title);
+    return reply_run(msg, pid, child, title);
   }
 }
 
@@ -100,10 +221,27 @@ static const sd_bus_vtable service_vtable[] = {
   // Status() -> String name, String description
   SD_BUS_METHOD("Status", "", "ss", service_method_status,
                 SD_BUS_VTABLE_UNPRIVILEGED),
+  // Metrics() -> Array<Tuple<String name, String kind, Double value, UInt64 count,
+  //                          Array<Tuple<Double bound, UInt64 count>> buckets>>
+  SD_BUS_METHOD("Metrics", "", "a(ssdta(dt))", service_method_metrics,
+                SD_BUS_VTABLE_UNPRIVILEGED),
+  // GetStats() -> The daemon's own metrics, in the same format as Metrics.
+  SD_BUS_METHOD("GetStats", "", "a(ssdta(dt))", service_method_get_stats,
+                SD_BUS_VTABLE_UNPRIVILEGED),
+  // GetRunTimeout() -> UInt64 usec
+  // How long a Run may take: 0 for the default D-Bus timeout, or UINT64_MAX for no limit.
+  SD_BUS_METHOD("GetRunTimeout", "", "t", service_method_get_run_timeout,
+                SD_BUS_VTABLE_UNPRIVILEGED),
   // Run(Array<DictEntry<String>> env, Array<String> argv, String cwd,
   //     Tuple<Fd, Fd, Fd> ttys, Int64 uprocctl_pid) -> Int64 pid, String name
   SD_BUS_METHOD("Run", "a{ss}ass(hhh)x", "xs",
                 service_method_run, SD_BUS_VTABLE_UNPRIVILEGED),
+  // RunWithRequestId(Array<DictEntry<String>> env, Array<String> argv, String cwd,
+  //                  Tuple<Fd, Fd, Fd> ttys, Int64 uprocctl_pid, String request_id)
+  //     -> Int64 pid, String name, Int32 status
+  // A pid of 0 means the request was served in-process, and already exited with status.
+  SD_BUS_METHOD("RunWithRequestId", "a{ss}ass(hhh)xs", "xsi",
+                service_method_run, SD_BUS_VTABLE_UNPRIVILEGED),
   SD_BUS_VTABLE_END
 };
 
@@ -144,8 +282,19 @@ bus_data * bus_new() {
   return NULL;
 }
 
+sd_bus * bus_get(bus_data *data) {
+  return data->bus;
+}
+
+int bus_release_name(bus_data *data) {
+  return sd_bus_release_name(data->bus, data->service);
+}
+
 int bus_pump(bus_data *data) {
   int rc;
+  // Answers from cgrmvd are picked up even while the bus stays busy, since children
+  // are waiting on them.
+  cgroup_moves_process();
   rc = sd_bus_process(data->bus, NULL);
   if (rc < 0) {
     FAIL("sd_bus_process failed: %s", strerror(-rc));
@@ -154,9 +303,20 @@ int bus_pump(bus_data *data) {
     return 1;
   }
 
-  rc = sd_bus_wait(data->bus, (uint64_t)-1);
-  if (rc < 0 && rc != -EINTR) {
-    FAIL("sd_bus_wait failed: %s", strerror(-rc));
+  // Like sd_bus_wait, but also wakes up for cgrmvd.
+  uint64_t until;
+  int timeout = -1;
+  if (sd_bus_get_timeout(data->bus, &until) >= 0 && until != (uint64_t)-1) {
+    uint64_t now = monotonic_usec();
+    timeout = until > now ? (until - now + 999) / 1000 : 0;
+  }
+
+  struct pollfd pfds[2] = {
+    { .fd = sd_bus_get_fd(data->bus), .events = sd_bus_get_events(data->bus) },
+  };
+  cgroup_moves_prepare(&pfds[1], &timeout);
+  if (poll(pfds, 2, timeout) == -1 && errno != EINTR) {
+    FAIL("poll failed: %s", strerror(errno));
     return -1;
   }
 
@@ -0,0 +1,79 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "private.h"
+#include "uprocd.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+// Records the shape of each Run request to the module's CaptureFile. Children inherit
+// the fd, but only the process answering Run writes to it, one record per write() so
+// appends from a restarted daemon never interleave.
+
+static int g_capture_fd = -1;
+static double g_capture_start;
+
+int capture_open(const char *path) {
+  g_capture_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (g_capture_fd == -1) {
+    FAIL("Error opening capture file %s: %s", path, strerror(errno));
+    return 0;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t start = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+  g_capture_start = stats_now();
+
+  sds header = capture_encode_header(sdsempty(), start);
+  int ok = write(g_capture_fd, header, sdslen(header)) == sdslen(header);
+  sdsfree(header);
+  if (!ok) {
+    FAIL("Error writing to capture file %s: %s", path, strerror(errno));
+    close(g_capture_fd);
+    g_capture_fd = -1;
+    return 0;
+  }
+
+  INFO("Capturing requests to %s.", path);
+  return 1;
+}
+
+void capture_request(uprocd_context *ctx) {
+  if (g_capture_fd == -1) {
+    return;
+  }
+
+  // argv[0] is the process title, which uprocd adds itself.
+  capture_record rec = {
+    .offset = (stats_now() - g_capture_start) * 1e6,
+    .argc = ctx->argc - 1,
+    .envc = ctx->envc,
+    .cwd_len = strlen(ctx->cwd),
+  };
+  rec.lens = newa(uint32_t, rec.argc + 2 * rec.envc + 1);
+
+  for (int i = 1; i < ctx->argc; i++) {
+    rec.lens[i - 1] = strlen(ctx->argv[i]);
+  }
+  for (int i = 0; i < 2 * ctx->envc; i++) {
+    rec.lens[rec.argc + i] = strlen(ctx->env[i]);
+  }
+
+  for (int i = 0; i < 3; i++) {
+    rec.fd_types[i] = capture_fd_type(ctx->fds[i]);
+  }
+
+  sds buf = capture_encode_record(sdsempty(), &rec);
+  if (write(g_capture_fd, buf, sdslen(buf)) != sdslen(buf)) {
+    FAIL("Error writing to capture file, no longer capturing: %s", strerror(errno));
+    close(g_capture_fd);
+    g_capture_fd = -1;
+  }
+
+  sdsfree(buf);
+  free(rec.lens);
+}
@@ -7,28 +7,42 @@
 
 #include <ctype.h>
 
+// Strips spaces and tabs from both ends of a line in place.
+static char * trim(char *line, size_t *len) {
+  while (*len && (line[*len - 1] == ' ' || line[*len - 1] == '\t')) {
+    line[--*len] = 0;
+  }
+  while (*line == ' ' || *line == '\t') {
+    line++;
+    --*len;
+  }
+  return line;
+}
+
 config *config_parse(const char *path) {
-  FILE *fp = fopen(path, "r");
-  if (fp == NULL) {
-    FAIL("Error opening config file: %s", strerror(errno));
+  line_reader lr;
+  int rc = line_reader_open(&lr, path);
+  if (rc < 0) {
+    FAIL("Error opening config file: %s", strerror(-rc));
     return NULL;
   }
 
   config *cfg = new(config);
-  sds line = NULL, cursect = NULL, key = NULL, value = NULL;
+  char *line, *key = NULL;
+  sds cursect = NULL, value = NULL;
+  size_t len;
 
-  int lineno = 0, rc = 0;
+  int lineno = 0;
 
   #define PARSE_ERROR(fmt, ...) do { \
     FAIL("Error parsing %s:%i: " fmt, path, lineno, ##__VA_ARGS__); \
     rc = 1; \
   } while (0)
 
-  while ((rc = readline(fp, &line)) == 0 && line != NULL) {
+  while ((line = line_reader_next(&lr, &len))) {
     lineno++;
-    sdstrim(line, "\t ");
+    line = trim(line, &len);
 
-    size_t len = sdslen(line);
     if (len == 0 || line[0] == '#') {
       goto parse_end;
     }
@@ -39,8 +53,10 @@ config *config_parse(const char *path) {
         goto parse_end;
       }
 
-      sdsrange(line, 1, -2);
-      cursect = sdsdup(line);
+      if (cursect) {
+        sdsfree(cursect);
+      }
+      cursect = sdsnewlen(line + 1, len - 2);
 
       int isnative = strcmp(cursect, "NativeModule") == 0,
           isderived = strcmp(cursect, "DerivedModule") == 0;
@@ -69,27 +85,24 @@ config *config_parse(const char *path) {
         goto parse_end;
       }
 
-      key = sdsdup(line), value = sdsdup(line);
-      sdsrange(key, 0, eq - line - 1);
-      sdsrange(value, eq - line + 1, -1);
+      // The key is only compared and copied, so it can stay in the buffer.
+      *eq = 0;
+      key = line;
+      value = sdsnewlen(eq + 1, len - (eq - line) - 1);
 
       int indent = -1;
       for (;;) {
-        char peek = fgetc(fp);
-        if (peek == '\n') {
+        // Blank lines don't end a value, but aren't part of it either.
+        if (lr.pos < lr.len && lr.data[lr.pos] == '\n') {
+          lr.pos++;
           continue;
         }
-
-        ungetc(peek, fp);
-        if (peek != ' ') {
+        if (lr.pos >= lr.len || lr.data[lr.pos] != ' ') {
           break;
         }
 
-        sds nextline;
-        rc = readline(fp, &nextline);
-        if (rc != 0) {
-          break;
-        }
+        size_t nextlen;
+        char *nextline = line_reader_next(&lr, &nextlen);
 
         int current_indent = 0;
         while (isspace(nextline[current_indent])) {
@@ -100,12 +113,12 @@ config *config_parse(const char *path) {
         }
 
         int min_indent = current_indent < indent ? current_indent : indent;
-        sdsrange(nextline, min_indent, -1);
-        value = sdscatfmt(value, "\n%S", nextline);
+        value = sdscatlen(value, "\n", 1);
+        value = sdscatlen(value, nextline + min_indent, nextlen - min_indent);
       }
 
       if (!cfg->kind) {
-        PARSE_ERROR("Key '%S' outside section", key);
+        PARSE_ERROR("Key '%s' outside section", key);
         goto parse_end;
       }
 
@@ -117,6 +130,41 @@ config *config_parse(const char *path) {
         } else if (strcmp(key, "Description") == 0) {
           cfg->description = sdsdup(value);
           goto parse_end;
+        } else if (strcmp(key, "KeyBy") == 0) {
+          cfg->key_by = sdsdup(value);
+          goto parse_end;
+        } else if (strcmp(key, "ColdExec") == 0) {
+          cfg->cold_exec = sdsdup(value);
+          goto parse_end;
+        } else if (strcmp(key, "StatsTextfile") == 0) {
+          cfg->stats_textfile = sdsdup(value);
+          goto parse_end;
+        } else if (strcmp(key, "CaptureFile") == 0) {
+          cfg->capture_file = sdsdup(value);
+          goto parse_end;
+        }
+
+        int *number = NULL;
+        if (strcmp(key, "KeyedTemplates") == 0) {
+          number = &cfg->keyed_templates;
+        } else if (strcmp(key, "KeyedMemoryBudget") == 0) {
+          number = &cfg->keyed_budget;
+        } else if (strcmp(key, "ServeWorkers") == 0) {
+          number = &cfg->serve_workers;
+        } else if (strcmp(key, "ServeMaxRequests") == 0) {
+          number = &cfg->serve_max_requests;
+        }
+
+        if (number) {
+          char *ep;
+          long parsed = strtol(value, &ep, 10);
+          if (*ep || parsed <= 0) {
+            PARSE_ERROR("%s must be a positive integer", key);
+            goto parse_end;
+          }
+
+          *number = parsed;
+          goto parse_end;
         }
 
         switch (cfg->kind) {
@@ -168,7 +216,7 @@ config *config_parse(const char *path) {
       } else if (strcmp(cursect, "Defaults") == 0) {
         user_type *type = table_get(&cfg->native.props, key);
         if (type == NULL) {
-          PARSE_ERROR("Unknown key: '%S'", key);
+          PARSE_ERROR("Unknown key: '%s'", key);
           goto parse_end;
         }
 
@@ -182,17 +230,12 @@ config *config_parse(const char *path) {
         goto parse_end;
       }
 
-      PARSE_ERROR("Invalid key '%S'", key);
+      PARSE_ERROR("Invalid key '%s'", key);
       goto parse_end;
     }
 
     parse_end:
-    sdsfree(line);
-    line = NULL;
-    if (key) {
-      sdsfree(key);
-      key = NULL;
-    }
+    key = NULL;
     if (value) {
       sdsfree(value);
       value = NULL;
@@ -202,10 +245,7 @@ config *config_parse(const char *path) {
     }
   }
 
-  fclose(fp);
-  if (line) {
-    sdsfree(line);
-  }
+  line_reader_free(&lr);
   if (cursect) {
     sdsfree(cursect);
   }
@@ -215,9 +255,6 @@ config *config_parse(const char *path) {
   }
 
   if (rc != 0) {
-    if (rc < 0) {
-      FAIL("Error reading %s: %s", path, strerror(-rc));
-    }
     config_free(cfg);
     return NULL;
   }
@@ -21,7 +21,7 @@ void user_type_free(user_type *type) {
   free(type);
 }
 
-user_value *user_value_parse(sds name, sds value, user_type *type) {
+user_value *user_value_parse(const char *name, sds value, user_type *type) {
   user_value *res = new(user_value);
   char *ep;
   sds *parts;
@@ -31,7 +31,7 @@ user_value *user_value_parse(sds name, sds value, user_type *type) {
   case TYPE_NUMBER:
     res->number = strtod(value, &ep);
     if (*ep) {
-      FAIL("Error parsing value of %S: Invalid number.", name);
+      FAIL("Error parsing value of %s: Invalid number.", name);
       free(res);
       return NULL;
     }
@@ -89,8 +89,20 @@ void config_free(config *cfg) {
   if (cfg->description) {
     sdsfree(cfg->description);
   }
+  if (cfg->key_by) {
+    sdsfree(cfg->key_by);
+  }
+  if (cfg->cold_exec) {
+    sdsfree(cfg->cold_exec);
+  }
+  if (cfg->stats_textfile) {
+    sdsfree(cfg->stats_textfile);
+  }
+  if (cfg->capture_file) {
+    sdsfree(cfg->capture_file);
+  }
 
-  char *arg = NULL;
+  table_cursor cursor = TABLE_CURSOR_INIT;
 
   switch (cfg->kind) {
   case CONFIG_NATIVE_MODULE:
@@ -99,14 +111,14 @@ void config_free(config *cfg) {
     }
 
     user_type *type;
-    while ((arg = table_next(&cfg->native.props, arg, (void**)&type))) {
+    while (table_iter(&cfg->native.props, &cursor, (void**)&type)) {
       user_type_free(type);
     }
     table_free(&cfg->native.props);
 
     user_value *usr;
-    arg = NULL;
-    while ((arg = table_next(&cfg->native.values, arg, (void**)&usr))) {
+    cursor = TABLE_CURSOR_INIT;
+    while (table_iter(&cfg->native.values, &cursor, (void**)&usr)) {
       user_value_free(usr);
     }
     table_free(&cfg->native.values);
@@ -117,7 +129,7 @@ void config_free(config *cfg) {
     }
 
     sds value;
-    while ((arg = table_next(&cfg->derived.value_strings, arg, (void**)&value))) {
+    while (table_iter(&cfg->derived.value_strings, &cursor, (void**)&value)) {
       sdsfree(value);
     }
     table_free(&cfg->derived.value_strings);
@@ -0,0 +1,736 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "private.h"
+#include "uprocd.h"
+
+#include <systemd/sd-bus.h>
+
+#include <sys/socket.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+// Keyed templates. When a module sets KeyBy=, the uprocd process never runs the module
+// itself. Instead it acts as a router: every request is fingerprinted, and routed to a
+// sub-template that was forked from the router and warmed up under the environment and
+// working directory of the first request with that fingerprint. Sub-templates talk to
+// the router over a socketpair, and are kept in an LRU bounded by KeyedTemplates= and
+// KeyedMemoryBudget=. The router never waits on a template: requests for one that is
+// still warming up are queued until it is ready, and forwarded requests are answered as
+// the template's replies come in.
+
+// How often templates are checked against the limits, since they grow after spawning.
+#define LIMITS_CHECK_INTERVAL 5.0
+
+// A request waiting for its template to warm up, or for the template's reply.
+typedef struct keyed_pending {
+  sd_bus_message *msg;
+  uprocd_context *ctx;
+  request_trace trace;
+  struct keyed_pending *next;
+} keyed_pending;
+
+typedef struct keyed_template {
+  sds fingerprint;
+  pid_t pid;
+  int fd, ready;
+  uint64_t last_used;
+  // Queued oldest first, and failed if the template isn't ready by the deadline.
+  keyed_pending *pending;
+  double deadline;
+  // Forwarded requests, oldest first, which is the order the template replies in.
+  keyed_pending *sent;
+} keyed_template;
+
+static keyed_template *g_templates = NULL;
+static int g_ntemplates = 0;
+static uint64_t g_clock = 0;
+static double g_next_limits_check = 0;
+
+static bus_data *g_router_bus = NULL;
+
+// What a newly forked sub-template needs once it has unwound back to keyed_serve.
+static struct {
+  jmp_buf jmp;
+  int fd;
+  // The first request, whose environment and cwd the sub-template takes on.
+  uprocd_context *ctx;
+} g_spawn;
+
+// Larger payloads are treated as a broken connection, rather than allocated.
+#define KEYED_MAX_PAYLOAD (64 * 1024 * 1024)
+
+// Requests are sent as this header, with the caller's stdio attached, followed by
+// size bytes of NUL-terminated strings: argc arguments, envc key/value pairs and the
+// cwd. Replies are a single int64_t: 0 once the sub-template is ready, then a child
+// pid or negative errno value for each request.
+typedef struct keyed_request_header {
+  int64_t pid;
+  uint32_t argc, envc, size;
+  char request_id[REQUEST_ID_SIZE];
+} keyed_request_header;
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t sz = send(fd, buf, len, MSG_NOSIGNAL);
+    if (sz == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    buf += sz;
+    len -= sz;
+  }
+  return 0;
+}
+
+static int read_all(int fd, char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t sz = read(fd, buf, len);
+    if (sz == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    } else if (sz == 0) {
+      return -EPIPE;
+    }
+    buf += sz;
+    len -= sz;
+  }
+  return 0;
+}
+
+static uint64_t fnv1a(uint64_t hash, const char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Hashes the marker file closest to cwd, along with the directory it was found in.
+static uint64_t hash_marker(uint64_t hash, const char *marker, const char *cwd) {
+  sds dir = sdsnew(cwd);
+
+  for (;;) {
+    sds path = sdscatfmt(sdsdup(dir), "/%s", marker);
+    FILE *fp = fopen(path, "r");
+    sdsfree(path);
+
+    if (fp != NULL) {
+      hash = fnv1a(hash, dir, sdslen(dir) + 1);
+
+      char buf[4096];
+      size_t sz;
+      while ((sz = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        hash = fnv1a(hash, buf, sz);
+      }
+      fclose(fp);
+      break;
+    }
+
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL || sdslen(dir) <= 1) {
+      break;
+    }
+    sdsrange(dir, 0, slash == dir ? 0 : slash - dir - 1);
+  }
+
+  sdsfree(dir);
+  return hash;
+}
+
+// Like getenv, so the last of any duplicates wins.
+static const char * context_getenv(uprocd_context *ctx, const char *name) {
+  for (int i = ctx->envc - 1; i >= 0; i--) {
+    if (strcmp(ctx->env[i * 2], name) == 0) {
+      return ctx->env[i * 2 + 1];
+    }
+  }
+  return NULL;
+}
+
+static sds compute_fingerprint(uprocd_context *ctx) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  int nparts;
+  sds *parts = sdssplitlen(global_run_data.key_by, sdslen(global_run_data.key_by), " ",
+                           1, &nparts);
+
+  for (int i = 0; i < nparts; i++) {
+    if (sdslen(parts[i]) == 0) {
+      continue;
+    }
+
+    hash = fnv1a(hash, parts[i], sdslen(parts[i]) + 1);
+    if (strncmp(parts[i], "env:", 4) == 0) {
+      const char *value = context_getenv(ctx, parts[i] + 4);
+      if (value) {
+        hash = fnv1a(hash, value, strlen(value) + 1);
+      }
+    } else if (strncmp(parts[i], "file:", 5) == 0) {
+      hash = hash_marker(hash, parts[i] + 5, ctx->cwd);
+    } else {
+      FAIL("WARNING: Ignoring invalid KeyBy entry %S.", parts[i]);
+    }
+  }
+
+  sdsfreesplitres(parts, nparts);
+  return sdscatprintf(sdsempty(), "%016" PRIx64, hash);
+}
+
+static uint64_t template_memory(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+
+  line_reader lr;
+  if (line_reader_open(&lr, path) < 0) {
+    return 0;
+  }
+
+  uint64_t pss_kb = 0;
+  char *line;
+  while ((line = line_reader_next(&lr, NULL))) {
+    if (strncmp(line, "Pss:", 4) == 0) {
+      pss_kb = strtoull(line + 4, NULL, 10);
+    }
+  }
+
+  line_reader_free(&lr);
+  return pss_kb * 1024;
+}
+
+// The router's borrowed fds belong to the message, so only the arena is freed.
+static void release_context(uprocd_context *ctx) {
+  for (int i = 0; i < 3; i++) {
+    ctx->fds[i] = -1;
+  }
+  uprocd_context_free(ctx);
+}
+
+static void queue_push(keyed_pending **queue, keyed_pending *p) {
+  while (*queue) {
+    queue = &(*queue)->next;
+  }
+  p->next = NULL;
+  *queue = p;
+}
+
+static keyed_pending * queue_pop(keyed_pending **queue) {
+  keyed_pending *p = *queue;
+  if (p) {
+    *queue = p->next;
+  }
+  return p;
+}
+
+// Replies to a queued request, which is then freed. The current request's trace is
+// swapped out in the meantime, since replying finishes the trace of the queued one.
+static void finish_pending(keyed_pending *p, int64_t child) {
+  request_trace saved = global_run_data.request;
+  global_run_data.request = p->trace;
+
+  int rc = bus_reply_keyed(p->msg, child);
+  if (rc < 0) {
+    FAIL("WARNING: Replying to a queued request failed: %s", strerror(-rc));
+  }
+
+  global_run_data.request = saved;
+  sd_bus_message_unref(p->msg);
+  if (p->ctx) {
+    release_context(p->ctx);
+  }
+  free(p);
+}
+
+static void fail_queue(keyed_pending **queue, int64_t err) {
+  keyed_pending *p;
+  while ((p = queue_pop(queue))) {
+    finish_pending(p, err);
+  }
+}
+
+// Stops a template, answering every request still waiting on it with err.
+static void remove_template(int index, int64_t err) {
+  keyed_template *t = &g_templates[index];
+  INFO("Removing keyed template %S (pid %i).", t->fingerprint, (int)t->pid);
+  fail_queue(&t->pending, err);
+  fail_queue(&t->sent, err);
+
+  kill(t->pid, SIGTERM);
+  close(t->fd);
+  sdsfree(t->fingerprint);
+
+  g_ntemplates--;
+  memmove(t, t + 1, (g_ntemplates - index) * sizeof(keyed_template));
+}
+
+static void template_died(int index, int err) {
+  keyed_template *t = &g_templates[index];
+  if (t->ready) {
+    FAIL("Keyed template %S exited unexpectedly: %s", t->fingerprint, strerror(-err));
+  } else {
+    FAIL("Keyed template %S failed to warm up: %s", t->fingerprint, strerror(-err));
+  }
+  remove_template(index, global_run_data.cold_exec ? 0 : err);
+}
+
+// Templates still forking children for forwarded requests are never evicted, since the
+// children may already be running. Returns -1 if every template is busy.
+static int least_recently_used() {
+  int lru = -1;
+  for (int i = 0; i < g_ntemplates; i++) {
+    if (g_templates[i].sent == NULL &&
+        (lru == -1 || g_templates[i].last_used < g_templates[lru].last_used)) {
+      lru = i;
+    }
+  }
+  return lru;
+}
+
+// Evicts templates until there's room for extra more under KeyedTemplates=, and all of
+// them fit in KeyedMemoryBudget=.
+static void enforce_limits(int extra) {
+  int lru;
+  while (g_ntemplates + extra > global_run_data.keyed_templates &&
+         (lru = least_recently_used()) != -1) {
+    remove_template(lru, -ECANCELED);
+  }
+
+  uint64_t budget = (uint64_t)global_run_data.keyed_budget * 1024 * 1024;
+  for (;;) {
+    uint64_t total = 0;
+    for (int i = 0; i < g_ntemplates; i++) {
+      total += template_memory(g_templates[i].pid);
+    }
+
+    if (total <= budget || (lru = least_recently_used()) == -1) {
+      break;
+    }
+    remove_template(lru, -ECANCELED);
+  }
+
+  g_next_limits_check = stats_now() + LIMITS_CHECK_INTERVAL;
+}
+
+static keyed_template * spawn_template(sds fingerprint, uprocd_context *ctx) {
+  enforce_limits(1);
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+    FAIL("Error creating keyed template socket: %s", strerror(errno));
+    return NULL;
+  }
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    FAIL("fork failed: %s", strerror(errno));
+    close(sv[0]);
+    close(sv[1]);
+    return NULL;
+  } else if (pid == 0) {
+    // The first caller's stdio must not stay open for as long as the template lives.
+    for (int i = 0; i < 3; i++) {
+      close(ctx->fds[i]);
+      ctx->fds[i] = -1;
+    }
+    close(sv[0]);
+    g_spawn.fd = sv[1];
+    g_spawn.ctx = ctx;
+    longjmp(g_spawn.jmp, 1);
+  }
+
+  close(sv[1]);
+  uprocd_metric_counter_add(g_stats.children_started, 1);
+  INFO("Warming keyed template %S (pid %i).", fingerprint, (int)pid);
+
+  g_templates = ralloc(g_templates, (g_ntemplates + 1) * sizeof(keyed_template));
+  keyed_template *t = &g_templates[g_ntemplates++];
+  t->fingerprint = sdsdup(fingerprint);
+  t->pid = pid;
+  t->fd = sv[0];
+  t->ready = 0;
+  t->pending = NULL;
+  t->deadline = 0;
+  t->sent = NULL;
+  return t;
+}
+
+static int forward_request(keyed_template *t, uprocd_context *ctx,
+                           const char *request_id) {
+  keyed_request_header header = { .pid = ctx->pid, .argc = ctx->argc,
+                                  .envc = ctx->envc };
+  memcpy(header.request_id, request_id, sizeof(header.request_id));
+  sds payload = sdsempty();
+
+  for (int i = 0; i < ctx->argc; i++) {
+    payload = sdscatlen(payload, ctx->argv[i], strlen(ctx->argv[i]) + 1);
+  }
+  for (int i = 0; i < ctx->envc * 2; i++) {
+    payload = sdscatlen(payload, ctx->env[i], strlen(ctx->env[i]) + 1);
+  }
+
+  payload = sdscatlen(payload, ctx->cwd, strlen(ctx->cwd) + 1);
+  header.size = sdslen(payload);
+
+  int rc = send_fds(t->fd, &header, sizeof(header), ctx->fds, 3);
+  if (rc >= 0) {
+    rc = write_all(t->fd, payload, sdslen(payload));
+  }
+  sdsfree(payload);
+  return rc < 0 ? rc : 0;
+}
+
+// Forwards a request to a ready template, without waiting for the reply, which
+// keyed_pump picks up. Returns -1 if the template turned out to be dead and was removed.
+static int send_pending(int index, keyed_pending *p) {
+  keyed_template *t = &g_templates[index];
+  int rc = forward_request(t, p->ctx, p->trace.id);
+  // The caller's stdio went along with the request, so the context is done with.
+  release_context(p->ctx);
+  p->ctx = NULL;
+
+  // Queued even if sending failed, so it's answered along with everything else sent.
+  queue_push(&t->sent, p);
+  if (rc < 0) {
+    template_died(index, rc);
+    return -1;
+  }
+  return 0;
+}
+
+int keyed_dispatch(sd_bus_message *msg, uprocd_context *ctx) {
+  sds fingerprint = compute_fingerprint(ctx);
+
+  keyed_template *t = NULL;
+  for (int i = 0; i < g_ntemplates; i++) {
+    if (strcmp(g_templates[i].fingerprint, fingerprint) == 0) {
+      t = &g_templates[i];
+      break;
+    }
+  }
+
+  if (t == NULL) {
+    t = spawn_template(fingerprint, ctx);
+  }
+  sdsfree(fingerprint);
+
+  if (t == NULL) {
+    release_context(ctx);
+    return bus_reply_keyed(msg, -EAGAIN);
+  }
+
+  t->last_used = ++g_clock;
+  if (!t->ready && global_run_data.cold_exec) {
+    release_context(ctx);
+    return bus_reply_keyed(msg, 0);
+  }
+
+  // Everything else is answered from keyed_pump, once the template replies.
+  keyed_pending *p = new(keyed_pending);
+  p->msg = sd_bus_message_ref(msg);
+  p->ctx = ctx;
+  p->trace = global_run_data.request;
+  memset(&global_run_data.request, 0, sizeof(global_run_data.request));
+
+  if (t->ready) {
+    send_pending(t - g_templates, p);
+  } else {
+    // Without a ColdExec= fallback, requests for this key wait for warmup.
+    if (t->pending == NULL) {
+      t->deadline = stats_now() + KEYED_WARMUP_TIMEOUT;
+    }
+    queue_push(&t->pending, p);
+  }
+
+  return 1;
+}
+
+// Reads the next thing a template sent: that it's ready, in which case the requests
+// waiting on it are forwarded, or the reply to its oldest forwarded request.
+static void read_template(int index) {
+  keyed_template *t = &g_templates[index];
+  int64_t reply;
+  int rc = read_all(t->fd, (char*)&reply, sizeof(reply));
+  if (rc < 0) {
+    template_died(index, rc);
+    return;
+  }
+
+  if (!t->ready) {
+    t->ready = 1;
+    keyed_pending *p;
+    while ((p = queue_pop(&t->pending))) {
+      if (send_pending(index, p) < 0) {
+        break;
+      }
+    }
+    return;
+  }
+
+  keyed_pending *p = queue_pop(&t->sent);
+  if (p == NULL) {
+    FAIL("WARNING: Keyed template %S sent a reply nobody was waiting on.",
+         t->fingerprint);
+    return;
+  }
+
+  // The template replies with the child's pid or a negative errno value, never 0.
+  finish_pending(p, reply == 0 ? -EPROTO : reply);
+}
+
+// Like bus_pump, but also wakes up for replies from templates, warmup deadlines and
+// the periodic limits check.
+static int keyed_pump(sd_bus *bus) {
+  int rc;
+  do {
+    rc = sd_bus_process(bus, NULL);
+  } while (rc > 0);
+  if (rc < 0) {
+    FAIL("sd_bus_process failed: %s", strerror(-rc));
+    return -1;
+  }
+
+  // sd-bus timeouts are on CLOCK_MONOTONIC, like stats_now.
+  double now = stats_now(), wake = g_next_limits_check;
+  uint64_t until;
+  if (sd_bus_get_timeout(bus, &until) >= 0 && until != (uint64_t)-1 &&
+      until / 1e6 < wake) {
+    wake = until / 1e6;
+  }
+
+  // Every template is watched, so one that exits while idle is noticed right away.
+  struct pollfd *pfds = newa(struct pollfd, g_ntemplates + 1);
+  pfds[0].fd = sd_bus_get_fd(bus);
+  pfds[0].events = sd_bus_get_events(bus);
+  for (int i = 0; i < g_ntemplates; i++) {
+    keyed_template *t = &g_templates[i];
+    pfds[i + 1].fd = t->fd;
+    pfds[i + 1].events = POLLIN;
+    pfds[i + 1].revents = 0;
+    if (t->pending && t->deadline < wake) {
+      wake = t->deadline;
+    }
+  }
+
+  int timeout = wake > now ? (int)((wake - now) * 1000) + 1 : 0;
+  int ntemplates = g_ntemplates;
+  if (poll(pfds, ntemplates + 1, timeout) == -1 && errno != EINTR) {
+    FAIL("poll failed: %s", strerror(errno));
+    free(pfds);
+    return -1;
+  }
+
+  // Walk backwards, since a dead template is removed from the array.
+  now = stats_now();
+  for (int i = ntemplates - 1; i >= 0; i--) {
+    if (i >= g_ntemplates) {
+      continue;
+    }
+
+    keyed_template *t = &g_templates[i];
+    if (pfds[i + 1].revents) {
+      read_template(i);
+    } else if (t->pending && now >= t->deadline) {
+      FAIL("Keyed template %S is taking too long to warm up.", t->fingerprint);
+      fail_queue(&t->pending, -ETIMEDOUT);
+    }
+  }
+
+  // Templates keep growing after they're spawned, so the budget is checked again from
+  // time to time, not just when making room for a new one.
+  if (now >= g_next_limits_check) {
+    enforce_limits(0);
+  }
+
+  free(pfds);
+  stats_flush();
+  return 0;
+}
+
+static void enter_spawned_template() {
+  for (int i = 0; i < g_ntemplates; i++) {
+    // Dropping the messages closes the stdio of whoever is waiting on other templates.
+    keyed_pending *queues[] = { g_templates[i].pending, g_templates[i].sent };
+    for (int j = 0; j < 2; j++) {
+      while (queues[j]) {
+        keyed_pending *p = queues[j];
+        queues[j] = p->next;
+        sd_bus_message_unref(p->msg);
+        if (p->ctx) {
+          release_context(p->ctx);
+        }
+        free(p);
+      }
+    }
+    close(g_templates[i].fd);
+    sdsfree(g_templates[i].fingerprint);
+  }
+  free(g_templates);
+  g_templates = NULL;
+  g_ntemplates = 0;
+
+  bus_free(g_router_bus);
+  g_router_bus = NULL;
+
+  uprocd_context *ctx = g_spawn.ctx;
+  clearenv();
+  for (char **p = ctx->env; *p; p += 2) {
+    setenv(p[0], p[1], 1);
+  }
+
+  if (chdir(ctx->cwd) == -1) {
+    FAIL("WARNING: chdir into %s failed: %s", ctx->cwd, strerror(errno));
+  }
+  uprocd_context_free(ctx);
+  g_spawn.ctx = NULL;
+
+  global_run_data.router_fd = g_spawn.fd;
+}
+
+int keyed_serve(int (*entry)()) {
+  if (setjmp(g_spawn.jmp) != 0) {
+    enter_spawned_template();
+    return entry();
+  }
+
+  INFO("Routing requests by %S.", global_run_data.key_by);
+  g_router_bus = bus_new();
+  if (g_router_bus == NULL) {
+    return 1;
+  }
+
+  stats_flush();
+  while (keyed_pump(bus_get(g_router_bus)) >= 0);
+
+  while (g_ntemplates) {
+    remove_template(0, -ECANCELED);
+  }
+  bus_free(g_router_bus);
+  return 1;
+}
+
+// Takes the next string from a request's payload, or returns NULL if it runs past end.
+static char * payload_string(char **p, char *end) {
+  char *s = *p;
+  char *nul = s < end ? memchr(s, '\0', end - s) : NULL;
+  if (nul == NULL) {
+    return NULL;
+  }
+  *p = nul + 1;
+  return s;
+}
+
+int keyed_template_serve() {
+  int fd = global_run_data.router_fd, rc;
+
+  int64_t reply = 0;
+  rc = write_all(fd, (char*)&reply, sizeof(reply));
+
+  while (rc >= 0) {
+    keyed_request_header header;
+    int fds[3], nfds = 3;
+
+    // Answers from cgrmvd for earlier children are handled while waiting.
+    struct pollfd pfds[2] = { { .fd = fd, .events = POLLIN } };
+    int timeout = -1;
+    cgroup_moves_prepare(&pfds[1], &timeout);
+    if (poll(pfds, 2, timeout) == -1 && errno != EINTR) {
+      return -errno;
+    }
+    cgroup_moves_process();
+    if (pfds[0].revents == 0) {
+      continue;
+    }
+
+    ssize_t sz = recv_fds(fd, &header, sizeof(header), fds, &nfds);
+    if (sz <= 0) {
+      // The router exited, so this template is no longer reachable.
+      return sz == 0 ? -EPIPE : sz;
+    }
+
+    // The payload is read straight into the new context's arena, and its strings used
+    // where they are.
+    uprocd_context *ctx = context_new();
+    memcpy(ctx->fds, fds, sizeof(fds));
+    for (int i = nfds; i < 3; i++) {
+      ctx->fds[i] = -1;
+    }
+
+    char *payload = NULL;
+    rc = read_all(fd, (char*)&header + sz, sizeof(header) - sz);
+    if (rc == 0 && nfds == 3 && header.size <= KEYED_MAX_PAYLOAD) {
+      payload = arena_alloc(&ctx->arena, header.size + 1);
+      rc = read_all(fd, payload, header.size);
+    } else if (rc == 0) {
+      rc = -EINVAL;
+    }
+
+    if (rc < 0) {
+      uprocd_context_free(ctx);
+      return rc;
+    }
+
+    // Every string has to end within the payload, or the request is turned away.
+    char *p = payload, *end = payload + header.size, *arg, *name, *value;
+    int valid = 1;
+    for (int i = 0; valid && i < header.argc; i++) {
+      valid = (arg = payload_string(&p, end)) != NULL;
+      if (valid) {
+        context_add_arg(ctx, arg);
+      }
+    }
+
+    for (int i = 0; valid && i < header.envc; i++) {
+      valid = (name = payload_string(&p, end)) != NULL &&
+              (value = payload_string(&p, end)) != NULL;
+      if (valid) {
+        context_add_env(ctx, name, value);
+      }
+    }
+
+    if (valid) {
+      valid = (ctx->cwd = payload_string(&p, end)) != NULL;
+    }
+    if (!valid) {
+      FAIL("WARNING: Rejecting a malformed request from the router.");
+      uprocd_context_free(ctx);
+      reply = -EINVAL;
+      rc = write_all(fd, (char*)&reply, sizeof(reply));
+      continue;
+    }
+
+    ctx->pid = header.pid;
+
+    // The router already counted the request and its spawn latency, so leave start
+    // unset and only record the stages that happen here.
+    request_trace *req = &global_run_data.request;
+    memset(req, 0, sizeof(*req));
+    memcpy(req->id, header.request_id, sizeof(req->id));
+    req->id[sizeof(req->id) - 1] = '\0';
+    req->pid = header.pid;
+
+    int child = prepare_context_and_fork(ctx);
+    if (child == 0) {
+      close(fd);
+      global_run_data.router_fd = -1;
+      longjmp(global_run_data.return_to_loop, 1);
+    } else if (child > 0) {
+      stats_finish_request(child);
+    } else {
+      memset(req, 0, sizeof(*req));
+    }
+
+    uprocd_context_free(ctx);
+    global_run_data.upcoming_context = NULL;
+
+    reply = child;
+    rc = write_all(fd, (char*)&reply, sizeof(reply));
+  }
+
+  return rc;
+}
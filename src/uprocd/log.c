@@ -0,0 +1,47 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "private.h"
+
+#include <systemd/sd-daemon.h>
+
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+
+// Where messages go when stderr isn't the journal. While a single serve worker has fd 2
+// pointed at a caller's terminal, this is a copy of the daemon's own stderr instead.
+static FILE *g_log_stream = NULL;
+
+void log_save_stderr() {
+  int fd = fcntl(2, F_DUPFD_CLOEXEC, 3);
+  if (fd == -1 || (g_log_stream = fdopen(fd, "w")) == NULL) {
+    FAIL("WARNING: Error saving stderr, messages may reach callers: %s",
+         strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return;
+  }
+  setvbuf(g_log_stream, NULL, _IOLBF, 0);
+}
+
+void log_restore_stderr() {
+  if (g_log_stream) {
+    fclose(g_log_stream);
+    g_log_stream = NULL;
+  }
+}
+
+void log_fields(int priority, sds message, sds *fields, int nfields) {
+  log_with_fields("uprocd", g_log_stream ? g_log_stream : stderr, global_run_data.module,
+                  global_run_data.request.id, priority, message, fields, nfields);
+}
+
+void _message(int failure, sds error) {
+  if (failure) {
+    sd_notifyf(0, "STATUS=\"Failure: %s\"", error);
+  }
+  log_fields(failure ? LOG_CRIT : LOG_INFO, error, NULL, 0);
+}
@@ -7,21 +7,11 @@
 
 #include "uprocd.h"
 
-#include <systemd/sd-daemon.h>
-
 #include <sys/wait.h>
 #include <dlfcn.h>
 #include <signal.h>
 #include <unistd.h>
 
-void _message(int failure, sds error) {
-  fprintf(stderr, "%s%.*s\n", failure ? SD_CRIT : SD_INFO, (int)sdslen(error), error);
-  if (failure) {
-    sd_notifyf(0, "STATUS=\"Failure: %s\"", error);
-  }
-  sdsfree(error);
-}
-
 sds get_xdg_config_home() {
   char *xdg_config_home = getenv("XDG_CONFIG_HOME");
   if (xdg_config_home != NULL) {
@@ -111,9 +101,10 @@ config *resolve_derived_config(config *cfg, sds *module_dir) {
     return NULL;
   }
 
-  char *key = NULL;
+  table_cursor cursor = TABLE_CURSOR_INIT;
+  const char *key;
   user_type *type;
-  while ((key = table_next(&base->native.props, key, (void**)&type))) {
+  while ((key = table_iter(&base->native.props, &cursor, (void**)&type))) {
     sds value = table_get(&cfg->derived.value_strings, key);
     if (value == NULL) {
       if (table_get(&base->native.values, key) == NULL) {
@@ -139,6 +130,40 @@ config *resolve_derived_config(config *cfg, sds *module_dir) {
 
   base->native.native_lib = sdsdup(cfg->derived.base);
 
+  // Daemon settings of the derived module win over those of its base.
+  if (cfg->key_by) {
+    sdsfree(base->key_by);
+    base->key_by = cfg->key_by;
+    cfg->key_by = NULL;
+  }
+  if (cfg->cold_exec) {
+    sdsfree(base->cold_exec);
+    base->cold_exec = cfg->cold_exec;
+    cfg->cold_exec = NULL;
+  }
+  if (cfg->stats_textfile) {
+    sdsfree(base->stats_textfile);
+    base->stats_textfile = cfg->stats_textfile;
+    cfg->stats_textfile = NULL;
+  }
+  if (cfg->capture_file) {
+    sdsfree(base->capture_file);
+    base->capture_file = cfg->capture_file;
+    cfg->capture_file = NULL;
+  }
+  if (cfg->keyed_templates) {
+    base->keyed_templates = cfg->keyed_templates;
+  }
+  if (cfg->keyed_budget) {
+    base->keyed_budget = cfg->keyed_budget;
+  }
+  if (cfg->serve_workers) {
+    base->serve_workers = cfg->serve_workers;
+  }
+  if (cfg->serve_max_requests) {
+    base->serve_max_requests = cfg->serve_max_requests;
+  }
+
   config_free(cfg);
   return base;
 }
@@ -190,7 +215,10 @@ void interrupt_main(int sig) {
 }
 
 void clear_child(int sig) {
-  waitpid(-1, NULL, WNOHANG);
+  // Signals coalesce, so one SIGCHLD may stand for several exited children.
+  while (waitpid(-1, NULL, WNOHANG) > 0) {
+    uprocd_metric_counter_add(g_stats.children_reaped, 1);
+  }
 }
 
 int main(int argc, char **argv) {
@@ -204,6 +232,9 @@ int main(int argc, char **argv) {
   char *module = argv[2];
   setproctitle("-uprocd@%s", module);
 
+  // Decide now, before any child points stderr at a caller's terminal.
+  stderr_is_journal();
+
   sds module_dir;
   config *cfg = load_config(module, &module_dir);
   if (cfg == NULL) {
@@ -217,6 +248,19 @@ int main(int argc, char **argv) {
     }
   }
 
+  // Set up before the module is loaded, so its constructors can already register
+  // metrics, and before anything forks.
+  if (!metrics_init()) {
+    config_free(cfg);
+    return 1;
+  }
+  stats_init();
+
+  // A trace is only a debugging aid, so carry on without one.
+  if (cfg->capture_file) {
+    capture_open(cfg->capture_file);
+  }
+
   dl_handle handle;
   if (!load_dl_handle(module, cfg, &handle)) {
     config_free(cfg);
@@ -227,9 +271,23 @@ int main(int argc, char **argv) {
   global_run_data.module_dir = module_dir;
   global_run_data.process_name = cfg->process_name ? sdsdup(cfg->process_name) : NULL;
   global_run_data.description = cfg->description ? sdsdup(cfg->description) : NULL;
+  global_run_data.key_by = cfg->key_by ? sdsdup(cfg->key_by) : NULL;
+  global_run_data.cold_exec = cfg->cold_exec ? sdsdup(cfg->cold_exec) : NULL;
+  global_run_data.stats_textfile = cfg->stats_textfile ? sdsdup(cfg->stats_textfile) :
+                                   NULL;
+  global_run_data.keyed_templates = cfg->keyed_templates ? cfg->keyed_templates : 4;
+  global_run_data.keyed_budget = cfg->keyed_budget ? cfg->keyed_budget : 1024;
+  global_run_data.router_fd = -1;
+  global_run_data.serve_workers = cfg->serve_workers ? cfg->serve_workers : 1;
+  global_run_data.serve_max_requests = cfg->serve_max_requests;
+  global_run_data.serving = 0;
+  global_run_data.draining = 0;
   config_move_out_values(cfg, &global_run_data.config);
   global_run_data.exit_handler = NULL;
   global_run_data.exit_handler_userdata = NULL;
+  global_run_data.before_fork = NULL;
+  global_run_data.after_fork_parent = NULL;
+  global_run_data.after_fork_child = NULL;
   global_run_data.upcoming_context = NULL;
   config_free(cfg);
 
@@ -238,11 +296,18 @@ int main(int argc, char **argv) {
     INFO("Entering uprocd_run...");
     signal(SIGINT, interrupt_main);
     signal(SIGCHLD, clear_child);
-    result = handle.entry();
+    if (global_run_data.key_by) {
+      result = keyed_serve(handle.entry);
+    } else {
+      result = handle.entry();
+    }
   }
 
   sdsfree(global_run_data.module_dir);
   sdsfree(global_run_data.process_name);
   sdsfree(global_run_data.description);
+  sdsfree(global_run_data.key_by);
+  sdsfree(global_run_data.cold_exec);
+  sdsfree(global_run_data.stats_textfile);
   return result;
 }
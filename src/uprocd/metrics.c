@@ -0,0 +1,373 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "private.h"
+#include "uprocd.h"
+
+#include <systemd/sd-bus.h>
+
+#include <sys/mman.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Metrics live in an anonymous shared mapping created before the module is loaded, so
+// forked children (and keyed templates) update the same values as the template without
+// any IPC. All updates are lock-free atomics; the lock only guards registration.
+
+#define METRICS_MAX 128
+#define METRIC_NAME_MAX 64
+
+// Bucket i counts observations <= 2^(i - HISTOGRAM_SHIFT); the last one is +Inf.
+#define HISTOGRAM_BUCKETS 48
+#define HISTOGRAM_SHIFT 16
+
+struct uprocd_metric {
+  char name[METRIC_NAME_MAX];
+  int kind, internal;
+  // Counter value, gauge bits, or histogram observation count.
+  uint64_t value;
+  // Histogram sum bits.
+  uint64_t sum;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+static struct {
+  // Robust, because a child may be killed while registering.
+  pthread_mutex_t lock;
+  int count;
+  struct uprocd_metric metrics[METRICS_MAX];
+} *g_metrics;
+
+static const char *kind_names[] = {
+  [METRIC_COUNTER] = "counter",
+  [METRIC_GAUGE] = "gauge",
+  [METRIC_HISTOGRAM] = "histogram",
+};
+
+int metrics_init() {
+  g_metrics = mmap(NULL, sizeof(*g_metrics), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (g_metrics == MAP_FAILED) {
+    g_metrics = NULL;
+    FAIL("Error mapping the metrics region: %s", strerror(errno));
+    return 0;
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  int rc = pthread_mutex_init(&g_metrics->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (rc != 0) {
+    FAIL("Error creating the metrics lock: %s", strerror(rc));
+    munmap(g_metrics, sizeof(*g_metrics));
+    g_metrics = NULL;
+    return 0;
+  }
+
+  return 1;
+}
+
+static uint64_t double_to_bits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static double bits_to_double(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static int is_name_valid(const char *name) {
+  // Names have to be usable as-is in the Prometheus text format.
+  if (*name == '\0' || strlen(name) >= METRIC_NAME_MAX || isdigit((unsigned char)*name)) {
+    return 0;
+  }
+
+  for (const char *p = name; *p; p++) {
+    if (!isalnum((unsigned char)*p) && *p != '_' && *p != ':') {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+uprocd_metric * metric_register(const char *name, int kind, int internal) {
+  if (g_metrics == NULL) {
+    return NULL;
+  }
+
+  if (!is_name_valid(name)) {
+    FAIL("WARNING: Invalid metric name %s.", name);
+    return NULL;
+  }
+
+  // A metric is only published once it's complete, so whatever a dead owner left
+  // behind past count is simply overwritten.
+  if (pthread_mutex_lock(&g_metrics->lock) == EOWNERDEAD) {
+    pthread_mutex_consistent(&g_metrics->lock);
+  }
+
+  // Registering a name again, e.g. from a child, returns the existing metric. Module
+  // and daemon metrics are exported under different names, so they never match.
+  uprocd_metric *metric = NULL;
+  for (int i = 0; i < g_metrics->count; i++) {
+    if (g_metrics->metrics[i].internal == internal &&
+        strcmp(g_metrics->metrics[i].name, name) == 0) {
+      metric = &g_metrics->metrics[i];
+      break;
+    }
+  }
+
+  if (metric && metric->kind != kind) {
+    FAIL("WARNING: Metric %s was already registered as a %s.", name,
+         kind_names[metric->kind]);
+    metric = NULL;
+  } else if (metric == NULL && g_metrics->count < METRICS_MAX) {
+    metric = &g_metrics->metrics[g_metrics->count];
+    strcpy(metric->name, name);
+    metric->kind = kind;
+    metric->internal = internal;
+    // Publish the metric only once it's complete, since readers don't take the lock.
+    __atomic_store_n(&g_metrics->count, g_metrics->count + 1, __ATOMIC_RELEASE);
+  } else if (metric == NULL) {
+    FAIL("WARNING: Too many metrics to register %s.", name);
+  }
+
+  pthread_mutex_unlock(&g_metrics->lock);
+  return metric;
+}
+
+UPROCD_EXPORT uprocd_metric * uprocd_metric_counter(const char *name) {
+  return metric_register(name, METRIC_COUNTER, 0);
+}
+
+UPROCD_EXPORT uprocd_metric * uprocd_metric_gauge(const char *name) {
+  return metric_register(name, METRIC_GAUGE, 0);
+}
+
+UPROCD_EXPORT uprocd_metric * uprocd_metric_histogram(const char *name) {
+  return metric_register(name, METRIC_HISTOGRAM, 0);
+}
+
+UPROCD_EXPORT void uprocd_metric_counter_add(uprocd_metric *metric,
+                                             unsigned long long value) {
+  if (metric && metric->kind == METRIC_COUNTER) {
+    __atomic_add_fetch(&metric->value, value, __ATOMIC_RELAXED);
+  }
+}
+
+UPROCD_EXPORT void uprocd_metric_gauge_set(uprocd_metric *metric, double value) {
+  if (metric && metric->kind == METRIC_GAUGE) {
+    __atomic_store_n(&metric->value, double_to_bits(value), __ATOMIC_RELAXED);
+  }
+}
+
+UPROCD_EXPORT void uprocd_metric_histogram_observe(uprocd_metric *metric,
+                                                   double value) {
+  if (metric == NULL || metric->kind != METRIC_HISTOGRAM || isnan(value)) {
+    return;
+  }
+
+  int bucket = 0;
+  double bound = ldexp(1, -HISTOGRAM_SHIFT);
+  while (value > bound && bucket < HISTOGRAM_BUCKETS - 1) {
+    bound *= 2;
+    bucket++;
+  }
+
+  __atomic_add_fetch(&metric->buckets[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&metric->value, 1, __ATOMIC_RELAXED);
+
+  uint64_t old = __atomic_load_n(&metric->sum, __ATOMIC_RELAXED), new;
+  do {
+    new = double_to_bits(bits_to_double(old) + value);
+  } while (!__atomic_compare_exchange_n(&metric->sum, &old, new, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+}
+
+static void metric_snapshot(uprocd_metric *metric, double *pvalue, uint64_t *pcount) {
+  switch (metric->kind) {
+  case METRIC_COUNTER:
+    *pcount = __atomic_load_n(&metric->value, __ATOMIC_RELAXED);
+    *pvalue = *pcount;
+    break;
+  case METRIC_GAUGE:
+    *pvalue = bits_to_double(__atomic_load_n(&metric->value, __ATOMIC_RELAXED));
+    *pcount = 0;
+    break;
+  default:
+    *pvalue = bits_to_double(__atomic_load_n(&metric->sum, __ATOMIC_RELAXED));
+    *pcount = __atomic_load_n(&metric->value, __ATOMIC_RELAXED);
+    break;
+  }
+}
+
+static double bucket_bound(int i) {
+  return i == HISTOGRAM_BUCKETS - 1 ? INFINITY : ldexp(1, i - HISTOGRAM_SHIFT);
+}
+
+static int append_metric(sd_bus_message *reply, uprocd_metric *metric) {
+  int rc;
+  double value;
+  uint64_t count;
+  metric_snapshot(metric, &value, &count);
+
+  rc = sd_bus_message_open_container(reply, 'r', "ssdta(dt)");
+  if (rc < 0) {
+    return rc;
+  }
+
+  rc = sd_bus_message_append(reply, "ssdt", metric->name, kind_names[metric->kind],
+                             value, count);
+  if (rc < 0) {
+    return rc;
+  }
+
+  rc = sd_bus_message_open_container(reply, 'a', "(dt)");
+  if (rc < 0) {
+    return rc;
+  }
+
+  if (metric->kind == METRIC_HISTOGRAM) {
+    // Cumulative counts, skipping the bounds that don't add anything.
+    uint64_t cumulative = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      uint64_t n = __atomic_load_n(&metric->buckets[i], __ATOMIC_RELAXED);
+      if (n == 0 && i != HISTOGRAM_BUCKETS - 1) {
+        continue;
+      }
+
+      cumulative += n;
+      rc = sd_bus_message_append(reply, "(dt)", bucket_bound(i), cumulative);
+      if (rc < 0) {
+        return rc;
+      }
+    }
+  }
+
+  rc = sd_bus_message_close_container(reply);
+  if (rc < 0) {
+    return rc;
+  }
+
+  return sd_bus_message_close_container(reply);
+}
+
+int metrics_reply(sd_bus_message *msg, int internal) {
+  sd_bus_message *reply = NULL;
+  int rc;
+
+  rc = sd_bus_message_new_method_return(msg, &reply);
+  if (rc < 0) {
+    goto end;
+  }
+
+  rc = sd_bus_message_open_container(reply, 'a', "(ssdta(dt))");
+  if (rc < 0) {
+    goto end;
+  }
+
+  int count = g_metrics ? __atomic_load_n(&g_metrics->count, __ATOMIC_ACQUIRE) : 0;
+  for (int i = 0; i < count; i++) {
+    uprocd_metric *metric = &g_metrics->metrics[i];
+    if (metric->internal != internal) {
+      continue;
+    }
+
+    rc = append_metric(reply, metric);
+    if (rc < 0) {
+      goto end;
+    }
+  }
+
+  rc = sd_bus_message_close_container(reply);
+  if (rc < 0) {
+    goto end;
+  }
+
+  rc = sd_bus_send(NULL, reply, NULL);
+
+  end:
+  if (rc < 0) {
+    FAIL("Error replying with metrics: %s", strerror(-rc));
+  }
+  if (reply) {
+    sd_bus_message_unref(reply);
+  }
+  return rc;
+}
+
+static void write_metric(FILE *fp, uprocd_metric *metric) {
+  // Module metrics are namespaced so they can't clash with the daemon's own.
+  const char *prefix = metric->internal ? "" : "uprocd_module_";
+  const char *module = global_run_data.module;
+
+  double value;
+  uint64_t count;
+  metric_snapshot(metric, &value, &count);
+
+  fprintf(fp, "# TYPE %s%s %s\n", prefix, metric->name, kind_names[metric->kind]);
+  if (metric->kind != METRIC_HISTOGRAM) {
+    fprintf(fp, "%s%s{module=\"%s\"} %.17g\n", prefix, metric->name, module, value);
+    return;
+  }
+
+  uint64_t cumulative = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    uint64_t n = __atomic_load_n(&metric->buckets[i], __ATOMIC_RELAXED);
+    if (n == 0 && i != HISTOGRAM_BUCKETS - 1) {
+      continue;
+    }
+
+    cumulative += n;
+    if (i == HISTOGRAM_BUCKETS - 1) {
+      fprintf(fp, "%s%s_bucket{module=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", prefix,
+              metric->name, module, cumulative);
+    } else {
+      fprintf(fp, "%s%s_bucket{module=\"%s\",le=\"%g\"} %" PRIu64 "\n", prefix,
+              metric->name, module, bucket_bound(i), cumulative);
+    }
+  }
+
+  fprintf(fp, "%s%s_sum{module=\"%s\"} %.17g\n", prefix, metric->name, module, value);
+  fprintf(fp, "%s%s_count{module=\"%s\"} %" PRIu64 "\n", prefix, metric->name, module,
+          count);
+}
+
+int metrics_write_textfile(const char *path) {
+  if (g_metrics == NULL) {
+    return 0;
+  }
+
+  // The collector may read the file at any time, so replace it atomically.
+  sds tmp = sdscatfmt(sdsempty(), "%s.%i.tmp", path, (int)getpid());
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    FAIL("Error opening %S: %s", tmp, strerror(errno));
+    sdsfree(tmp);
+    return -1;
+  }
+
+  int count = __atomic_load_n(&g_metrics->count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count; i++) {
+    write_metric(fp, &g_metrics->metrics[i]);
+  }
+
+  int rc = 0;
+  if (fclose(fp) != 0 || rename(tmp, path) == -1) {
+    FAIL("Error writing %s: %s", path, strerror(errno));
+    unlink(tmp);
+    rc = -1;
+  }
+
+  sdsfree(tmp);
+  return rc;
+}
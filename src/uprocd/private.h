@@ -15,6 +15,11 @@ void _message(int failure, sds error);
 #define INFO(...) _MESSAGE(0, __VA_ARGS__)
 #define FAIL(...) _MESSAGE(1, __VA_ARGS__)
 
+void log_fields(int priority, sds message, sds *fields, int nfields);
+// Sends messages to a copy of the current stderr, until log_restore_stderr.
+void log_save_stderr();
+void log_restore_stderr();
+
 typedef struct user_type {
   enum { TYPE_NONE, TYPE_LIST, TYPE_STRING, TYPE_NUMBER } kind;
   struct user_type *child;
@@ -35,12 +40,15 @@ typedef struct user_value {
   };
 } user_value;
 
-user_value *user_value_parse(sds name, sds value, user_type *type);
+user_value *user_value_parse(const char *name, sds value, user_type *type);
 void user_value_free(user_value *usr);
 
 typedef struct config {
   enum { CONFIG_NATIVE_MODULE = 1, CONFIG_DERIVED_MODULE } kind;
   sds path, process_name, description;
+  sds key_by, cold_exec, stats_textfile, capture_file;
+  int keyed_templates, keyed_budget;
+  int serve_workers, serve_max_requests;
   union {
     struct {
       sds native_lib;
@@ -57,20 +65,113 @@ config *config_parse(const char *path);
 void config_move_out_values(config *cfg, table *values);
 void config_free(config *cfg);
 
-int prepare_context_and_fork(int argc, char **argv, table *env, char *cwd, int *fds,
-                             pid_t pid);
+// A context is allocated in its own arena, along with everything it points to, so a
+// request is decoded without any per-string allocations and freed all at once. Forked
+// children inherit the whole arena.
+struct uprocd_context {
+  arena arena;
+  int argc, envc;
+  // Both NULL-terminated. env holds envc name/value pairs, in the order they were sent.
+  char **argv, **env;
+  char *cwd;
+  int fds[3], pid;
+  // Read by the child once the template has tried to move it to the caller's cgroups.
+  int moved_fd;
+  // Slots allocated for argv and env, which grow as the request is decoded.
+  int argv_cap, env_cap;
+};
+
+struct uprocd_context * context_new();
+// The strings must already live in the context's arena.
+void context_add_arg(struct uprocd_context *ctx, char *arg);
+void context_add_env(struct uprocd_context *ctx, char *name, char *value);
+// Takes ownership of ctx, which is freed with the next upcoming context.
+int prepare_context_and_fork(struct uprocd_context *ctx);
+// Loops that fork have to wait on cgrmvd's answers too: prepare fills in a pollfd, which
+// is ignored while no moves are pending, and lowers the timeout to the next deadline.
+struct pollfd;
+void cgroup_moves_prepare(struct pollfd *pfd, int *timeout);
+void cgroup_moves_process();
+struct sd_bus_message;
 typedef struct bus_data bus_data;
 bus_data * bus_new();
 int bus_pump(bus_data *data);
 void bus_free(bus_data *data);
+struct sd_bus * bus_get(bus_data *data);
+int bus_release_name(bus_data *data);
+// Replies to a Run request with the PID of a child spawned by a keyed template, a
+// negative errno value, or 0 to send the caller to ColdExec=.
+int bus_reply_keyed(struct sd_bus_message *msg, int64_t child);
+
+#define KEYED_COLD_EXEC_ERROR "com.refi64.uprocd.ColdExec"
+// How long requests may wait for a new keyed template to warm up, in seconds.
+#define KEYED_WARMUP_TIMEOUT 60.0
+int keyed_serve(int (*entry)());
+// Takes ownership of ctx, whose fds are borrowed from msg. The reply may be sent later,
+// once the request's template has warmed up.
+int keyed_dispatch(struct sd_bus_message *msg, struct uprocd_context *ctx);
+int keyed_template_serve();
+
+#define SERVE_DRAINING_ERROR "com.refi64.uprocd.Draining"
+#define SERVE_BUSY_ERROR "com.refi64.uprocd.Busy"
+// Takes ownership of ctx. Replies with SERVE_BUSY_ERROR if too many requests are
+// already waiting on the workers.
+int serve_enqueue(struct sd_bus_message *msg, struct uprocd_context *ctx);
+
+enum { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM };
+struct uprocd_metric;
+int metrics_init();
+struct uprocd_metric * metric_register(const char *name, int kind, int internal);
+int metrics_reply(struct sd_bus_message *msg, int internal);
+int metrics_write_textfile(const char *path);
+
+typedef struct daemon_stats {
+  struct uprocd_metric *requests, *parse_seconds, *fork_seconds,
+                       *fork_seconds_per_gib, *handshake_seconds, *cgroup_seconds,
+                       *spawn_seconds, *template_rss, *start_time;
+  // Keyed templates reap their own children, so live children are only known as the
+  // difference of these two.
+  struct uprocd_metric *children_started, *children_reaped;
+  struct uprocd_metric *parse_failures, *fork_failures, *cgroup_failures,
+                       *reply_failures;
+} daemon_stats;
+extern daemon_stats g_stats;
+
+void stats_init();
+double stats_now();
+double stats_stage(struct uprocd_metric *metric, double *stage, double start);
+double stats_sample_rss();
+void stats_flush();
+void stats_finish_request(int64_t child);
+
+int capture_open(const char *path);
+void capture_request(struct uprocd_context *ctx);
+
+// The request currently being spawned, which forked children inherit. Stage durations
+// are in seconds, and only logged if non-zero.
+typedef struct request_trace {
+  char id[REQUEST_ID_SIZE];
+  int64_t pid;
+  double start, parse, fork, handshake, cgroup;
+} request_trace;
 
 struct {
   char *module;
   sds module_dir;
   sds process_name, description;
+  sds key_by, cold_exec, stats_textfile;
+  int keyed_templates, keyed_budget;
+  int router_fd;
+  // draining is set once ServeMaxRequests is reached, while serving stays set until
+  // uprocd_serve returns.
+  int serve_workers, serve_max_requests, serving, draining;
+  request_trace request;
   table config;
   jmp_buf return_to_main, return_to_loop;
   void *exit_handler, *exit_handler_userdata;
+  void *before_fork, *before_fork_userdata;
+  void *after_fork_parent, *after_fork_parent_userdata;
+  void *after_fork_child, *after_fork_child_userdata;
   void *upcoming_context;
 } global_run_data;
 
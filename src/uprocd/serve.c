@@ -0,0 +1,333 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define _GNU_SOURCE
+
+#include "private.h"
+#include "probes.h"
+#include "uprocd.h"
+
+#include <systemd/sd-bus.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+// In-process serving. Requests are queued by the bus thread and handled by a pool of
+// ServeWorkers threads, which hand finished requests back over a pipe so that only the
+// bus thread ever touches sd-bus.
+
+// The most requests that may be queued or running at once. Kept below what a pipe
+// holds even when it's limited to a single page, so workers never block handing
+// requests back.
+#define SERVE_MAX_IN_FLIGHT 256
+
+typedef struct serve_job {
+  sd_bus_message *msg;
+  uprocd_context *ctx;
+  pid_t pid;
+  char request_id[REQUEST_ID_SIZE];
+  double seconds;
+  int status;
+  struct serve_job *next;
+} serve_job;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  serve_job *head, *tail;
+  int stopping;
+
+  uprocd_request_handler handler;
+  void *userdata;
+
+  int done[2];
+  int accepted, in_flight;
+} g_serve = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+int serve_enqueue(sd_bus_message *msg, uprocd_context *ctx) {
+  if (g_serve.in_flight >= SERVE_MAX_IN_FLIGHT) {
+    uprocd_context_free(ctx);
+    return sd_bus_reply_method_errorf(msg, SERVE_BUSY_ERROR,
+                                      "Too many requests are queued, try again.");
+  }
+
+  serve_job *job = new(serve_job);
+  job->msg = sd_bus_message_ref(msg);
+  job->ctx = ctx;
+  job->pid = ctx->pid;
+  memcpy(job->request_id, global_run_data.request.id, sizeof(job->request_id));
+
+  g_serve.accepted++;
+  g_serve.in_flight++;
+
+  pthread_mutex_lock(&g_serve.lock);
+  if (g_serve.tail) {
+    g_serve.tail->next = job;
+  } else {
+    g_serve.head = job;
+  }
+  g_serve.tail = job;
+  pthread_cond_signal(&g_serve.cond);
+  pthread_mutex_unlock(&g_serve.lock);
+
+  // The reply is sent once a worker is done with the request.
+  return 1;
+}
+
+// With a single worker, the process-wide stdio and working directory can be pointed at
+// the caller's for the duration of the request, so handlers can use them like a forked
+// child would. Only that worker ever swaps them, and uprocd's own messages go to a saved
+// copy of stderr meanwhile. Multiple workers have to use uprocd_context_get_fds instead.
+static int run_swapped(serve_job *job) {
+  int fds[3], saved[3];
+  uprocd_context_get_fds(job->ctx, fds);
+
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < 3; i++) {
+    saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+    dup2(fds[i], i);
+  }
+
+  int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (chdir(uprocd_context_get_cwd(job->ctx)) == -1) {
+    FAIL("WARNING: chdir into %s failed: %s", uprocd_context_get_cwd(job->ctx),
+         strerror(errno));
+  }
+
+  int status = g_serve.handler(job->ctx, g_serve.userdata);
+
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < 3; i++) {
+    dup2(saved[i], i);
+    close(saved[i]);
+  }
+
+  if (cwd != -1) {
+    if (fchdir(cwd) == -1) {
+      FAIL("WARNING: Restoring the working directory failed: %s", strerror(errno));
+    }
+    close(cwd);
+  }
+
+  return status;
+}
+
+static void * worker_main(void *unused) {
+  for (;;) {
+    pthread_mutex_lock(&g_serve.lock);
+    while (g_serve.head == NULL && !g_serve.stopping) {
+      pthread_cond_wait(&g_serve.cond, &g_serve.lock);
+    }
+
+    serve_job *job = g_serve.head;
+    if (job == NULL) {
+      pthread_mutex_unlock(&g_serve.lock);
+      return NULL;
+    }
+
+    g_serve.head = job->next;
+    if (g_serve.head == NULL) {
+      g_serve.tail = NULL;
+    }
+    pthread_mutex_unlock(&g_serve.lock);
+
+    PROBE(uprocd, serve__begin, job->pid);
+    double start = stats_now();
+    int status = global_run_data.serve_workers == 1 ? run_swapped(job) :
+                 g_serve.handler(job->ctx, g_serve.userdata);
+    PROBE(uprocd, serve__end, job->pid, status);
+    job->seconds = stats_now() - start;
+    // Match what the caller would see from exit(status).
+    job->status = status & 0xff;
+
+    // Pointer-sized pipe writes are atomic, so workers can share the pipe, and the
+    // in-flight limit means it never fills up.
+    while (write(g_serve.done[1], &job, sizeof(job)) == -1 && errno == EINTR);
+  }
+}
+
+static void finish_jobs() {
+  char *title = global_run_data.process_name ? global_run_data.process_name :
+                global_run_data.module;
+
+  serve_job *job;
+  ssize_t sz;
+  while ((sz = read(g_serve.done[0], &job, sizeof(job))) == sizeof(job)) {
+    int rc = sd_bus_reply_method_return(job->msg, "xsi", (int64_t)0, title,
+                                        job->status);
+    PROBE(uprocd, reply__sent, job->pid, 0);
+
+    // Only the bus thread logs, so the request can be borrowed for the log entry.
+    memcpy(global_run_data.request.id, job->request_id, sizeof(job->request_id));
+    sds fields[] = {
+      sdscatfmt(sdsempty(), "HANDLER_USEC=%U", (uint64_t)(job->seconds * 1e6)),
+      sdscatfmt(sdsempty(), "EXIT_STATUS=%i", job->status),
+    };
+    log_fields(LOG_DEBUG, sdscatfmt(sdsempty(), "Served uprocctl %i in-process.",
+                                    (int)job->pid), fields, 2);
+    global_run_data.request.id[0] = '\0';
+    if (rc < 0) {
+      FAIL("WARNING: Replying to a served request failed: %s", strerror(-rc));
+      uprocd_metric_counter_add(g_stats.reply_failures, 1);
+    }
+
+    sd_bus_message_unref(job->msg);
+    uprocd_context_free(job->ctx);
+    free(job);
+    g_serve.in_flight--;
+  }
+}
+
+// Like bus_pump, but also wakes up for finished requests.
+static int serve_pump(bus_data *data) {
+  sd_bus *bus = bus_get(data);
+  int rc;
+
+  do {
+    rc = sd_bus_process(bus, NULL);
+  } while (rc > 0);
+  if (rc < 0) {
+    FAIL("sd_bus_process failed: %s", strerror(-rc));
+    return -1;
+  }
+
+  uint64_t until;
+  int timeout = -1;
+  if (sd_bus_get_timeout(bus, &until) >= 0 && until != (uint64_t)-1) {
+    uint64_t now = monotonic_usec();
+    timeout = until > now ? (until - now + 999) / 1000 : 0;
+  }
+
+  struct pollfd pfds[2] = {
+    { .fd = sd_bus_get_fd(bus), .events = sd_bus_get_events(bus) },
+    { .fd = g_serve.done[0], .events = POLLIN },
+  };
+  if (poll(pfds, 2, timeout) == -1 && errno != EINTR) {
+    FAIL("poll failed: %s", strerror(errno));
+    return -1;
+  }
+
+  finish_jobs();
+  stats_flush();
+  return 0;
+}
+
+static void stop_workers(pthread_t *workers, int nworkers) {
+  pthread_mutex_lock(&g_serve.lock);
+  g_serve.stopping = 1;
+  pthread_cond_broadcast(&g_serve.cond);
+  pthread_mutex_unlock(&g_serve.lock);
+
+  for (int i = 0; i < nworkers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+}
+
+UPROCD_EXPORT int uprocd_serve(uprocd_request_handler handler, void *userdata) {
+  bus_data *data = NULL;
+  int nworkers = 0, max = global_run_data.serve_max_requests;
+  pthread_t *workers = newa(pthread_t, global_run_data.serve_workers);
+  g_serve.done[0] = g_serve.done[1] = -1;
+  sigset_t all, saved_mask;
+  struct sigaction dfl = { .sa_handler = SIG_DFL }, saved_chld;
+
+  // A served template has no children of its own, so anything that exits belongs to
+  // a handler (system(), popen, subprocess), which has to be able to wait on it.
+  sigaction(SIGCHLD, &dfl, &saved_chld);
+
+  if (global_run_data.router_fd != -1) {
+    FAIL("uprocd_serve can't be used together with KeyBy.");
+    goto failure;
+  }
+
+  g_serve.handler = handler;
+  g_serve.userdata = userdata;
+  if (global_run_data.serve_workers == 1) {
+    log_save_stderr();
+  }
+  // Only the bus thread's end is non-blocking, so a worker's write is never dropped.
+  if (pipe2(g_serve.done, O_CLOEXEC) == -1 ||
+      fcntl(g_serve.done[0], F_SETFL, O_NONBLOCK) == -1) {
+    FAIL("Error creating the worker pipe: %s", strerror(errno));
+    goto failure;
+  }
+
+  // Signals are only handled on the bus thread, since SIGINT's handler jumps back onto
+  // its stack.
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &saved_mask);
+  for (; nworkers < global_run_data.serve_workers; nworkers++) {
+    int rc = pthread_create(&workers[nworkers], NULL, worker_main, NULL);
+    if (rc != 0) {
+      pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+      FAIL("Error starting a worker thread: %s", strerror(rc));
+      goto failure;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+
+  data = bus_new();
+  if (data == NULL) {
+    goto failure;
+  }
+
+  INFO("Serving requests in-process with %i worker(s).", nworkers);
+  global_run_data.serving = 1;
+
+  for (;;) {
+    if (serve_pump(data) < 0) {
+      goto failure;
+    }
+
+    if (max && g_serve.accepted >= max && !global_run_data.draining) {
+      // Let systemd start a fresh template once the requests still in flight finish.
+      // Runs that were already queued on the bus are turned away until then.
+      INFO("Served %i requests, recycling.", g_serve.accepted);
+      global_run_data.draining = 1;
+      bus_release_name(data);
+    }
+
+    if (global_run_data.draining && g_serve.in_flight == 0) {
+      break;
+    }
+  }
+
+  global_run_data.serving = 0;
+  global_run_data.draining = 0;
+
+  stop_workers(workers, nworkers);
+  sigaction(SIGCHLD, &saved_chld, NULL);
+  log_restore_stderr();
+  free(workers);
+  close(g_serve.done[0]);
+  close(g_serve.done[1]);
+  bus_free(data);
+  return 0;
+
+  failure:
+  stop_workers(workers, nworkers);
+  sigaction(SIGCHLD, &saved_chld, NULL);
+  log_restore_stderr();
+  global_run_data.serving = 0;
+  global_run_data.draining = 0;
+  free(workers);
+  for (int i = 0; i < 2; i++) {
+    if (g_serve.done[i] != -1) {
+      close(g_serve.done[i]);
+    }
+  }
+  bus_free(data);
+  if (global_run_data.exit_handler) {
+    uprocd_exit_handler exit_handler = global_run_data.exit_handler;
+    exit_handler(global_run_data.exit_handler_userdata);
+  }
+  longjmp(global_run_data.return_to_main, 1);
+}
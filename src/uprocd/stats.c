@@ -0,0 +1,120 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "private.h"
+#include "uprocd.h"
+
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+// The daemon's own metrics, kept in the same shared region as the module's so that
+// children can report the parts of a spawn only they see.
+
+daemon_stats g_stats;
+
+static double g_last_flush = -1;
+
+double stats_now() {
+  return clock_seconds(CLOCK_MONOTONIC);
+}
+
+void stats_init() {
+  #define COUNTER(field, name) g_stats.field = metric_register(name, METRIC_COUNTER, 1)
+  #define GAUGE(field, name) g_stats.field = metric_register(name, METRIC_GAUGE, 1)
+  #define HISTOGRAM(field, name) \
+    g_stats.field = metric_register(name, METRIC_HISTOGRAM, 1)
+
+  COUNTER(requests, "uprocd_run_requests_total");
+  HISTOGRAM(parse_seconds, "uprocd_run_parse_seconds");
+  HISTOGRAM(fork_seconds, "uprocd_fork_seconds");
+  HISTOGRAM(fork_seconds_per_gib, "uprocd_fork_seconds_per_rss_gib");
+  HISTOGRAM(handshake_seconds, "uprocd_child_handshake_seconds");
+  HISTOGRAM(cgroup_seconds, "uprocd_cgroup_move_seconds");
+  HISTOGRAM(spawn_seconds, "uprocd_spawn_seconds");
+  GAUGE(template_rss, "uprocd_template_rss_bytes");
+  COUNTER(children_started, "uprocd_children_started_total");
+  COUNTER(children_reaped, "uprocd_children_reaped_total");
+  GAUGE(start_time, "uprocd_start_time_seconds");
+
+  COUNTER(parse_failures, "uprocd_parse_failures_total");
+  COUNTER(fork_failures, "uprocd_fork_failures_total");
+  COUNTER(cgroup_failures, "uprocd_cgroup_failures_total");
+  COUNTER(reply_failures, "uprocd_reply_failures_total");
+
+  #undef COUNTER
+  #undef GAUGE
+  #undef HISTOGRAM
+
+  uprocd_metric_gauge_set(g_stats.start_time, clock_seconds(CLOCK_REALTIME));
+}
+
+double stats_stage(struct uprocd_metric *metric, double *stage, double start) {
+  double seconds = stats_now() - start;
+  uprocd_metric_histogram_observe(metric, seconds);
+  *stage = seconds;
+  return seconds;
+}
+
+double stats_sample_rss() {
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp == NULL) {
+    return 0;
+  }
+
+  unsigned long size, resident = 0;
+  if (fscanf(fp, "%lu %lu", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(fp);
+
+  double rss = (double)resident * sysconf(_SC_PAGESIZE);
+  uprocd_metric_gauge_set(g_stats.template_rss, rss);
+  return rss;
+}
+
+void stats_flush() {
+  if (global_run_data.stats_textfile == NULL) {
+    return;
+  }
+
+  // Writing on every request would cost more than the spawn itself on busy templates.
+  double now = stats_now();
+  if (g_last_flush >= 0 && now - g_last_flush < 1) {
+    return;
+  }
+
+  g_last_flush = now;
+  metrics_write_textfile(global_run_data.stats_textfile);
+}
+
+static void add_usec_field(sds *fields, int *nfields, const char *name, double seconds) {
+  if (seconds > 0) {
+    fields[(*nfields)++] = sdscatfmt(sdsempty(), "%s_USEC=%U", name,
+                                     (uint64_t)(seconds * 1e6));
+  }
+}
+
+// Logs the stage durations of the current request, then forgets it.
+void stats_finish_request(int64_t child) {
+  request_trace *req = &global_run_data.request;
+  if (req->start > 0) {
+    uprocd_metric_histogram_observe(g_stats.spawn_seconds, stats_now() - req->start);
+  }
+
+  sds fields[8];
+  int nfields = 0;
+  fields[nfields++] = sdscatfmt(sdsempty(), "CHILD_PID=%I", child);
+  add_usec_field(fields, &nfields, "PARSE", req->parse);
+  add_usec_field(fields, &nfields, "FORK", req->fork);
+  add_usec_field(fields, &nfields, "HANDSHAKE", req->handshake);
+  add_usec_field(fields, &nfields, "CGROUP", req->cgroup);
+  add_usec_field(fields, &nfields, "SPAWN", req->start > 0 ? stats_now() - req->start : 0);
+
+  log_fields(LOG_DEBUG, sdscatfmt(sdsempty(), "Spawned %I for uprocctl %I.", child,
+                                  req->pid), fields, nfields);
+
+  memset(req, 0, sizeof(*req));
+  stats_flush();
+}